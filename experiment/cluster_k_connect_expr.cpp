@@ -2,8 +2,11 @@
 #include <graph_distrib_update.h>
 #include <math.h>
 #include <work_distributor.h>
+#include <memory_report.h>
+#include <mpi.h>
 
 #include "simple_stream.h"
+#include "stream_replayer.h"
 
 #include <atomic>
 #include <iostream>
@@ -17,14 +20,25 @@ static double get_max_mem_used() {
   return (double) data.ru_maxrss / 1024.0;
 }
 
+// print the predicted memory of the cluster before the graph is constructed
+static void print_memory_plan(node_id_t num_nodes, node_id_t num_forests) {
+  int num_processes;
+  MPI_Comm_size(MPI_COMM_WORLD, &num_processes);
+  int num_workers = num_processes - WorkerCluster::distrib_worker_offset;
+  std::cout << "Predicted memory usage" << std::endl;
+  GraphDistribUpdate::plan_memory(num_nodes, num_forests, num_workers).print(std::cout);
+}
+
 int main(int argc, char** argv) {
   GraphDistribUpdate::setup_cluster(argc, argv);
+  StreamReplayer::Options replay = StreamReplayer::parse_args(argc, argv);
 
   if (argc != 7) {
     std::cerr << "Incorrect number of arguments. "
                  "Expected six but got "
               << argc - 1 << std::endl;
-    std::cerr << "Arguments are: insert_threads, num_forests, format" << std::endl;
+    std::cerr << "Arguments are: insert_threads, num_forests, format, "
+              << StreamReplayer::usage() << std::endl;
     std::cerr << "Format='file' args are:  repeats, input_stream, output_file" << std::endl;
     std::cerr << "Format='erdos' args are: vertices, edges, output_file" << std::endl;
     exit(EXIT_FAILURE);
@@ -65,7 +79,9 @@ int main(int argc, char** argv) {
     std::cout << "Processing stream" << std::endl;
     std::cout << "Vertices = " << num_nodes << std::endl;
     std::cout << "Edges    = " << m << std::endl;
+    print_memory_plan(num_nodes, num_forests);
     GraphDistribUpdate g{num_nodes, inserter_threads, num_forests};
+    StreamReplayer replayer(replay, inserter_threads);
 
     std::vector<std::thread> threads;
     threads.reserve(inserter_threads);
@@ -76,11 +92,13 @@ int main(int argc, char** argv) {
       while (true) {
         upd = reader.get_edge();
         if (upd.type == BREAKPOINT) break;
+        replayer.wait(thr_id);
         g.update(upd, thr_id);
       }
     };
 
     auto start = std::chrono::steady_clock::now();
+    replayer.start();
 
     for (int r = 0; r < repeats; r++) {
       // start inserters
@@ -94,8 +112,10 @@ int main(int argc, char** argv) {
       stream.stream_reset();
       threads.clear();
     }
+    replayer.report(std::cout);
     std::cout << "Starting CC" << std::endl;
     std::vector<std::set<node_id_t>> sf_adj = g.k_spanning_forests(num_forests);
+    g.memory_report().print(std::cout);
 
     std::chrono::duration<double> runtime = g.flush_end - start;
     std::chrono::duration<double> CC_time = g.cc_alg_end - g.cc_alg_start;
@@ -135,7 +155,9 @@ int main(int argc, char** argv) {
 
     SimpleStream stream(time(nullptr), num_nodes);
     stream.set_break_point(num_edges);
+    print_memory_plan(num_nodes, num_forests);
     GraphDistribUpdate g{num_nodes, inserter_threads, num_forests};
+    StreamReplayer replayer(replay, inserter_threads);
 
     std::vector<std::thread> threads;
     threads.reserve(inserter_threads);
@@ -145,6 +167,7 @@ int main(int argc, char** argv) {
       bool running = true;
       while (running) {
         size_t num_upds = stream.get_update_buffer(upds, 256);
+        replayer.wait(thr_id, num_upds);
         for (size_t i = 0; i < num_upds; i++) {
           GraphStreamUpdate upd = upds[i];
           if (upd.type == BREAKPOINT) {
@@ -160,6 +183,7 @@ int main(int argc, char** argv) {
     };
 
     auto start = std::chrono::steady_clock::now();
+    replayer.start();
 
     // start inserters
     for (int t = 0; t < inserter_threads; t++) {
@@ -171,8 +195,10 @@ int main(int argc, char** argv) {
     }
     threads.clear();
 
+    replayer.report(std::cout);
     std::cout << "Starting CC" << std::endl;
     std::vector<std::set<node_id_t>> sf_adj = g.k_spanning_forests(num_forests);
+    g.memory_report().print(std::cout);
 
     std::chrono::duration<double> runtime = g.flush_end - start;
     std::chrono::duration<double> CC_time = g.cc_alg_end - g.cc_alg_start;
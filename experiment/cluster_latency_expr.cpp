@@ -0,0 +1,231 @@
+#include <binary_graph_stream.h>
+#include <graph_distrib_update.h>
+
+#include "stream_replayer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Measures how soon an inserted edge is reflected in a query. The stream is ingested at a
+ * fixed rate regardless of how fast Landscape processes it (open loop). Meanwhile marker edges
+ * joining pairs of vertices that are otherwise isolated are inserted at a fixed interval and
+ * point queries for every invisible marker are issued at another. The latency of a marker is
+ * the time from its insertion until the query that first reports its endpoints as connected
+ * returns. It is broken into the time the marker waited in the gutters for a query to begin,
+ * the flush of the gutters and workers, and Boruvka. Markers first reported by a query that
+ * found the DSU valid, and so neither flushed nor ran Boruvka, are reported separately.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+// A marker edge and, once visible, its latency in seconds
+struct Marker {
+  Clock::time_point inserted;
+  double latency = 0;
+  double gutter = 0;
+  double flush = 0;
+  double boruvka = 0;
+  bool fast_path = false; // first reported by a query answered from a valid DSU
+};
+
+static double percentile(std::vector<double> values, double p) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1, (size_t) (p * values.size()))];
+}
+
+static double seconds(Clock::duration d) { return std::chrono::duration<double>(d).count(); }
+
+int main(int argc, char** argv) {
+  GraphDistribUpdate::setup_cluster(argc, argv);
+
+  if (argc != 7) {
+    std::cerr << "Incorrect number of arguments. "
+                 "Expected six but got "
+              << argc - 1 << std::endl;
+    std::cerr << "Arguments are: insert_threads, rate, query_interval, marker_interval, "
+                 "input_stream, output_file" << std::endl;
+    std::cerr << "insert_threads:  number of threads inserting to guttering system" << std::endl;
+    std::cerr << "rate:            updates per second to insert. 0 inserts as fast as possible"
+              << std::endl;
+    std::cerr << "query_interval:  milliseconds between queries" << std::endl;
+    std::cerr << "marker_interval: milliseconds between marker edges" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  int inserter_threads = std::atoi(argv[1]);
+  if (inserter_threads < 1 || inserter_threads > 50) {
+    std::cerr << "Number of inserter threads is invalid. Require in [1, 50]" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  double rate = std::atof(argv[2]);
+  int query_interval = std::atoi(argv[3]);
+  int marker_interval = std::atoi(argv[4]);
+  if (rate < 0 || query_interval < 1 || marker_interval < 1) {
+    std::cerr << "Rate must be non-negative and intervals at least 1 millisecond" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string input = argv[5];
+  std::string output = argv[6];
+
+  BinaryGraphStream_MT stream(input, 32 * 1024);
+  node_id_t stream_nodes = stream.nodes();
+  edge_id_t num_updates = stream.edges();
+
+  // each marker joins two vertices that follow those of the stream
+  size_t max_markers = 1024;
+  if (rate > 0) max_markers = num_updates / rate * 1000 / marker_interval + 1;
+  node_id_t num_nodes = stream_nodes + 2 * max_markers;
+
+  std::cout << "Processing stream at "
+            << (rate > 0 ? std::to_string((uint64_t) rate) : "unlimited") << " updates/sec"
+            << std::endl;
+  std::cout << "Vertices = " << stream_nodes << " + " << 2 * max_markers << " marker vertices"
+            << std::endl;
+  std::cout << "Edges    = " << num_updates << std::endl;
+
+  std::vector<Marker> markers;
+  markers.reserve(max_markers);
+  double achieved_rate;
+  uint64_t deficit;
+  size_t num_queries = 0;
+  {
+    // the marker thread inserts with the last thread id
+    GraphDistribUpdate g{num_nodes, inserter_threads + 1};
+
+    std::mutex marker_lock;
+    std::vector<size_t> invisible; // markers not yet reported as connected
+    std::atomic<bool> ingesting;
+    ingesting = true;
+    StreamReplayer::Options replay;
+    replay.rate = rate;
+    StreamReplayer replayer(replay, inserter_threads);
+
+    auto start = Clock::now();
+    replayer.start();
+
+    auto insert_task = [&](const int thr_id) {
+      MT_StreamReader reader(stream);
+      while (true) {
+        GraphUpdate upd = reader.get_edge();
+        if (upd.type == BREAKPOINT) break;
+        if (!replayer.try_acquire(thr_id)) replayer.wait(thr_id);
+        g.update(upd, thr_id);
+      }
+    };
+
+    auto marker_task = [&]() {
+      for (size_t i = 0; i < max_markers; i++) {
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(marker_interval * (i + 1)));
+        if (!ingesting) return;
+
+        node_id_t a = stream_nodes + 2 * i;
+        {
+          std::lock_guard<std::mutex> lk(marker_lock);
+          markers.emplace_back();
+          markers.back().inserted = Clock::now();
+          invisible.push_back(i);
+        }
+        g.update({{a, a + 1}, INSERT}, inserter_threads);
+      }
+    };
+
+    auto query_task = [&]() {
+      for (size_t q = 1; ; q++) {
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(query_interval * q));
+        bool last = !ingesting;
+
+        std::vector<std::pair<node_id_t, node_id_t>> pairs;
+        std::unique_lock<std::mutex> lk(marker_lock);
+        std::vector<size_t> queried = invisible;
+        lk.unlock();
+        for (size_t i : queried) pairs.push_back({stream_nodes + 2 * i, stream_nodes + 2 * i + 1});
+        std::vector<bool> connected = g.point_to_point_queries(pairs);
+        auto done = Clock::now();
+        bool fast_path = g.dsu_fast_path;
+        ++num_queries;
+
+        lk.lock();
+        invisible.clear();
+        for (size_t j = 0; j < queried.size(); j++) {
+          Marker &marker = markers[queried[j]];
+          if (!connected[j]) {
+            invisible.push_back(queried[j]);
+            continue;
+          }
+          marker.latency = seconds(done - marker.inserted);
+          marker.fast_path = fast_path;
+          if (fast_path) continue; // there was no flush or Boruvka to attribute time to
+          marker.gutter  = seconds(std::max(g.flush_start, marker.inserted) - marker.inserted);
+          marker.flush   = seconds(g.flush_end - g.flush_start);
+          marker.boruvka = seconds(g.cc_alg_end - g.cc_alg_start);
+        }
+        lk.unlock();
+        if (last) return;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < inserter_threads; t++) threads.emplace_back(insert_task, t);
+    std::thread marker_thr(marker_task);
+    std::thread query_thr(query_task);
+
+    for (auto &thr : threads) thr.join();
+    achieved_rate = num_updates / seconds(Clock::now() - start);
+    deficit = replayer.deficit();
+    replayer.report(std::cout);
+    ingesting = false;
+    marker_thr.join();
+    query_thr.join(); // the final query follows the end of ingestion
+  }
+
+  // summarize the visible markers, those seen by a fast path query apart from the others
+  std::vector<double> latency, gutter, flush, boruvka, fast_path;
+  for (auto &marker : markers) {
+    if (marker.latency == 0) continue;
+    if (marker.fast_path) {
+      fast_path.push_back(marker.latency);
+      continue;
+    }
+    latency.push_back(marker.latency);
+    gutter.push_back(marker.gutter);
+    flush.push_back(marker.flush);
+    boruvka.push_back(marker.boruvka);
+  }
+  size_t num_invisible = markers.size() - latency.size() - fast_path.size();
+
+  std::cout << "Ingested at " << achieved_rate << " updates/sec, " << deficit
+            << " updates behind schedule" << std::endl;
+  std::cout << "Performed " << num_queries << " queries, " << markers.size() << " markers, "
+            << num_invisible << " never visible, " << fast_path.size()
+            << " seen without a flush" << std::endl;
+  std::cout << "Latency (seconds)   p50        p90        p99        max" << std::endl;
+  auto print_dist = [](const std::string &name, const std::vector<double> &values) {
+    std::cout << name << percentile(values, 0.5) << "  " << percentile(values, 0.9) << "  "
+              << percentile(values, 0.99) << "  " << percentile(values, 1) << std::endl;
+  };
+  std::cout << std::fixed << std::setprecision(6);
+  print_dist("Visibility          ", latency);
+  print_dist("  Gutters           ", gutter);
+  print_dist("  Flush             ", flush);
+  print_dist("  Boruvka           ", boruvka);
+  print_dist("Seen from DSU       ", fast_path);
+
+  std::ofstream out{output, std::ios_base::out | std::ios_base::app};
+  out << std::fixed << rate << ", " << achieved_rate << ", " << deficit << ", " << markers.size()
+      << ", " << num_invisible << ", " << percentile(latency, 0.5) << ", "
+      << percentile(latency, 0.9) << ", " << percentile(latency, 0.99) << ", "
+      << percentile(latency, 1) << ", " << percentile(gutter, 0.5) << ", "
+      << percentile(flush, 0.5) << ", " << percentile(boruvka, 0.5) << ", " << fast_path.size()
+      << ", " << percentile(fast_path, 0.5) << std::endl;
+
+  GraphDistribUpdate::teardown_cluster();
+}
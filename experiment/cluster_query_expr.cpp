@@ -2,6 +2,8 @@
 #include <binary_graph_stream.h>
 #include <work_distributor.h>
 
+#include "stream_replayer.h"
+
 #include <string>
 #include <iostream>
 #include <unordered_map>
@@ -9,6 +11,7 @@
 
 int main(int argc, char **argv) {
   GraphDistribUpdate::setup_cluster(argc, argv);
+  StreamReplayer::Options replay = StreamReplayer::parse_args(argc, argv);
   {
     int inserter_threads;
     int num_queries;
@@ -104,7 +107,8 @@ int main(int argc, char **argv) {
 
     const auto print_usage = [&]() {
       std::cout << "Arguments are: insert_threads, num_queries, input_stream, output_file, ";
-      std::cout << "[--point], [--repeat <num_repeats>], [--burst <num_grouped> <ins_btwn_qry>]" << std::endl;
+      std::cout << "[--point], [--repeat <num_repeats>], [--burst <num_grouped> <ins_btwn_qry>], ";
+      std::cout << StreamReplayer::usage() << std::endl;
       std::cout << "insert_threads:  number of threads inserting to guttering system" << std::endl;
       std::cout << "num_queries:     number of queries to issue during the stream." << std::endl;
       std::cout << "input_stream:    the binary stream to ingest." << std::endl;
@@ -115,6 +119,8 @@ int main(int argc, char **argv) {
       std::cout << "--burst <num_grouped> <ins_btwn_qry>: [OPTIONAL] if present then queries should be bursty" << std::endl;
       std::cout << "  num_grouped:   specifies how many queries should be grouped together" << std::endl;
       std::cout << "  ins_btwn_qry:  specifies the number of insertions to perform between each query" << std::endl;
+      std::cout << "--rate <updates/sec>: [OPTIONAL] if present then insert at this rate rather than as fast as possible" << std::endl;
+      std::cout << "--trace <replay_trace>: [OPTIONAL] if present then insert at the times of a trace, see stream_replayer.h" << std::endl;
     };
 
     for (int i = 1; i < argc; ++i) {
@@ -164,6 +170,7 @@ int main(int argc, char **argv) {
     std::cout << "Edges    = " << num_updates << std::endl;
 
     GraphDistribUpdate g{num_nodes, inserter_threads};
+    StreamReplayer replayer(replay, inserter_threads);
 
     std::vector<std::thread> threads;
     threads.reserve(inserter_threads);
@@ -324,14 +331,17 @@ int main(int argc, char **argv) {
             q_done_cond.notify_all();
           }
         }
-        else if (upd.type == INSERT || upd.type == DELETE)
+        else if (upd.type == INSERT || upd.type == DELETE) {
+          replayer.wait(thr_id);
           g.update(upd, thr_id);
+        }
         else
           throw std::invalid_argument("Did not recognize edge code!");
       }
     };
 
     auto start = std::chrono::steady_clock::now();
+    replayer.start();
 
     for (int r = 0; r < repeats; r++) {
       // start inserters
@@ -358,6 +368,8 @@ int main(int argc, char **argv) {
       }
     }
 
+    replayer.report(std::cout);
+
     // perform final query
     auto cc_start = std::chrono::steady_clock::now();
     size_t num_CC;
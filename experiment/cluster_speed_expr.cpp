@@ -4,6 +4,7 @@
 #include <work_distributor.h>
 
 #include "simple_stream.h"
+#include "stream_replayer.h"
 
 #include <atomic>
 #include <iostream>
@@ -11,12 +12,13 @@
 
 int main(int argc, char** argv) {
   GraphDistribUpdate::setup_cluster(argc, argv);
+  StreamReplayer::Options replay = StreamReplayer::parse_args(argc, argv);
 
   if (argc != 6) {
     std::cerr << "Incorrect number of arguments. "
                  "Expected five but got "
               << argc - 1 << std::endl;
-    std::cerr << "Arguments are: insert_threads, format" << std::endl;
+    std::cerr << "Arguments are: insert_threads, format, " << StreamReplayer::usage() << std::endl;
     std::cerr << "Format='file' args are:  repeats, input_stream, output_file" << std::endl;
     std::cerr << "Format='erdos' args are: vertices, edges, output_file" << std::endl;
     exit(EXIT_FAILURE);
@@ -52,6 +54,7 @@ int main(int argc, char** argv) {
     std::cout << "Vertices = " << num_nodes << std::endl;
     std::cout << "Edges    = " << m << std::endl;
     GraphDistribUpdate g{num_nodes, inserter_threads};
+    StreamReplayer replayer(replay, inserter_threads);
 
     std::vector<std::thread> threads;
     threads.reserve(inserter_threads);
@@ -62,11 +65,13 @@ int main(int argc, char** argv) {
       while (true) {
         upd = reader.get_edge();
         if (upd.type == BREAKPOINT) break;
+        replayer.wait(thr_id);
         g.update(upd, thr_id);
       }
     };
 
     auto start = std::chrono::steady_clock::now();
+    replayer.start();
 
     for (int r = 0; r < repeats; r++) {
       // start inserters
@@ -81,6 +86,7 @@ int main(int argc, char** argv) {
       threads.clear();
     }
 
+    replayer.report(std::cout);
     std::cout << "Starting CC" << std::endl;
     uint64_t num_CC = g.get_connected_components().size();
 
@@ -116,6 +122,7 @@ int main(int argc, char** argv) {
     SimpleStream stream(time(nullptr), num_vertices);
     stream.set_break_point(num_edges);
     GraphDistribUpdate g{num_vertices, inserter_threads};
+    StreamReplayer replayer(replay, inserter_threads);
 
     std::vector<std::thread> threads;
     threads.reserve(inserter_threads);
@@ -125,6 +132,7 @@ int main(int argc, char** argv) {
       bool running = true;
       while (running) {
         size_t num_upds = stream.get_update_buffer(upds, 256);
+        replayer.wait(thr_id, num_upds);
         for (size_t i = 0; i < num_upds; i++) {
           GraphStreamUpdate upd = upds[i];
           if (upd.type == BREAKPOINT) {
@@ -140,6 +148,7 @@ int main(int argc, char** argv) {
     };
 
     auto start = std::chrono::steady_clock::now();
+    replayer.start();
 
     // start inserters
     for (int t = 0; t < inserter_threads; t++) {
@@ -151,6 +160,7 @@ int main(int argc, char** argv) {
     }
     threads.clear();
 
+    replayer.report(std::cout);
     std::cout << "Starting CC" << std::endl;
     uint64_t num_CC = g.get_connected_components().size();
 
@@ -1,30 +1,481 @@
 #include <mpi.h>
-#include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
 constexpr size_t MB = 1024 * 1024;
 
 /*
- * This code is designed to test the speed of MPI in a variety of contexts
- * Ideas for parameters:
- * 1. Number of threads sending (num recv determined by -np)
- * 2. Thread support level
- * 3. Probe before Recv or not
- * 4. Ssend vs Send vs Issend vs Isend
- * 5. Message size
- * 6. Number of messages
- * 7. Random vs identical messages
- * 8. Prepopulate messages or generate on the fly
- * 9. Recievers send ACK or messages of their own
+ * This code is designed to test the speed of MPI in a variety of contexts so that the transport
+ * settings of Landscape may be chosen for a given cluster shape.
+ *
+ * Patterns:
+ *   p2p:       the threads of rank 0 send messages round robin to every other rank, which
+ *              reply to the sending thread.
+ *   landscape: the traffic of Landscape. The threads of rank 0 (main) send batch messages to
+ *              the batch forwarders which fan them out to their workers. Workers reply with a
+ *              delta message to their delta forwarder which passes it back to main. Processes
+ *              are laid out as in WorkerCluster.
+ *
+ * Every option accepts a comma separated list and every combination of them is measured.
+ *   threads    Number of threads of rank 0 sending messages
+ *   recv       'recv' or 'probe': Probe for the size of a message before the Recv
+ *   send       'send', 'ssend', 'isend', or 'issend': How every data message is sent
+ *   size       Bytes of the messages sent by rank 0
+ *   reply      Bytes of the replies. 4 is an ACK, larger are messages of their own (deltas)
+ *   window     Messages a sending thread may have awaiting a reply. Also the number of
+ *              buffers each process cycles through when sending with isend/issend
+ *   data       'identical': the same message each time, 'prepopulated': copied from a pool of
+ *              random messages, 'generated': random data generated for each message
+ *   messages   Number of messages sent by each thread of rank 0
+ *   repeats    Number of times each combination is measured (not a list)
+ *   level      The MPI thread support level: 'single', 'funneled', 'serialized', or
+ *              'multiple'. Fixed for the run as MPI may only be initialized once (not a list)
+ *   forwarders Number of batch forwarders of the landscape pattern (not a list)
+ *
+ * One CSV row is appended to the output file for every measurement. Throughput counts the
+ * bytes sent by rank 0.
  */
 
+constexpr int stop_tag = 32000; // data messages are tagged with the id of the sending thread
+
+enum SendMode { SEND, SSEND, ISEND, ISSEND };
+enum DataMode { IDENTICAL, PREPOPULATED, GENERATED };
+
+static const std::map<std::string, SendMode> send_modes = {
+  {"send", SEND}, {"ssend", SSEND}, {"isend", ISEND}, {"issend", ISSEND}};
+static const std::map<std::string, DataMode> data_modes = {
+  {"identical", IDENTICAL}, {"prepopulated", PREPOPULATED}, {"generated", GENERATED}};
+static const std::map<std::string, int> thread_levels = {
+  {"single", MPI_THREAD_SINGLE}, {"funneled", MPI_THREAD_FUNNELED},
+  {"serialized", MPI_THREAD_SERIALIZED}, {"multiple", MPI_THREAD_MULTIPLE}};
+
+// the options that may be swept and their defaults
+static const std::vector<std::pair<std::string, std::string>> sweep_options = {
+  {"threads", "1"}, {"recv", "recv"}, {"send", "send"}, {"size", "100"}, {"reply", "4"},
+  {"window", "1"}, {"data", "identical"}, {"messages", "100000"}};
+
+struct Config {
+  std::map<std::string, std::string> values; // the option values of this combination
+  int threads;
+  bool probe;
+  SendMode send;
+  int size;
+  int reply;
+  int window;
+  DataMode data;
+  size_t messages;
+};
+
+/*
+ * The MPI calls made by a process. Under MPI_THREAD_SERIALIZED the threads of rank 0 take turns
+ * calling MPI, so blocking calls are replaced by their nonblocking forms polled under a lock.
+ */
+struct Comm {
+  SendMode mode;
+  bool serialized;
+  std::mutex lock;
+
+  Comm(SendMode mode, bool serialized) : mode(mode), serialized(serialized) {}
+
+  std::unique_lock<std::mutex> guard() {
+    return serialized ? std::unique_lock<std::mutex>(lock) : std::unique_lock<std::mutex>();
+  }
+
+  bool test(MPI_Request &req, MPI_Status *status = MPI_STATUS_IGNORE) {
+    auto lk = guard();
+    int flag;
+    MPI_Test(&req, &flag, status);
+    return flag;
+  }
+
+  void wait(MPI_Request &req, MPI_Status *status = MPI_STATUS_IGNORE) {
+    if (!serialized)
+      MPI_Wait(&req, status);
+    else
+      while (!test(req, status));
+  }
+
+  // send a message with the send mode. The request completes when the buffer may be reused
+  void send(char *buf, int bytes, int dest, int tag, MPI_Request &req) {
+    bool blocking = mode == SEND || mode == SSEND;
+    req = MPI_REQUEST_NULL;
+    if (blocking && !serialized) {
+      if (mode == SEND) MPI_Send(buf, bytes, MPI_CHAR, dest, tag, MPI_COMM_WORLD);
+      else              MPI_Ssend(buf, bytes, MPI_CHAR, dest, tag, MPI_COMM_WORLD);
+      return;
+    }
+    {
+      auto lk = guard();
+      if (mode == SEND || mode == ISEND)
+        MPI_Isend(buf, bytes, MPI_CHAR, dest, tag, MPI_COMM_WORLD, &req);
+      else
+        MPI_Issend(buf, bytes, MPI_CHAR, dest, tag, MPI_COMM_WORLD, &req);
+    }
+    if (blocking) wait(req);
+  }
+
+  // receive a message with the tag from any source. Returns the size of the message
+  int recv(char *buf, int max_bytes, int tag, bool probe, MPI_Status &status) {
+    if (probe) {
+      if (!serialized) {
+        MPI_Probe(MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &status);
+        int bytes;
+        MPI_Get_count(&status, MPI_CHAR, &bytes);
+        MPI_Recv(buf, bytes, MPI_CHAR, status.MPI_SOURCE, status.MPI_TAG, MPI_COMM_WORLD, &status);
+      } else {
+        int flag = 0;
+        while (!flag) {
+          auto lk = guard();
+          MPI_Iprobe(MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &flag, &status);
+          if (flag)
+            MPI_Recv(buf, max_bytes, MPI_CHAR, status.MPI_SOURCE, status.MPI_TAG, MPI_COMM_WORLD,
+                     &status);
+        }
+      }
+    } else {
+      if (!serialized) {
+        MPI_Recv(buf, max_bytes, MPI_CHAR, MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &status);
+      } else {
+        MPI_Request req;
+        {
+          auto lk = guard();
+          MPI_Irecv(buf, max_bytes, MPI_CHAR, MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &req);
+        }
+        wait(req, &status);
+      }
+    }
+    int bytes;
+    MPI_Get_count(&status, MPI_CHAR, &bytes);
+    return bytes;
+  }
+};
+
+// Produces the contents of the messages according to the data mode
+class MessageSource {
+  DataMode mode;
+  std::vector<std::vector<char>> pool;
+  size_t next = 0;
+  uint64_t state;
+
+  uint64_t rand() { // xorshift64
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  void generate(char *buf, int bytes) {
+    int i = 0;
+    for (; i + (int) sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+      uint64_t word = rand();
+      memcpy(buf + i, &word, sizeof(word));
+    }
+    for (; i < bytes; i++) buf[i] = rand();
+  }
+
+ public:
+  static constexpr size_t pool_size = 64;
+
+  MessageSource(DataMode mode, int bytes, uint64_t seed) : mode(mode), state(seed * 2654435761 + 1) {
+    if (mode == PREPOPULATED) {
+      pool.assign(pool_size, std::vector<char>(bytes));
+      for (auto &msg : pool) generate(msg.data(), bytes);
+    }
+  }
+
+  // write the next message to buf. Identical messages are left as they were initialized
+  void fill(char *buf, int bytes) {
+    if (mode == PREPOPULATED) {
+      memcpy(buf, pool[next].data(), bytes);
+      next = (next + 1) % pool_size;
+    } else if (mode == GENERATED) {
+      generate(buf, bytes);
+    }
+  }
+};
+
+// A ring of message buffers, each with the request of the last message sent from it
+class Sender {
+  Comm &comm;
+  std::vector<std::vector<char>> bufs;
+  std::vector<MPI_Request> reqs;
+  size_t cur = 0;
+
+ public:
+  Sender(Comm &comm, int window, int max_bytes)
+   : comm(comm), bufs(comm.mode == ISEND || comm.mode == ISSEND ? window : 1) {
+    reqs.assign(bufs.size(), MPI_REQUEST_NULL);
+    for (auto &buf : bufs) {
+      buf.resize(std::max(max_bytes, 1));
+      for (size_t i = 0; i < buf.size(); i++) buf[i] = i % 93 + 33;
+    }
+  }
+
+  // is the next buffer free?
+  bool ready() { return comm.test(reqs[cur]); }
+
+  // the next buffer, once it is free
+  char *buffer() {
+    comm.wait(reqs[cur]);
+    return bufs[cur].data();
+  }
+
+  // send the next buffer
+  void send(int bytes, int dest, int tag) {
+    comm.send(bufs[cur].data(), bytes, dest, tag, reqs[cur]);
+    cur = (cur + 1) % bufs.size();
+  }
+
+  void flush() {
+    for (auto &req : reqs) comm.wait(req);
+  }
+};
+
+// The processes of the landscape pattern, laid out as by WorkerCluster
+struct Layout {
+  int forwarders;
+  int workers;
+
+  void forwarder_workers(int fid, int &first, int &last) const {
+    first = ceil((fid-1) * (double)workers / forwarders);
+    last = ceil(fid * (double)workers / forwarders);
+
+    // Edge case for when workers < forwarders
+    if (workers < forwarders) {
+      first = fid-1;
+      last = fid-1 < workers ? fid : fid-1;
+    }
+  }
+  int forwarder_of_worker(int worker) const {
+    for (int fid = 1; fid <= forwarders; fid++) {
+      int first, last;
+      forwarder_workers(fid, first, last);
+      if (worker >= first && worker < last) return fid;
+    }
+    return -1;
+  }
+  int delta_forwarder(int fid) const { return fid + forwarders; }
+  int worker_rank(int worker) const { return 2 * forwarders + 1 + worker; }
+};
+
+/*
+ * A sending thread of rank 0. Sends its messages round robin to dests, keeping at most window
+ * messages awaiting a reply. Replies are recieved while waiting for a buffer so that every
+ * process can always make progress.
+ */
+static void send_messages(Comm &comm, const Config &cfg, int tid, const std::vector<int> &dests) {
+  Sender sender(comm, cfg.window, cfg.size);
+  MessageSource source(cfg.data, cfg.size, tid + 1);
+  std::vector<char> reply(std::max(cfg.reply, 1));
+
+  size_t sent = 0;
+  size_t received = 0;
+  auto recv_reply = [&]() {
+    MPI_Status status;
+    comm.recv(reply.data(), reply.size(), tid, cfg.probe, status);
+    ++received;
+  };
+
+  while (sent < cfg.messages) {
+    size_t outstanding = sent - received;
+    if (outstanding >= (size_t) cfg.window || (outstanding > 0 && !sender.ready())) {
+      recv_reply();
+      continue;
+    }
+    char *buf = sender.buffer();
+    source.fill(buf, cfg.size);
+    sender.send(cfg.size, dests[(tid + sent * cfg.threads) % dests.size()], tid);
+    ++sent;
+  }
+  while (received < sent) recv_reply();
+  sender.flush();
+}
+
+// p2p: reply to every message until stopped by rank 0
+static void p2p_receiver(Comm &comm, const Config &cfg, int proc_id) {
+  std::vector<char> msg(std::max(cfg.size, 1));
+  Sender sender(comm, cfg.window, cfg.reply);
+  MessageSource source(cfg.data, cfg.reply, proc_id);
+  while (true) {
+    MPI_Status status;
+    comm.recv(msg.data(), msg.size(), MPI_ANY_TAG, cfg.probe, status);
+    if (status.MPI_TAG == stop_tag) break;
+
+    char *buf = sender.buffer();
+    source.fill(buf, cfg.reply);
+    sender.send(cfg.reply, 0, status.MPI_TAG);
+  }
+  sender.flush();
+}
+
+// landscape: forward batch messages to the workers of the forwarder round robin
+static void batch_forwarder(Comm &comm, const Config &cfg, const Layout &layout, int fid) {
+  int first, last;
+  layout.forwarder_workers(fid, first, last);
+  Sender sender(comm, cfg.window, cfg.size);
+  int next = 0;
+  while (true) {
+    char *buf = sender.buffer();
+    MPI_Status status;
+    int bytes = comm.recv(buf, std::max(cfg.size, 1), MPI_ANY_TAG, cfg.probe, status);
+    if (status.MPI_TAG == stop_tag) break;
+
+    sender.send(bytes, layout.worker_rank(first + next), status.MPI_TAG);
+    next = (next + 1) % (last - first);
+  }
+  sender.flush();
+  for (int w = first; w < last; w++)
+    MPI_Send(nullptr, 0, MPI_CHAR, layout.worker_rank(w), stop_tag, MPI_COMM_WORLD);
+}
+
+// landscape: reply to every batch message with a delta message
+static void worker(Comm &comm, const Config &cfg, const Layout &layout, int w) {
+  int delta_forwarder = layout.delta_forwarder(layout.forwarder_of_worker(w));
+  std::vector<char> msg(std::max(cfg.size, 1));
+  Sender sender(comm, cfg.window, cfg.reply);
+  MessageSource source(cfg.data, cfg.reply, layout.worker_rank(w));
+  while (true) {
+    MPI_Status status;
+    comm.recv(msg.data(), msg.size(), MPI_ANY_TAG, cfg.probe, status);
+    if (status.MPI_TAG == stop_tag) break;
+
+    char *buf = sender.buffer();
+    source.fill(buf, cfg.reply);
+    sender.send(cfg.reply, delta_forwarder, status.MPI_TAG);
+  }
+  sender.flush();
+  MPI_Send(nullptr, 0, MPI_CHAR, delta_forwarder, stop_tag, MPI_COMM_WORLD);
+}
+
+// landscape: forward delta messages to main until every worker of the forwarder has stopped
+static void delta_forwarder(Comm &comm, const Config &cfg, const Layout &layout, int fid) {
+  int first, last;
+  layout.forwarder_workers(fid, first, last);
+  Sender sender(comm, cfg.window, cfg.reply);
+  int stopped = 0;
+  while (stopped < last - first) {
+    char *buf = sender.buffer();
+    MPI_Status status;
+    int bytes = comm.recv(buf, std::max(cfg.reply, 1), MPI_ANY_TAG, cfg.probe, status);
+    if (status.MPI_TAG == stop_tag) {
+      ++stopped;
+      continue;
+    }
+    sender.send(bytes, 0, status.MPI_TAG);
+  }
+  sender.flush();
+}
+
+// the reason a configuration cannot be measured, empty if it can
+static std::string invalid_reason(const Config &cfg, int level) {
+  if (cfg.threads > 1 && level < MPI_THREAD_SERIALIZED)
+    return "threads > 1 requires level serialized or multiple";
+  if ((cfg.send == SEND || cfg.send == SSEND) && cfg.window > 1)
+    return "a blocking send requires window = 1 as a sending thread cannot recieve replies";
+  return "";
+}
+
+static void usage() {
+  std::cerr << "Arguments are: pattern, output_file, [option=value[,value...]]..." << std::endl;
+  std::cerr << "pattern is 'p2p' or 'landscape'" << std::endl;
+  std::cerr << "options (defaults) are:";
+  for (auto &opt : sweep_options) std::cerr << " " << opt.first << "=" << opt.second;
+  std::cerr << " repeats=1 level=multiple forwarders=10" << std::endl;
+}
+
 int main(int argc, char **argv) {
-  // TODO: Allow threading mode to be configurable
+  if (argc < 3) {
+    std::cerr << "Incorrect number of arguments. "
+                 "Expected at least two but got " << argc-1 << std::endl;
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  std::string pattern = argv[1];
+  std::string output = argv[2];
+  if (pattern != "p2p" && pattern != "landscape") {
+    std::cerr << "Pattern is not valid! Expect: 'p2p' or 'landscape'" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // parse the options into lists of values
+  std::map<std::string, std::vector<std::string>> options;
+  for (auto &opt : sweep_options) options[opt.first] = {opt.second};
+  options["repeats"] = {"1"};
+  options["level"] = {"multiple"};
+  options["forwarders"] = {"10"};
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos || options.count(arg.substr(0, eq)) == 0) {
+      std::cerr << "Unrecognized option " << arg << std::endl;
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    std::vector<std::string> &values = options[arg.substr(0, eq)];
+    values.clear();
+    for (size_t begin = eq + 1, end; begin <= arg.size(); begin = end + 1) {
+      end = std::min(arg.find(',', begin), arg.size());
+      values.push_back(arg.substr(begin, end - begin));
+    }
+  }
+
+  // build every combination of the options
+  std::vector<Config> configs;
+  std::vector<size_t> idx(sweep_options.size(), 0);
+  try {
+    while (true) {
+      Config cfg;
+      for (size_t o = 0; o < sweep_options.size(); o++)
+        cfg.values[sweep_options[o].first] = options[sweep_options[o].first][idx[o]];
+      cfg.threads  = std::stoi(cfg.values["threads"]);
+      cfg.probe    = cfg.values["recv"] == "probe";
+      cfg.send     = send_modes.at(cfg.values["send"]);
+      cfg.size     = std::stoi(cfg.values["size"]);
+      cfg.reply    = std::stoi(cfg.values["reply"]);
+      cfg.window   = std::stoi(cfg.values["window"]);
+      cfg.data     = data_modes.at(cfg.values["data"]);
+      cfg.messages = std::stoull(cfg.values["messages"]);
+      if ((!cfg.probe && cfg.values["recv"] != "recv") || cfg.threads < 1 ||
+          cfg.threads >= stop_tag || cfg.size < 0 || cfg.reply < 0 || cfg.window < 1)
+        throw std::invalid_argument("option value");
+      configs.push_back(cfg);
+
+      size_t o = 0;
+      for (; o < idx.size() && ++idx[o] == options[sweep_options[o].first].size(); o++)
+        idx[o] = 0;
+      if (o == idx.size()) break;
+    }
+  } catch (std::exception &e) {
+    std::cerr << "Invalid option value" << std::endl;
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  if (thread_levels.count(options["level"][0]) == 0) {
+    std::cerr << "Level is not valid! Expect: 'single', 'funneled', 'serialized', or 'multiple'"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string level_name = options["level"][0];
+  int level = thread_levels.at(level_name);
+  int repeats = std::atoi(options["repeats"][0].c_str());
+
   int provided;
-  MPI_Init_thread(&argc, &argv, MPI_THREAD_SINGLE, &provided);
-  if (provided < MPI_THREAD_SINGLE){
-    std::cout << "ERROR! Could not achieve MPI_THREAD_SINGLE" << std::endl;
+  MPI_Init_thread(&argc, &argv, level, &provided);
+  if (provided < level){
+    std::cout << "ERROR! Could not achieve MPI thread level " << level_name << std::endl;
     exit(EXIT_FAILURE);
   }
   int num_processes = 0;
@@ -32,53 +483,98 @@ int main(int argc, char **argv) {
   if (num_processes < 2) {
     throw std::invalid_argument("number of mpi processes must be at least 2!");
   }
-
-  size_t num_messages  = 1000000;
-  size_t message_bytes = 100;
-  char message[message_bytes];
-
-  size_t ack_bytes = 4;
-
-  // Get MPI Rank
   int proc_id;
   MPI_Comm_rank(MPI_COMM_WORLD, &proc_id);
-  if (proc_id > 0) {
-    // prepare ack buffer
-    char ack[ack_bytes] = "ACK\0";
-
-    for (size_t i = 0; i < num_messages; i++) {
-      // Receive message from sender
-      MPI_Recv(message, message_bytes, MPI_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD, nullptr);
-      
-      // Send ack
-      MPI_Send(ack, ack_bytes, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-    }
 
+  Layout layout;
+  layout.forwarders = std::atoi(options["forwarders"][0].c_str());
+  layout.workers = num_processes - 2 * layout.forwarders - 1;
+  if (pattern == "landscape" && (layout.forwarders < 1 || layout.workers < 1)) {
+    if (proc_id == 0)
+      std::cerr << "The landscape pattern requires at least 2 * forwarders + 2 processes"
+                << std::endl;
     MPI_Finalize();
+    exit(EXIT_FAILURE);
+  }
+
+  // the destinations of the messages of rank 0
+  std::vector<int> dests;
+  if (pattern == "p2p") {
+    for (int p = 1; p < num_processes; p++) dests.push_back(p);
   } else {
-    // prepare message
-    for (size_t i = 0; i < message_bytes; i++) {
-      message[i] = i % 93 + 33;
+    for (int fid = 1; fid <= layout.forwarders; fid++) {
+      int first, last;
+      layout.forwarder_workers(fid, first, last);
+      if (last > first) dests.push_back(fid);
     }
-    message[message_bytes - 1] = 0;
-
-    auto start = std::chrono::steady_clock::now();
-    for (size_t i = 0; i < num_messages; i++) {
-      // prepare buffer for response
-      char ack_buffer[ack_bytes];
+  }
 
-      // send message
-      MPI_Send(message, message_bytes, MPI_CHAR, 1, 0, MPI_COMM_WORLD);
+  std::ofstream out;
+  if (proc_id == 0) {
+    std::ifstream existing(output);
+    bool header = !existing.good() || existing.peek() == std::ifstream::traits_type::eof();
+    out.open(output, std::ios_base::app);
+    if (header) {
+      out << "pattern,processes,level";
+      for (auto &opt : sweep_options) out << "," << opt.first;
+      out << ",repeat,seconds,messages_per_sec,mib_per_sec,us_per_message" << std::endl;
+    }
+  }
 
-      // recv ack message
-      MPI_Recv(ack_buffer, ack_bytes, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, nullptr);
+  for (auto &cfg : configs) {
+    std::string reason = invalid_reason(cfg, level);
+    if (reason != "") {
+      if (proc_id == 0) {
+        std::cerr << "Skipping";
+        for (auto &opt : sweep_options) std::cerr << " " << opt.first << "=" << cfg.values[opt.first];
+        std::cerr << ": " << reason << std::endl;
+      }
+      continue;
     }
 
-    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
-    MPI_Finalize();
-    std::cout << "Total time:          " << time.count() << "(seconds)" << std::endl;
-    std::cout << "Latency per message: " << time.count() / num_messages * 1e9 << "(ns)" << std::endl;
-    std::cout << "Messages per second: " << num_messages / time.count() / 1e6 << "(millions)" << std::endl;
-    std::cout << "Data Throughput:     " << num_messages * message_bytes / time.count() / MB << "(MiB)" << std::endl;
+    for (int r = 0; r < repeats; r++) {
+      Comm comm(cfg.send, proc_id == 0 && level == MPI_THREAD_SERIALIZED);
+      MPI_Barrier(MPI_COMM_WORLD);
+      if (proc_id > 0) {
+        if (pattern == "p2p")
+          p2p_receiver(comm, cfg, proc_id);
+        else if (proc_id <= layout.forwarders)
+          batch_forwarder(comm, cfg, layout, proc_id);
+        else if (proc_id <= 2 * layout.forwarders)
+          delta_forwarder(comm, cfg, layout, proc_id - layout.forwarders);
+        else
+          worker(comm, cfg, layout, proc_id - layout.worker_rank(0));
+        MPI_Barrier(MPI_COMM_WORLD);
+        continue;
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      if (cfg.threads == 1) {
+        send_messages(comm, cfg, 0, dests);
+      } else {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < cfg.threads; t++)
+          threads.emplace_back(send_messages, std::ref(comm), std::cref(cfg), t, std::cref(dests));
+        for (auto &thr : threads) thr.join();
+      }
+      std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+      // stop the other processes
+      int num_stop = pattern == "p2p" ? num_processes - 1 : layout.forwarders;
+      for (int p = 1; p <= num_stop; p++)
+        MPI_Send(nullptr, 0, MPI_CHAR, p, stop_tag, MPI_COMM_WORLD);
+      MPI_Barrier(MPI_COMM_WORLD);
+
+      size_t total = cfg.messages * cfg.threads;
+      std::ostringstream row;
+      row << pattern << "," << num_processes << "," << level_name;
+      for (auto &opt : sweep_options) row << "," << cfg.values[opt.first];
+      row << "," << r << "," << time.count() << "," << total / time.count() << ","
+          << total * cfg.size / time.count() / MB << "," << time.count() / total * 1e6;
+      out << row.str() << std::endl;
+      std::cout << row.str() << std::endl;
+    }
   }
+
+  MPI_Finalize();
 }
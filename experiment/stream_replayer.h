@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * The cumulative number of stream updates that may be inserted by each time since a replay
+ * began. Either a constant rate or a recorded trace, interpolated linearly between its points.
+ */
+class ReplaySchedule {
+ public:
+  static ReplaySchedule constant(double rate) {
+    ReplaySchedule schedule;
+    schedule.times = {0};
+    schedule.updates = {0};
+    schedule.tail_rate = rate;
+    return schedule;
+  }
+
+  /*
+   * Each line of a trace is either '<seconds>', the time of one update, or
+   * '<seconds> <updates>', the time of many. Times are relative to the start of the
+   * trace and in increasing order. Updates after the end of the trace are not paced.
+   */
+  static ReplaySchedule from_trace(const std::string &path) {
+    std::ifstream in(path);
+    if (!in.is_open()) throw std::invalid_argument("Could not open replay trace " + path);
+
+    ReplaySchedule schedule;
+    schedule.times = {0};
+    schedule.updates = {0};
+    schedule.tail_rate = std::numeric_limits<double>::infinity();
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      double time;
+      double count = 1;
+      if (!(fields >> time)) continue;
+      fields >> count;
+      if (time < schedule.times.back())
+        throw std::invalid_argument("Replay trace times must be increasing");
+      if (time == schedule.times.back()) {
+        schedule.updates.back() += count;
+      } else {
+        schedule.times.push_back(time);
+        schedule.updates.push_back(schedule.updates.back() + count);
+      }
+    }
+    return schedule;
+  }
+
+  // the number of updates that may be inserted by seconds since the start
+  double allowance(double seconds) const {
+    if (seconds >= times.back())
+      return tail_rate == 0 ? updates.back() : updates.back() + tail_rate * (seconds - times.back());
+    size_t i = std::upper_bound(times.begin(), times.end(), seconds) - times.begin();
+    double fraction = (seconds - times[i-1]) / (times[i] - times[i-1]);
+    return updates[i-1] + fraction * (updates[i] - updates[i-1]);
+  }
+
+  // the seconds since the start at which allowance() reaches num_updates
+  double time_of(double num_updates) const {
+    if (num_updates >= updates.back())
+      return times.back() + (num_updates - updates.back()) / tail_rate;
+    size_t i = std::upper_bound(updates.begin(), updates.end(), num_updates) - updates.begin();
+    double fraction = (num_updates - updates[i-1]) / (updates[i] - updates[i-1]);
+    return times[i-1] + fraction * (times[i] - times[i-1]);
+  }
+
+  double duration() const { return times.back(); }
+  double total_updates() const { return updates.back(); }
+
+ private:
+  std::vector<double> times;   // in seconds, beginning with 0
+  std::vector<double> updates; // cumulative number of updates by each time
+  double tail_rate = 0;        // updates per second after the last time
+};
+
+/*
+ * Paces the inserter threads of an experiment so that a stream is inserted at a target rate
+ * regardless of how quickly Landscape processes it (open loop) instead of as fast as the
+ * inserters can go. Each inserter thread has a token bucket that refills with its share of
+ * the schedule and holds at most burst tokens. An inserter takes a token for every update.
+ * Tokens lost because a full bucket could not hold them are updates the inserters fell
+ * behind the schedule, which is reported.
+ */
+class StreamReplayer {
+ public:
+  struct Options {
+    double rate = 0;   // updates per second, 0 if not paced by rate
+    std::string trace; // path of a replay trace, empty if not paced by trace
+  };
+
+  static constexpr double default_burst = 1024;
+
+  /*
+   * Remove the replay options '--rate <updates/sec>' and '--trace <file>' from the
+   * arguments of an experiment so that it may parse the rest as before.
+   */
+  static Options parse_args(int &argc, char **argv) {
+    Options options;
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+      if (i + 1 < argc && strcmp(argv[i], "--rate") == 0) {
+        options.rate = std::atof(argv[++i]);
+        if (options.rate <= 0) {
+          std::cerr << "Replay rate must be positive" << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      } else if (i + 1 < argc && strcmp(argv[i], "--trace") == 0) {
+        options.trace = argv[++i];
+      } else {
+        argv[kept++] = argv[i];
+      }
+    }
+    argc = kept;
+    return options;
+  }
+
+  static std::string usage() { return "[--rate <updates/sec>] [--trace <replay_trace>]"; }
+
+  StreamReplayer(const Options &options, int num_threads, double burst = default_burst)
+   : paced(options.rate > 0 || !options.trace.empty()),
+     schedule(options.trace.empty() ? ReplaySchedule::constant(options.rate)
+                                    : ReplaySchedule::from_trace(options.trace)),
+     description(options.trace.empty() ? std::to_string((uint64_t) options.rate) + " updates/sec"
+                                       : "trace " + options.trace),
+     num_threads(num_threads), burst(burst), pacers(num_threads) {
+    start();
+  }
+
+  bool is_paced() const { return paced; }
+
+  // begin the schedule now. Call just before the inserter threads begin
+  void start() {
+    start_time = std::chrono::steady_clock::now();
+    for (auto &pacer : pacers) pacer = Pacer();
+    warned = false;
+  }
+
+  // take n tokens for thread thr_id if the bucket holds them, otherwise take none
+  bool try_acquire(int thr_id, uint64_t n = 1) {
+    if (!paced) return true;
+    Pacer &pacer = pacers[thr_id];
+    refill(thr_id, std::chrono::steady_clock::now());
+    if (pacer.tokens < n) return false;
+    pacer.tokens -= n;
+    pacer.inserted += n;
+    return true;
+  }
+
+  // take n tokens for thread thr_id, waiting for the bucket to refill if necessary.
+  // n must not exceed the burst
+  void wait(int thr_id, uint64_t n = 1) {
+    if (try_acquire(thr_id, n)) return;
+    Pacer &pacer = pacers[thr_id];
+    double needed = (pacer.allowance + n - pacer.tokens) * num_threads;
+    double when = schedule.time_of(needed);
+    if (std::isfinite(when))
+      std::this_thread::sleep_until(start_time + std::chrono::duration_cast<
+                                    std::chrono::steady_clock::duration>(
+                                    std::chrono::duration<double>(when)));
+    refill(thr_id, std::chrono::steady_clock::now());
+    pacer.tokens = std::max(0.0, pacer.tokens - n);
+    pacer.inserted += n;
+  }
+
+  // the number of updates the inserters fell behind the schedule
+  uint64_t deficit() const {
+    double lost = 0;
+    for (auto &pacer : pacers) lost += pacer.lost;
+    return lost;
+  }
+
+  // write the achieved rate of the replay and whether the inserters kept up
+  void report(std::ostream &out) const {
+    if (!paced) return;
+    uint64_t inserted = 0;
+    double elapsed = 0;
+    for (auto &pacer : pacers) {
+      inserted += pacer.inserted;
+      elapsed = std::max(elapsed, pacer.last_seconds);
+    }
+    out << "Replayed " << inserted << " updates at " << description << ": took " << elapsed
+        << " seconds, " << inserted / elapsed << " per second" << std::endl;
+    if (deficit() > inserted / 100)
+      out << "WARNING: Could not keep up with the replay. The inserters fell " << deficit()
+          << " updates behind schedule" << std::endl;
+  }
+
+ private:
+  struct Pacer {
+    double tokens = 0;
+    double allowance = 0; // this thread's share of the schedule at its last refill
+    double lost = 0;      // tokens that did not fit in the bucket
+    double last_seconds = 0;
+    uint64_t inserted = 0;
+    char pad[64];         // avoid false sharing between inserters
+  };
+
+  void refill(int thr_id, std::chrono::steady_clock::time_point now) {
+    Pacer &pacer = pacers[thr_id];
+    pacer.last_seconds = std::chrono::duration<double>(now - start_time).count();
+    double allowance = schedule.allowance(pacer.last_seconds) / num_threads;
+    if (!std::isfinite(allowance)) { // past the end of the trace, no longer paced
+      pacer.tokens = std::numeric_limits<double>::infinity();
+      return;
+    }
+    pacer.tokens += allowance - pacer.allowance;
+    pacer.allowance = allowance;
+    if (pacer.tokens > burst) {
+      pacer.lost += pacer.tokens - burst;
+      pacer.tokens = burst;
+      if (!warned.exchange(true))
+        std::cerr << "WARNING: Inserter " << thr_id << " cannot keep up with the replay at "
+                  << description << std::endl;
+    }
+  }
+
+  const bool paced;
+  const ReplaySchedule schedule;
+  const std::string description;
+  const int num_threads;
+  const double burst;
+
+  std::chrono::steady_clock::time_point start_time;
+  std::vector<Pacer> pacers;
+  std::atomic<bool> warned;
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <types.h>
+#include <supernode.h>
+
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * The parameters the DistributedWorkers were initialized with when a capture was taken
+ */
+struct CaptureParams {
+  node_id_t num_nodes;
+  uint64_t seed;
+  double sketches_factor;
+  int max_msg_size;
+};
+
+/*
+ * Records a sample of the BATCH messages seen by each BatchMessageForwarder so that the work
+ * of a DistributedWorker may be replayed on a single machine without a cluster, see
+ * tools/replay_batches.cpp.
+ *
+ * Capture is enabled by setting LANDSCAPE_CAPTURE_DIR, and optionally LANDSCAPE_CAPTURE_RATE
+ * (the fraction of batch messages captured, default 0.01) and LANDSCAPE_CAPTURE_LIMIT (the
+ * most messages captured per file, default 100000), in the environment of main. After each
+ * INIT a forwarder writes capture_<rank>_<init>.bin to that directory. The file begins with
+ * capture_magic and the CaptureParams, followed by each message as its size and its bytes.
+ */
+class BatchCapture {
+ public:
+  /*
+   * Share the capture configuration of main with every process.
+   * Must be called by every process immediately after MPI is initialized.
+   */
+  static void setup();
+
+  static bool enabled() { return capture_enabled; }
+
+  // BatchMessageForwarder: begin a capture file for the cluster initialized with params
+  static void begin(const CaptureParams &params);
+
+  // BatchMessageForwarder: capture a BATCH message if it is sampled
+  static void record(const char *msg, int msg_size);
+
+  // BatchMessageForwarder: close the capture file at STOP
+  static void end();
+
+  // read a capture file. Returns false if it is not a valid capture
+  static bool read(const std::string &path, CaptureParams &params,
+                   std::vector<std::vector<char>> &messages);
+
+  // configure Supernodes and the WorkerCluster as the workers of a capture were
+  static void configure(const CaptureParams &params);
+
+  /*
+   * Process a batch message as a DistributedWorker does: parse its batches, generate a delta
+   * for each, and serialize the deltas to serial_str. Call configure() first. Returns the
+   * number of updates in the message.
+   */
+  static size_t process_message(char *msg, int msg_size, Supernode *delta,
+                                std::ostream &serial_str);
+
+  static constexpr uint64_t capture_magic = 0x3130425443534c00ull;
+ private:
+  static bool capture_enabled;
+  static double sample_rate;
+  static uint64_t max_messages;
+  static std::string capture_dir;
+  static int rank;
+  static int num_inits;
+
+  static std::ofstream out;
+  static uint64_t num_seen;
+  static uint64_t num_captured;
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * The points in the life of a batch message that are traced
+ */
+enum TraceStage {
+  TRACE_GET_DATA,        // main: WorkDistributor waits for the first DataNode of the message
+  TRACE_SEND_BATCHES,    // main: WorkDistributor sends the batch message
+  TRACE_FWD_BATCH,       // BatchMessageForwarder sends the message to a worker
+  TRACE_PARSE_BATCHES,   // DistributedWorker parses the batches
+  TRACE_GENERATE_DELTAS, // DistributedWorker generates the deltas
+  TRACE_RETURN_DELTAS,   // DistributedWorker returns the deltas
+  TRACE_FWD_DELTA,       // DeltaMessageForwarder sends the deltas to main
+  TRACE_APPLY_DELTAS,    // main: WorkDistributor applies the deltas to the supernodes
+  NUM_TRACE_STAGES
+};
+
+/*
+ * Samples batch messages and records when each traced message passes each TraceStage.
+ * A traced message carries its trace id in the Trailer of the message.
+ *
+ * Tracing is enabled by setting LANDSCAPE_TRACE_DIR, and optionally LANDSCAPE_TRACE_RATE (the
+ * fraction of batch messages traced, default 0.01), in the environment of main. Each process
+ * appends its events to trace_<rank>.txt in that directory along with the offset of its
+ * clock from the clock of main. tools/merge_traces.cpp combines them into a Chrome trace.
+ */
+class BatchTracer {
+ public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  struct TraceEvent {
+    uint64_t trace_id;
+    TraceStage stage;
+    int64_t begin_ns;
+    int64_t end_ns;
+    uint64_t thread;
+  };
+
+  /*
+   * Share the tracing configuration of main and measure the clock offset of every process.
+   * Must be called by every process immediately after MPI is initialized.
+   */
+  static void setup();
+
+  static bool enabled() { return trace_enabled; }
+
+  // main: the trace id for the next batch message or 0 if it should not be traced
+  static uint64_t sample();
+
+  // buffer an event. Once max_buffered_events are buffered they are appended to the trace file
+  static void record(uint64_t trace_id, TraceStage stage, time_point begin, time_point end);
+
+  // append the events recorded so far to the trace file of this process
+  static void write();
+
+  /*
+   * Read the events of a trace file written by a process, adjusted to the clock of main
+   * @param path    the trace file
+   * @param rank    set to the rank of the process that wrote it
+   * @param events  the vector the events are appended to
+   * @return        false if the file could not be read
+   */
+  static bool read(const std::string &path, int &rank, std::vector<TraceEvent> &events);
+
+  static std::string stage_name(TraceStage stage);
+  static TraceStage stage_of(const std::string &name); // NUM_TRACE_STAGES if unknown
+
+  static constexpr size_t max_buffered_events = 1 << 16;
+
+  /*
+   * Every batch message carries a Trailer to the worker and back, which every process that
+   * handles the message strips before parsing and copies to the messages derived from it.
+   * Main matches each delta message to the batch message it answers by sent_ns.
+   */
+  struct Trailer {
+    uint64_t trace_id = 0;  // trace id of the batch message, or 0 if not traced
+    int64_t sent_ns = 0;    // when main sent the batch message, by the clock of main
+    int32_t worker_id = -1; // the worker that generated the deltas, or -1 until then
+    uint32_t padding = 0;
+  };
+
+  // the trailer is a Trailer followed by trailer_magic
+  static constexpr size_t trailer_bytes = sizeof(Trailer) + sizeof(uint64_t);
+  static constexpr uint64_t trailer_magic = 0xfffffff7fffffff3ull;
+
+  static void write_trailer(char *msg_end, const Trailer &trailer) {
+    memcpy(msg_end, &trailer, sizeof(Trailer));
+    memcpy(msg_end + sizeof(Trailer), &trailer_magic, sizeof(uint64_t));
+  }
+
+  // read the trailer of a message into trailer. Returns false if the message has none
+  static bool find_trailer(const char *msg, size_t msg_size, Trailer &trailer) {
+    if (msg_size < trailer_bytes) return false;
+    uint64_t magic;
+    memcpy(&magic, msg + msg_size - sizeof(uint64_t), sizeof(uint64_t));
+    if (magic != trailer_magic) return false;
+    memcpy(&trailer, msg + msg_size - trailer_bytes, sizeof(Trailer));
+    return true;
+  }
+
+  static int64_t to_ns(time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+  }
+  static time_point from_ns(int64_t ns) {
+    return time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::nanoseconds(ns)));
+  }
+
+  static constexpr int sync_tag = 64;    // MPI tag of clock synchronization messages
+  static constexpr int sync_rounds = 16; // the round with the least delay is used
+ private:
+  static void write_events(const std::vector<TraceEvent> &to_write);
+  static int64_t sync_clock(int rank, int num_ranks); // offset of this clock from main's
+
+  static bool trace_enabled;
+  static double sample_rate;
+  static std::string trace_dir;
+  static int rank;
+  static int64_t clock_offset_ns;
+
+  static std::atomic<uint64_t> next_trace;
+  static std::mutex events_lock;
+  static std::vector<TraceEvent> events;
+  static std::mutex write_lock; // events are recorded while others are written
+};
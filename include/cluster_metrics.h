@@ -0,0 +1,219 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "worker_cluster.h"
+
+/*
+ * The stages of stream ingestion whose latencies are recorded
+ */
+enum MetricStage {
+  QUEUE_WAIT_TIME,   // time a WorkDistributor waits for a DataNode from the gutters
+  COALESCE_TIME,     // time the first batch of a message waits for the message to be sent
+  SEND_TIME,         // time to send a batch message to a forwarder
+  ROUND_TRIP_TIME,   // time from sending a batch message to recieving its deltas
+  DELTA_APPLY_TIME,  // time to apply the deltas of one message to the supernodes
+  LOCAL_TIME,        // time to process a DataNode locally on the main node
+  FLUSH_TIME,        // time for every WorkDistributor to pause when flushing
+  NUM_METRIC_STAGES
+};
+
+/*
+ * A summary of a LatencyHistogram. Latencies are in nanoseconds.
+ */
+struct HistogramSnapshot {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+  std::vector<uint64_t> buckets; // the number of latencies in each bucket
+
+  double mean() const { return count == 0 ? 0 : (double) sum / count; }
+
+  // add the latencies of oth to this snapshot
+  void merge(const HistogramSnapshot &oth);
+
+  // the number of latencies of at most nanos, to the precision of the buckets
+  uint64_t count_below(uint64_t nanos) const;
+
+  // an estimate of the latency at percentile p in [0, 100]
+  uint64_t percentile(double p) const;
+};
+
+/*
+ * A histogram of latencies in the style of HdrHistogram. Each power of two is split into
+ * sub_buckets linear buckets so every latency is recorded with about 6% precision.
+ * Recording is lock free and may be done by many threads at once.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() { reset(); }
+
+  void record(uint64_t nanos) {
+    buckets[bucket_of(nanos)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(nanos, std::memory_order_relaxed);
+    uint64_t cur_max = max.load(std::memory_order_relaxed);
+    while (nanos > cur_max && !max.compare_exchange_weak(cur_max, nanos, std::memory_order_relaxed));
+  }
+
+  HistogramSnapshot snapshot() const;
+  void reset();
+
+  static constexpr int sub_bucket_bits = 4;
+  static constexpr int sub_buckets = 1 << sub_bucket_bits;
+  static constexpr int num_buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+  static int bucket_of(uint64_t nanos) {
+    if (nanos < sub_buckets) return nanos;
+    int exp = 63 - __builtin_clzll(nanos);
+    int sub_bucket = (nanos >> (exp - sub_bucket_bits)) & (sub_buckets - 1);
+    return (exp - sub_bucket_bits + 1) * sub_buckets + sub_bucket;
+  }
+
+  // the smallest latency recorded in bucket
+  static uint64_t bucket_low(int bucket) {
+    if (bucket < sub_buckets) return bucket;
+    int exp = bucket / sub_buckets + sub_bucket_bits - 1;
+    return (uint64_t) (sub_buckets + bucket % sub_buckets) << (exp - sub_bucket_bits);
+  }
+
+ private:
+  std::array<std::atomic<uint64_t>, num_buckets> buckets;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+};
+
+/*
+ * The traffic between main and a single pair of message forwarders
+ */
+struct ForwarderSnapshot {
+  uint64_t bytes_sent = 0;      // bytes of batch messages sent
+  uint64_t messages_sent = 0;
+  uint64_t bytes_received = 0;  // bytes of delta messages recieved
+  uint64_t messages_received = 0;
+  HistogramSnapshot round_trip; // batch to delta round trip of the workers of this forwarder
+};
+
+/*
+ * The health of a DistributedWorker as of its last heartbeat. Rates are over the interval
+ * between its last two heartbeats
+ */
+struct WorkerHealth {
+  int worker_id = 0;
+  double utilization = 0;      // fraction of the time of its threads spent generating deltas
+  double updates_per_sec = 0;
+  uint32_t idle_handlers = 0;   // message handlers waiting for a batch message
+  uint32_t pending_returns = 0; // messages of deltas waiting to be returned to main
+  uint64_t buffer_bytes = 0;    // memory of its message buffers and delta supernodes
+  uint64_t resident_bytes = 0;  // memory of its resident deltas
+  double heartbeat_age = 0;     // seconds since the last heartbeat
+  bool stopped = false;         // the worker sent its final heartbeat
+};
+
+struct MetricsSnapshot {
+  std::array<HistogramSnapshot, NUM_METRIC_STAGES> stages;
+  std::vector<ForwarderSnapshot> forwarders; // forwarders[i] is the forwarder with id i + 1
+  // worker_round_trips[i] is the batch to delta round trip of the worker with id
+  // i + WorkerCluster::distrib_worker_offset
+  std::vector<HistogramSnapshot> worker_round_trips;
+  std::vector<WorkerStats> workers;          // the last statistics reported by each worker
+  std::vector<WorkerHealth> health;          // the health of each worker
+};
+
+/*
+ * The process wide registry of ingestion metrics recorded by the main node. Every function
+ * may be called concurrently and recording never takes a lock. Each thread records latencies
+ * to one of num_shards copies of the histograms which are only combined by snapshot().
+ */
+class ClusterMetrics {
+ public:
+  static void record(MetricStage stage, std::chrono::steady_clock::duration latency) {
+    shards[shard_id()].stages[stage].record(to_nanos(latency));
+  }
+
+  // record the batch to delta round trip of worker_id, one of the workers of forwarder fid
+  static void record_round_trip(int fid, int worker_id,
+                                std::chrono::steady_clock::duration latency) {
+    uint64_t nanos = to_nanos(latency);
+    shards[shard_id()].stages[ROUND_TRIP_TIME].record(nanos);
+    forwarders[fid - 1].round_trip.record(nanos);
+    size_t w = worker_id - WorkerCluster::distrib_worker_offset;
+    if (w < num_round_trip_workers) worker_round_trips[w].record(nanos);
+  }
+
+  static void record_sent(int fid, size_t bytes) {
+    forwarders[fid - 1].bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+    forwarders[fid - 1].messages_sent.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void record_received(int fid, size_t bytes) {
+    forwarders[fid - 1].bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+    forwarders[fid - 1].messages_received.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // record the WorkerStats contained in a FLUSH message from a DeltaMessageForwarder
+  static void record_worker_stats(const char *msg, size_t msg_size);
+
+  // record a heartbeat and return the health of its worker
+  static WorkerHealth record_heartbeat(const WorkerHeartbeat &heartbeat);
+  static std::vector<WorkerHealth> worker_health();
+
+  static MetricsSnapshot snapshot();
+
+  // clear every metric. Must not be called while a WorkDistributor may record
+  static void reset();
+
+  static std::string stage_name(MetricStage stage);
+
+  static constexpr int num_shards = 16;
+ private:
+  // the send and recieve threads of a WorkDistributor update different cache lines
+  struct ForwarderMetrics {
+    alignas(64) std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> messages_sent{0};
+    alignas(64) std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> messages_received{0};
+    LatencyHistogram round_trip;
+  };
+
+  struct alignas(64) Shard {
+    std::array<LatencyHistogram, NUM_METRIC_STAGES> stages;
+  };
+
+  // threads are assigned shards round robin the first time they record
+  static int shard_id() {
+    thread_local int id = next_shard.fetch_add(1, std::memory_order_relaxed) % num_shards;
+    return id;
+  }
+
+  static uint64_t to_nanos(std::chrono::steady_clock::duration latency) {
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    return nanos < 0 ? 0 : nanos;
+  }
+
+  static std::array<Shard, num_shards> shards;
+  static std::atomic<int> next_shard;
+  static std::array<ForwarderMetrics, WorkerCluster::num_msg_forwarders> forwarders;
+  // one per worker of the cluster, allocated once by reset() and never replaced
+  static std::unique_ptr<LatencyHistogram[]> worker_round_trips;
+  static size_t num_round_trip_workers;
+
+  struct HeartbeatRecord {
+    WorkerHeartbeat last;
+    std::chrono::steady_clock::time_point received;
+    WorkerHealth health;
+  };
+
+  // only taken when workers flush or send a heartbeat, or by snapshot()
+  static std::mutex workers_lock;
+  static std::map<int, WorkerStats> workers;
+  static std::map<int, HeartbeatRecord> heartbeats;
+};
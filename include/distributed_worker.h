@@ -2,10 +2,18 @@
 #include <types.h>
 #include <vector>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
+#include "batch_tracer.h"
 #include "msg_buffer_queue.h"
 #include <supernode.h>
 #include "memstream.h"
+#include "msg_buffer_pool.h"
+#include "worker_cluster.h"
 
 class DistributedWorker {
 private:
@@ -21,10 +29,12 @@ private:
     std::vector<delta_t> deltas;  // where we place the generated deltas
     omemstream serial_stream;
     int msg_src;
+    BatchTracer::Trailer trailer; // trailer of the batch message, returned with its deltas
+    bool has_trailer = false;
 
     BatchesToDeltasHandler(int max_msg_size, size_t size) 
-      : serial_delta_mem(new char[max_msg_size * sizeof(char)]),
-        batches_buffer(new char[max_msg_size * sizeof(char)]),
+      : serial_delta_mem(MsgBufferPool::get(max_msg_size)),
+        batches_buffer(MsgBufferPool::get(max_msg_size)),
         serial_stream(serial_delta_mem, max_msg_size) {
       //  std::cout << "BatchesToDeltas with size = " << deltas.size() << std::endl;
       for (size_t i = 0; i < size; i++)
@@ -34,11 +44,12 @@ private:
     BatchesToDeltasHandler(BatchesToDeltasHandler&& oth)
         : serial_delta_mem(std::exchange(oth.serial_delta_mem, nullptr)),
           batches_buffer(std::exchange(oth.batches_buffer, nullptr)), deltas(std::move(oth.deltas)), 
-          serial_stream(std::move(oth.serial_stream)) {};
+          serial_stream(std::move(oth.serial_stream)), msg_src(oth.msg_src),
+          trailer(oth.trailer), has_trailer(oth.has_trailer) {};
 
     ~BatchesToDeltasHandler() {
-      delete[] batches_buffer;
-      delete[] serial_delta_mem;
+      MsgBufferPool::put(batches_buffer);
+      MsgBufferPool::put(serial_delta_mem);
       for (auto& delta : deltas)
         delete[] delta.supernode;
     }
@@ -56,7 +67,7 @@ private:
   MsgBufferQueue<BatchesToDeltasHandler> send_msg_queue;
 
   static constexpr int init_msg_size =
-      sizeof(seed) + sizeof(num_nodes) + sizeof(max_msg_size) + sizeof(double);
+      sizeof(seed) + sizeof(num_nodes) + sizeof(max_msg_size) + sizeof(double) + sizeof(bool);
   bool running = true; // is cluster active
 
   // variables for storing messages to this worker
@@ -68,15 +79,55 @@ private:
   size_t helper_threads;  // number of helper threads that will process deltas for the main thread
 
   std::atomic<size_t> num_updates; // number of updates processed by this node
+  std::atomic<size_t> num_batch_msgs;   // number of batch messages processed by this node
+  std::atomic<size_t> num_delta_bytes;  // bytes of deltas returned to main
+  std::atomic<uint64_t> busy_nanos;     // time spent generating deltas
+
+  // the statistics reported to main with each FLUSH
+  WorkerStats get_stats();
+
+  // while initialized a heartbeat thread reports the health of this worker to main
+  std::chrono::steady_clock::time_point init_time;
+  std::atomic<uint32_t> idle_handlers;   // size of recv_msg_queue
+  std::atomic<uint32_t> pending_returns; // size of send_msg_queue
+  std::thread heartbeat_thr;
+  std::mutex heartbeat_lock;
+  std::condition_variable heartbeat_cond;
+  bool heartbeat_stop = false;
+
+  WorkerHeartbeat get_heartbeat(bool last);
+  void start_heartbeats();
+  void stop_heartbeats(); // stop the heartbeat thread. Does not send a final heartbeat
+  void send_heartbeats(); // body of the heartbeat thread
+
+  // When resident the worker XORs the deltas it generates into per-node deltas that stay on
+  // this worker and are only returned to main when flushed. One map per processing thread
+  bool resident = false;
+  std::vector<std::unordered_map<node_id_t, Supernode*>> resident_deltas;
+  size_t max_resident_per_thread = 0;
+  std::atomic<size_t> num_resident_deltas; // read by the heartbeat thread
+  // resident deltas may use this fraction of the physical memory of the machine, divided
+  // evenly between the processes of the cluster on the machine
+  static constexpr double resident_memory_fraction = 0.5;
+  int machine_processes;
 
   // wait for initialize message
   void init_worker();
   void process_send_queue_elm();
+
+  // accumulate a delta as a resident delta. Returns false if it must be returned to main
+  bool accumulate_delta(delta_t &delta);
+  // return all resident deltas to main using the buffers of handler
+  void return_resident_deltas(int destination_id, BatchesToDeltasHandler &handler);
+  void free_resident_deltas();
 public:
-  // Create a distributed worker and run
-  DistributedWorker(int _id);
+  // Create a distributed worker and run. machine_processes is the number of processes of
+  // the cluster that share this machine
+  DistributedWorker(int _id, int _machine_processes);
   ~DistributedWorker();
 
+  static constexpr std::chrono::milliseconds heartbeat_interval{100};
+
   // main loop of the distributed worker
   void run();
 };
@@ -1,27 +1,332 @@
 #pragma once
 #include <graph.h>
 #include <supernode.h>
+#include "numa_placement.h"
+#include "cluster_metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// forward declarations
+class QueryCoordinator;
+class MetricsExporter;
+struct CheckpointHeader;
+struct MemoryReport;
+
+/*
+ * A compact representation of k spanning forests.
+ * edges contains the edges of every forest, sorted by (src, dst) within each forest.
+ * The edges of forest t are edges[forest_offsets[t]] to edges[forest_offsets[t+1] - 1]
+ * and forest_offsets.back() == edges.size().
+ */
+struct SpanningForests {
+  std::vector<Edge> edges;
+  std::vector<size_t> forest_offsets;
+
+  size_t num_forests() const { return forest_offsets.size() - 1; }
+};
 
 class GraphDistribUpdate : public Graph {
 private:
   FRIEND_TEST(DistributedGraphTest, TestSupernodeRestoreAfterCCFailure);
+  friend class QueryCoordinator;
 
   static GraphConfiguration graph_conf(node_id_t num_nodes, node_id_t k);
+
+  // configuration of the guttering system
+  static float batch_factor(node_id_t k) { return k > 1 ? 1.0 : 1.2; }
+  static constexpr int gutter_buffer_exp = 20;
+  static constexpr int gutter_fanout = 64;
+  static constexpr int gutter_queue_factor = WorkerCluster::num_batches;
+
+  // the sizes of the supernodes of a graph, which depend only on its num_nodes and k
+  struct SupernodeSizes {
+    size_t bytes;            // Supernode::get_size()
+    size_t serialized_bytes; // Supernode::get_serialized_size()
+  };
+
+  // fill in the memory of main that is modelled the same way for a plan and a report
+  static void plan_main_memory(MemoryReport &report, node_id_t num_nodes, size_t gutter_updates,
+                               int num_workers, size_t supernode_bytes);
+  // plan_memory() given the supernode sizes of the planned graph
+  static MemoryReport plan_memory_of(node_id_t num_nodes, node_id_t k, int num_workers,
+                                     int worker_threads, SupernodeSizes sizes);
+
+  /*
+   * The sizes of the supernodes of a graph of num_nodes vertices and the given k. Supernode
+   * keeps the sizes of one configuration in static state that the live graph reads while it
+   * ingests. So Supernode is only configured for a plan while no graph is alive, and the sizes
+   * of every configuration seen are remembered. Throws std::invalid_argument if a graph is
+   * alive and the sizes of this configuration have not been seen.
+   */
+  static SupernodeSizes supernode_sizes(node_id_t num_nodes, node_id_t k);
+
+  // the graph Supernode is configured for, if any, and the sizes of every configuration seen.
+  // Guarded by live_graph_lock
+  static GraphDistribUpdate *live_graph;
+  static std::map<std::pair<node_id_t, node_id_t>, SupernodeSizes> known_sizes;
+  static std::mutex live_graph_lock;
   node_id_t k = 1; // this parameter determines the value of k for is_k_connected()
+  uint64_t stream_offset = 0; // stream position of the last checkpoint taken or restored
+  bool resident_workers = false; // do the DistributedWorkers hold their deltas until flushed
+
+  // one bit per supernode, set when the supernode is modified after the last checkpoint
+  std::unique_ptr<std::atomic<uint64_t>[]> dirty_nodes;
+  std::string last_checkpoint_path; // full checkpoint that incremental checkpoints append to
+  uint64_t checkpoint_log_end = 0;  // end of the log of last_checkpoint_path
+
+  // the checkpoint this graph was restored from. Graphs restored from the same checkpoint
+  // hold sketches of that checkpoint plus their own updates, see merge_sketches()
+  std::string base_path;
+  uint64_t base_id = 0;          // 0 if the graph was constructed empty
+  bool base_log_applied = false; // the base includes records of its incremental log
+
+  // the log is compacted into a full checkpoint once it would exceed this fraction of one
+  static constexpr double log_compaction_factor = 0.5;
+
+  // the range of supernodes this instance owns when the graph is sharded, see set_shard()
+  int shard_id = 0;
+  int num_shards = 1;
+  node_id_t shard_begin = 0;
+  node_id_t shard_end = 0;
+
+  /*
+   * Inserters pass through a gate in update() so that they wait, rather than fail, while a
+   * query holds the graph locked to updates. Each inserter raises its own flag while inside
+   * update(). The query thread closes the gate and then waits for every flag to drop.
+   */
+  struct InserterFlag {
+    std::atomic<bool> active{false};
+    char padding[63]; // flags of different inserters are on different cache lines
+  };
+  int num_inserters;
+  std::unique_ptr<InserterFlag[]> inserter_flags;
+  std::atomic<bool> gate_closed{false};
+  std::mutex gate_lock;
+  std::condition_variable gate_condition;
+
+  void close_update_gate(); // called by the query thread before it flushes for Boruvka
+  void open_update_gate();  // called once update_locked is cleared
+  void wait_at_update_gate();
+
+  void take_checkpoint(const std::string &path, uint64_t offset, bool incremental);
+  std::vector<node_id_t> take_dirty_nodes(); // return and clear the dirty supernodes
+
+  // restore from a checkpoint whose header has already been read
+  GraphDistribUpdate(const CheckpointHeader &header, const std::string &checkpoint_path,
+                     int num_inserters, bool resident_workers);
+
+  // stop the GraphWorkers and start the WorkDistributors and query thread
+  void start_ingestion();
+
+  // reallocate each supernode on the NUMA node that owns it under policy
+  void place_supernodes(NumaPolicy policy);
+
+  // every query is run by the coordinator's query thread
+  std::unique_ptr<QueryCoordinator> coordinator;
+
+  std::unique_ptr<MetricsExporter> exporter; // serves metrics if requested
+
+  // query implementations, these are called on the query thread
+  std::vector<std::set<node_id_t>> final_connected_components();
+  SpanningForests compute_k_spanning_forests(node_id_t user_k);
+
+  // append the edges of the current spanning_forest to edges, sorted by (src, dst)
+  void append_forest_edges(std::vector<Edge> &edges);
+
+  // delete the given forest edges from the sketches with one delta per touched supernode
+  void peel_forest_edges(const Edge *edges, size_t num_edges);
+
+  // find the root of node in the DSU without path compression. Safe to call concurrently
+  node_id_t find_root(node_id_t node) const {
+    while (parent[node] != node) node = parent[node];
+    return node;
+  }
+
+  // throw std::invalid_argument if node is not a vertex of this graph
+  void check_query_node(node_id_t node) const;
+
+  // throw std::runtime_error if this graph is a shard, whose sketches cannot answer queries
+  void check_unsharded() const;
+
+  // fill labels with the DSU root of every vertex
+  void labels_from_dsu(std::vector<node_id_t> &labels) const;
+
+  /*
+   * Call answer() while the DSU reflects every update in the stream. Uses the existing DSU
+   * if it is still valid, otherwise flushes the stream and performs a non-destructive Boruvka
+   */
+  void query_dsu(const std::function<void()> &answer);
 public:
-  // constructor
-  GraphDistribUpdate(node_id_t num_nodes, int num_inserters, node_id_t k = 1);
+  /*
+   * Construct an empty GraphDistribUpdate.
+   * If resident_workers is true each DistributedWorker XORs the deltas it generates into deltas
+   * it holds in memory, one per node, and only returns them when the workers are flushed. This
+   * reduces network traffic to main when updates to the same node are processed by the same
+   * worker many times between queries.
+   */
+  GraphDistribUpdate(node_id_t num_nodes, int num_inserters, node_id_t k = 1,
+                     bool resident_workers = false);
+
+  /*
+   * Construct a GraphDistribUpdate from a checkpoint written by checkpoint(). The seed, k,
+   * and supernodes are those of the checkpointed graph. Ingestion should resume from
+   * get_stream_offset(). resident_workers is as for an empty GraphDistribUpdate.
+   */
+  GraphDistribUpdate(const std::string &checkpoint_path, int num_inserters,
+                     bool resident_workers = false);
   ~GraphDistribUpdate();
 
+  // the last query answered from the DSU found it valid and so neither flushed nor ran Boruvka
+  bool dsu_fast_path = false;
+
   // some getter functions
   node_id_t get_num_nodes() const {return num_nodes;}
   uint64_t get_seed() const {return seed;}
   Supernode *get_supernode(node_id_t src) const { return supernodes[src]; }
+  uint64_t get_stream_offset() const { return stream_offset; }
 
+  /*
+   * Query functions may be called concurrently by many threads. Queries that are answered
+   * from the DSU and arrive at nearly the same time share a single flush and Boruvka.
+   * k_spanning_forests leaves the sketches as it found them, so it may be repeated.
+   */
   std::vector<std::set<node_id_t>> get_connected_components(bool cont = false);
   std::vector<std::set<node_id_t>> k_spanning_forests(node_id_t user_k);
+  SpanningForests k_spanning_forests_compact(node_id_t user_k);
   bool point_to_point_query(node_id_t a, node_id_t b);
 
+  /*
+   * Answer many point to point queries with a single flush and Boruvka. Returns a vector
+   * where entry i is true if the vertices of pairs[i] are in the same connected component.
+   * Both point to point queries throw std::invalid_argument if a node id is not in the graph.
+   */
+  std::vector<bool> point_to_point_queries(const std::vector<std::pair<node_id_t, node_id_t>> &pairs);
+
+  /*
+   * Asynchronous versions of get_connected_components(true) and k_spanning_forests().
+   * The query is performed by the query thread and the caller may continue, for example to
+   * insert more updates. Updates inserted before the call are reflected in the answer.
+   * Updates inserted while the query flushes and runs Boruvka wait until it is done.
+   * flush_start, flush_end, cc_alg_start and cc_alg_end describe the query once the future
+   * is ready, as does dsu_fast_path for queries answered from the DSU.
+   */
+  std::future<std::vector<std::set<node_id_t>>> async_connected_components();
+  std::future<std::vector<std::set<node_id_t>>> async_k_spanning_forests(node_id_t user_k);
+
+  /*
+   * Returns the component label of every vertex. Vertices a and b are in the same connected
+   * component if and only if labels[a] == labels[b]. Does not prevent further updates.
+   */
+  std::vector<node_id_t> get_component_labels();
+
+  // Returns the size of every connected component. Does not prevent further updates.
+  std::vector<node_id_t> get_component_sizes();
+
+  /*
+   * Write every supernode to a binary checkpoint file at path. The stream is flushed first
+   * so the checkpoint reflects every update inserted before the call. The caller supplies
+   * the number of stream updates inserted so far so that a restore knows where to resume.
+   */
+  void checkpoint(const std::string &path, uint64_t stream_offset = 0);
+
+  /*
+   * Write only the supernodes modified since the last checkpoint, as a record appended to
+   * the log beside the full checkpoint at path. A full checkpoint is written instead if
+   * path has no checkpoint yet or if its log has grown too large. Restoring from path
+   * applies the log.
+   */
+  void incremental_checkpoint(const std::string &path, uint64_t stream_offset = 0);
+
+  /*
+   * Write every supernode to path so that another GraphDistribUpdate may merge them with
+   * merge_sketches(). Uses the checkpoint format but does not affect incremental checkpoints.
+   * Throws std::invalid_argument if path is the checkpoint that incremental checkpoints of
+   * this graph append to, as the export would overwrite it.
+   */
+  void export_sketches(const std::string &path);
+
+  /*
+   * XOR the supernodes exported by another GraphDistribUpdate into our own. As the sketches
+   * are linear the result reflects the updates of both streams. Both graphs must have been
+   * restored from the same full checkpoint, the base, before ingesting their streams. The
+   * base is then in both sketches and cancels out of the XOR, so it is read again from its
+   * file and XORed back in. Throws std::invalid_argument if the export has a different base,
+   * and if the base has since been overwritten or was restored with its incremental log.
+   * To combine the exports of many graphs, restore one graph from their base and merge each.
+   * Only the full checkpoint at path is merged, not its incremental log.
+   *
+   * This is how several Landscape instances, each with its own leader, forwarders and
+   * workers, ingest one stream: each is restored from a common base and ingests a disjoint
+   * part of the stream, for example the updates of one source. Every instance sketches both
+   * endpoints of the updates it ingests unless the instances are sharded, see set_shard().
+   */
+  void merge_sketches(const std::string &path);
+
+  /*
+   * Shard supernode ownership across several Landscape instances, each with its own leader,
+   * forwarders and workers. This instance owns the supernodes of one contiguous range of
+   * node ids. Inserters route each update to the shards of its endpoints, see shard_of(),
+   * and a shard inserts into its gutters only the half of an update that belongs to an
+   * endpoint it owns. The leader of each shard therefore applies deltas to its own range of
+   * supernodes only. Call before inserting updates, on graphs restored from a common base.
+   * A shard holds no DSU and throws std::runtime_error if queried. To query, each shard
+   * calls export_sketches() and a graph restored from the base merges every export.
+   */
+  void set_shard(int _shard_id, int _num_shards);
+
+  // the shard that owns the supernode of node_idx. Inserters use this to route updates
+  static int shard_of(node_id_t node_idx, node_id_t num_nodes, int num_shards) {
+    return (int) (((uint64_t) node_idx * num_shards) / num_nodes);
+  }
+
+  bool owns(node_id_t node_idx) const {
+    return num_shards == 1 || (node_idx >= shard_begin && node_idx < shard_end);
+  }
+
+  /*
+   * Insert an update to the graph. Waits while a query runs Boruvka rather than throwing
+   * UpdateLockedException. Only a graph locked by get_connected_components(false) throws.
+   * Otherwise the update is that of Graph::update(), which this hides to add the wait and
+   * to skip the endpoints that a sharded graph does not own.
+   */
+  inline void update(GraphUpdate upd, int thr_id = 0) {
+    std::atomic<bool> &active = inserter_flags[thr_id].active;
+    active = true;
+    while (gate_closed) {
+      active = false;
+      wait_at_update_gate();
+      active = true;
+    }
+    // update_locked only changes while the gate is closed
+    if (update_locked) {
+      active = false;
+      throw UpdateLockedException();
+    }
+    if (num_shards == 1) {
+      Graph::update(upd, thr_id);
+    } else {
+      Edge &edge = upd.edge;
+      if (owns(edge.src)) gts->insert({edge.src, edge.dst}, thr_id);
+      if (owns(edge.dst)) gts->insert({edge.dst, edge.src}, thr_id);
+    }
+    active.store(false, std::memory_order_release);
+  }
+
+  // mark a supernode as modified since the last checkpoint
+  void mark_dirty(node_id_t node_idx) {
+    dirty_nodes[node_idx / 64].fetch_or(1ull << (node_idx % 64), std::memory_order_relaxed);
+  }
+
   /*
    * This function must be called at the beginning of the program
    * its job is to direct the workers to the DistributedWorker class
@@ -42,4 +347,55 @@ public:
   node_id_t get_k() {
     return k;
   }
+
+  bool get_resident_workers() const { return resident_workers; }
+
+  /*
+   * Remove pairs of identical updates from each batch before it is sent to the cluster or
+   * processed locally. Beneficial for streams that repeatedly insert and delete the same edges.
+   * Disabled in every newly constructed GraphDistribUpdate.
+   */
+  void set_cancel_duplicate_updates(bool cancel);
+  uint64_t get_cancelled_updates() const; // number of updates removed since construction
+
+  // latency histograms and traffic counters of ingestion since construction
+  MetricsSnapshot get_metrics() const { return ClusterMetrics::snapshot(); }
+
+  // the health of each DistributedWorker as of its last heartbeat
+  std::vector<WorkerHealth> get_worker_health() const { return ClusterMetrics::worker_health(); }
+
+  /*
+   * Where the memory of the cluster goes. Only the message pool, the resident set of main and
+   * the memory of each worker, as of its last heartbeat, are measured. The supernodes, query
+   * copies, gutters, WorkDistributors and bookkeeping are modelled from the configuration of
+   * this graph as plan_memory() models them.
+   */
+  MemoryReport memory_report() const;
+
+  /*
+   * Predict the memory of a cluster of num_workers workers, each with worker_threads threads,
+   * for a graph of num_nodes vertices and the given k. The ingestion of a live graph is not
+   * disturbed. While a graph is alive only the num_nodes and k of that graph, or of a graph
+   * planned or constructed earlier, can be planned. Others throw std::invalid_argument.
+   */
+  static MemoryReport plan_memory(node_id_t num_nodes, node_id_t k, int num_workers,
+                                  int worker_threads = std::thread::hardware_concurrency());
+
+  /*
+   * Serve the metrics in the Prometheus text format over HTTP, either on the loopback
+   * interface at port or on a Unix domain socket at socket_path. Replaces any previous exporter.
+   */
+  void serve_metrics(int port);
+  void serve_metrics(const std::string &socket_path);
+
+  // how long the query thread waits for other queries to join a flush and Boruvka
+  void set_query_coalesce_window(std::chrono::microseconds window);
+
+  /*
+   * Place the supernodes across the NUMA nodes of this machine according to policy and pin
+   * the WorkDistributors so that each NUMA node has its share of them. Supernodes are
+   * reallocated by a thread on the owning NUMA node so that first touch places their memory.
+   * NO_NUMA leaves the supernodes where they are and unpins the WorkDistributors.
+   */
+  void set_numa_policy(NumaPolicy policy);
 };
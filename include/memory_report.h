@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/*
+ * The memory of a DistributedWorker
+ */
+struct WorkerMemory {
+  int worker_id = 0;
+  uint64_t buffer_bytes = 0;   // message buffers and delta supernodes
+  uint64_t resident_bytes = 0; // resident deltas
+
+  uint64_t total() const { return buffer_bytes + resident_bytes; }
+};
+
+/*
+ * Where the memory of a Landscape cluster goes, in bytes. Produced either for a live
+ * GraphDistribUpdate by memory_report() or predicted by plan_memory() before launching.
+ * The memory of main other than the message pool is modelled from the configuration of the
+ * graph in both, only the message pool, main_resident and the workers are measured live.
+ */
+struct MemoryReport {
+  // main node
+  uint64_t supernodes = 0;        // the sketches of every vertex
+  uint64_t query_copies = 0;      // in memory copy of the sketches made by each query
+  uint64_t gutters = 0;           // gutters, internal buffers and work queue of the gts
+  uint64_t work_distributors = 0; // delta supernodes of the WorkDistributors
+  uint64_t message_pool = 0;      // message buffers of the WorkDistributors
+  uint64_t bookkeeping = 0;       // DSU and dirty supernode bits
+  uint64_t main_resident = 0;     // measured resident set of main, 0 in a plan
+
+  std::vector<WorkerMemory> workers;
+
+  uint64_t main_total() const {
+    return supernodes + query_copies + gutters + work_distributors + message_pool + bookkeeping;
+  }
+  uint64_t workers_total() const {
+    uint64_t total = 0;
+    for (auto &worker : workers) total += worker.total();
+    return total;
+  }
+  uint64_t total() const { return main_total() + workers_total(); }
+
+  // write the report in a human readable form
+  void print(std::ostream &out) const;
+
+  // the resident set size of this process
+  static uint64_t process_resident_bytes();
+
+  // the physical memory of this machine
+  static uint64_t physical_memory_bytes();
+};
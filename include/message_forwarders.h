@@ -1,5 +1,6 @@
 #pragma once
 #include <mpi.h>
+#include <vector>
 
 #include "worker_cluster.h"
 
@@ -38,7 +39,8 @@ class BatchMessageForwarder {
     init();
     run();
   }
-  static constexpr size_t init_msg_size = sizeof(max_msg_size) + sizeof(WorkerCluster::num_workers);
+  static constexpr size_t init_msg_size = sizeof(max_msg_size) + sizeof(WorkerCluster::num_workers)
+   + sizeof(WorkerCluster::num_nodes) + sizeof(WorkerCluster::seed) + sizeof(double);
 };
 
 class DeltaMessageForwarder {
@@ -50,6 +52,7 @@ class DeltaMessageForwarder {
   bool running = true;
   int num_distrib = 0;
   int num_distrib_flushed = 0;
+  std::vector<WorkerStats> flush_stats; // stats of the workers that have flushed
 
   void run();      // run the process
   void init();     // initialize the process
@@ -63,5 +66,6 @@ class DeltaMessageForwarder {
     init();
     run();
   }
-  static constexpr size_t init_msg_size = sizeof(max_msg_size) + sizeof(WorkerCluster::num_workers);
+  static constexpr size_t init_msg_size = sizeof(max_msg_size) + sizeof(WorkerCluster::num_workers)
+   + sizeof(WorkerCluster::num_nodes) + sizeof(WorkerCluster::seed) + sizeof(double);
 };
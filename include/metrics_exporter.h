@@ -0,0 +1,39 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <thread>
+
+class GraphDistribUpdate;
+
+/*
+ * Serves the metrics of the main node in the Prometheus text format. A single thread answers
+ * every HTTP request, whatever its path, with the current metrics. The metrics are gathered
+ * when a scrape arrives so serving them adds nothing to the ingestion hot path.
+ */
+class MetricsExporter {
+ public:
+  // serve metrics over HTTP on the loopback interface at port. If graph is given its memory
+  // report is included
+  MetricsExporter(int port, const GraphDistribUpdate *graph = nullptr);
+
+  // serve metrics over HTTP on a Unix domain socket created at socket_path
+  MetricsExporter(const std::string &socket_path, const GraphDistribUpdate *graph = nullptr);
+
+  ~MetricsExporter(); // stops the exporter thread and removes any Unix socket
+
+  // the current metrics in the Prometheus text format
+  static std::string render(const GraphDistribUpdate *graph = nullptr);
+
+ private:
+  void start();
+  void serve(); // function run by the exporter thread
+  void answer(int conn_fd);
+
+  int listen_fd = -1;
+  std::string socket_path;
+  const GraphDistribUpdate *graph;
+  std::atomic<bool> running;
+  std::thread serve_thr;
+
+  static constexpr int poll_interval_ms = 200; // how often the thread checks for shutdown
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * A process wide pool of message buffers. Buffers are carved out of chunks of memory backed
+ * by 2MB huge pages and are returned to the pool, not the operating system, when released.
+ * Therefore, the buffers of a process are allocated once and reused across every STOP/INIT
+ * of the cluster, which avoids TLB misses and repeated page faults on every message.
+ *
+ * If USE_MPI_ALLOC_MEM is defined the chunks are allocated with MPI_Alloc_mem so that
+ * transports which register memory with the network card do so once per chunk.
+ */
+class MsgBufferPool {
+ public:
+  /*
+   * Get a buffer of at least bytes bytes from the pool. Thread safe.
+   */
+  static char *get(size_t bytes);
+
+  /*
+   * Return a buffer obtained from get() to the pool. Thread safe. A buffer obtained before
+   * the last free_all() is ignored, as its memory has already been released.
+   */
+  static void put(char *buf);
+
+  /*
+   * Release the memory of the pool, any buffer still in use becomes invalid. Called before
+   * MPI_Finalize as memory from MPI_Alloc_mem must be freed while MPI is active. The owners
+   * of buffers in use, such as WorkDistributors stopped after teardown, may still put them.
+   */
+  static void free_all();
+
+  static size_t size_class(size_t bytes);  // the power of two buffers of bytes come from
+  static size_t bytes_mapped();            // bytes of memory held by the pool
+
+  static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+  static constexpr size_t min_buffer_size = 4096;
+
+ private:
+  struct Chunk {
+    char *base;   // the allocation to free
+    char *mem;    // start of the huge page aligned memory within the allocation
+    size_t bytes; // bytes of aligned memory
+  };
+
+  static Chunk alloc_chunk(size_t bytes);  // bytes is a multiple of huge_page_size
+  static void free_chunk(Chunk chunk);
+
+  static std::mutex pool_lock;
+  static std::map<size_t, std::vector<char *>> free_buffers; // free buffers by size class
+  static std::unordered_map<char *, size_t> buffer_sizes;    // size class of every buffer
+  static std::vector<Chunk> chunks;                          // memory backing the buffers
+  static char *chunk_pos;   // start of the unused portion of the last chunk
+  static size_t chunk_left; // bytes remaining in the last chunk
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <types.h>
+
+#include <pthread.h>
+#include <vector>
+
+/*
+ * How supernodes are placed across the NUMA nodes of the main process.
+ * NUMA_PARTITION gives each NUMA node a contiguous range of node ids while NUMA_INTERLEAVE
+ * assigns node ids round robin. NO_NUMA leaves memory where it is and unpins all threads.
+ */
+enum NumaPolicy {
+  NO_NUMA,
+  NUMA_INTERLEAVE,
+  NUMA_PARTITION
+};
+
+/*
+ * Helper functions for placing memory and threads on NUMA nodes. The topology is read from
+ * sysfs so no additional libraries are required. A machine without NUMA information is
+ * treated as a single NUMA node.
+ */
+class NumaPlacement {
+ public:
+  // the number of NUMA nodes on this machine
+  static int num_numa_nodes();
+
+  // the NUMA node that owns the supernode of node_idx under policy
+  static int numa_node_of(node_id_t node_idx, node_id_t num_nodes, NumaPolicy policy) {
+    int numa_nodes = num_numa_nodes();
+    if (policy == NUMA_INTERLEAVE) return node_idx % numa_nodes;
+    if (policy == NUMA_PARTITION) return (uint64_t) node_idx * numa_nodes / num_nodes;
+    return 0;
+  }
+
+  /*
+   * Restrict a thread to the cpus of a NUMA node.
+   * @param thr        the thread to pin.
+   * @param numa_node  the NUMA node to pin to or -1 to allow every cpu.
+   * @return           true if the thread was pinned.
+   */
+  static bool pin_thread(pthread_t thr, int numa_node);
+
+  // pin the calling thread. Does nothing if it is already pinned to numa_node
+  static void pin_this_thread(int numa_node);
+
+  /*
+   * Allocate memory that begins on a page boundary and is padded to a whole number of pages,
+   * so that moving it to a NUMA node moves no other allocation. Release it with free().
+   * @return  the memory or nullptr if it could not be allocated.
+   */
+  static void *alloc_pages(size_t bytes);
+
+  /*
+   * Move the pages that hold [addr, addr + bytes) to a NUMA node. First touch does not
+   * place memory that malloc reuses so placed memory is also moved explicitly. Every page
+   * is moved, including any part of it outside the range, see alloc_pages().
+   * @return  true if every page is now on numa_node or if this machine has a single NUMA node.
+   */
+  static bool move_to_numa_node(const void *addr, size_t bytes, int numa_node);
+
+  // the NUMA node that holds the page of addr, or -1 if unknown or the page is not present
+  static int numa_node_of_address(const void *addr);
+
+ private:
+  // the cpus of each NUMA node, read once from sysfs
+  static const std::vector<std::vector<int>> &numa_cpus();
+};
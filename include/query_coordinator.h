@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// forward declarations
+class GraphDistribUpdate;
+
+/*
+ * The QueryCoordinator runs every query of a GraphDistribUpdate on a single query thread so
+ * that only one thread ever flushes, pauses or unpauses the WorkDistributors.
+ * Queries that can be answered from the DSU and that arrive within coalesce_window of each
+ * other share a single flush and Boruvka. While the DSU is valid no flush is needed and such
+ * queries are answered without waiting. Each caller receives its answer through a future.
+ */
+class QueryCoordinator {
+ public:
+  /**
+   * Create a QueryCoordinator and start its query thread.
+   * @param _graph   the graph to query.
+   * @param _window  how long to wait for more queries after the first arrives.
+   */
+  QueryCoordinator(GraphDistribUpdate *_graph, std::chrono::microseconds _window);
+  ~QueryCoordinator(); // answers all outstanding queries and then joins the query thread
+
+  /**
+   * Submit a query that is answered from a valid DSU. It may share its flush and Boruvka
+   * with other DSU queries.
+   * @param answer  computes the answer. Called on the query thread while the DSU is valid.
+   */
+  template <class T>
+  std::future<T> submit_dsu_query(std::function<T()> answer) {
+    return submit(std::move(answer), false);
+  }
+
+  /**
+   * Submit a query that manages its own flush and must run alone, for example a query that
+   * modifies the sketches.
+   * @param query  performs the query. Called on the query thread.
+   */
+  template <class T>
+  std::future<T> submit_exclusive_query(std::function<T()> query) {
+    return submit(std::move(query), true);
+  }
+
+  void set_coalesce_window(std::chrono::microseconds _window) { window = _window; }
+
+  static constexpr std::chrono::microseconds default_coalesce_window{500};
+ private:
+  struct Query {
+    bool exclusive;
+    std::function<void()> answer;                   // compute the answer and fulfill the promise
+    std::function<void(std::exception_ptr)> fail;   // fulfill the promise with an exception
+  };
+
+  template <class T>
+  std::future<T> submit(std::function<T()> func, bool exclusive) {
+    auto promise = std::make_shared<std::promise<T>>();
+    std::future<T> ret = promise->get_future();
+
+    Query query;
+    query.exclusive = exclusive;
+    query.answer = [promise, func]() {
+      try {
+        promise->set_value(func());
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    };
+    query.fail = [promise](std::exception_ptr err) { promise->set_exception(err); };
+    enqueue(std::move(query));
+    return ret;
+  }
+
+  void enqueue(Query &&query);
+  void do_query_work();  // function run by the query thread
+  void run_dsu_queries(std::vector<Query> &queries);
+
+  GraphDistribUpdate *graph;
+  std::atomic<std::chrono::microseconds> window;
+
+  std::deque<Query> pending;
+  std::mutex queue_lock;
+  std::condition_variable queue_condition;
+  bool shutdown = false;
+
+  std::thread query_thr;
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include <supernode.h>
+#include <types.h>
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+
+/*
+ * Binary format of a sketch checkpoint.
+ * The header occupies the first page of the file and is followed by num_nodes serialized
+ * supernodes of supernode_bytes each, in order of node id. The supernode region begins on
+ * a page boundary so the file may be loaded with mmap or with parallel pread.
+ */
+struct CheckpointHeader {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t num_nodes;
+  uint64_t k;
+  uint64_t seed;
+  uint64_t stream_offset;    // number of stream updates reflected in the checkpoint
+  uint64_t supernode_bytes;  // serialized size of a single supernode
+  uint64_t checkpoint_id;    // identifies this checkpoint to its incremental log
+  uint64_t base_id;          // the checkpoint the written graph was restored from, 0 if none
+};
+
+/*
+ * Beside every full checkpoint is an incremental log of the supernodes modified since.
+ * The log begins with a page holding a CheckpointLogHeader and is followed by records.
+ * Each record is a page holding a CheckpointLogRecord, the ids of its supernodes padded to
+ * a page and then the supernodes themselves padded to a page.
+ */
+struct CheckpointLogHeader {
+  uint64_t magic;
+  uint64_t checkpoint_id;    // the full checkpoint this log applies to
+};
+
+struct CheckpointLogRecord {
+  uint64_t magic;
+  uint64_t stream_offset;    // number of stream updates reflected once this record is applied
+  uint64_t num_supernodes;   // number of supernodes in this record
+};
+
+/*
+ * This class reads and writes sketch checkpoints. Supernodes are serialized and read by
+ * many threads at once, each with its own region of the file, so that loading and storing
+ * proceed at disk bandwidth.
+ */
+class SketchCheckpoint {
+ public:
+  /*
+   * Write a full checkpoint of the given supernodes and begin an empty incremental log.
+   * The file is written to a temporary path and renamed so that an existing checkpoint at
+   * path is never left partially written.
+   * @param path        where to place the checkpoint.
+   * @param header      the header of the checkpoint. magic, version and id are filled in.
+   * @param supernodes  the header.num_nodes supernodes to write.
+   * @param begin_log   if false the log is neither created nor truncated. A log left by an
+   *                    earlier checkpoint at path has a different id and is not replayed.
+   * @return            the id of the new checkpoint.
+   */
+  static uint64_t write(const std::string &path, CheckpointHeader header, Supernode **supernodes,
+                        bool begin_log = true);
+
+  /*
+   * Read and validate the header of a checkpoint
+   */
+  static CheckpointHeader read_header(const std::string &path);
+
+  /*
+   * Read every supernode of a checkpoint. load is called concurrently by many threads,
+   * once for each node, with a stream positioned at the start of that node's supernode.
+   */
+  static void read_supernodes(const std::string &path, const CheckpointHeader &header,
+                              const std::function<void(node_id_t, std::istream &)> &load);
+
+  /*
+   * Append a record containing the given supernodes to the incremental log of a checkpoint.
+   * The record is only valid once it has been completely written.
+   * @param path           the path of the full checkpoint.
+   * @param log_end        the end of the last valid record of the log.
+   * @param stream_offset  the number of stream updates reflected by the record.
+   * @param nodes          the ids of the supernodes to write.
+   * @return               the end of the new record.
+   */
+  static uint64_t append_log(const std::string &path, uint64_t log_end, uint64_t stream_offset,
+                             const std::vector<node_id_t> &nodes, Supernode **supernodes,
+                             uint64_t supernode_bytes);
+
+  /*
+   * Apply the records of the incremental log of a checkpoint in order. load is called as in
+   * read_supernodes() and a later record replaces the supernodes of an earlier one.
+   * @param stream_offset  set to the stream offset of the last record applied.
+   * @return               the end of the last valid record or 0 if there is no valid log.
+   */
+  static uint64_t replay_log(const std::string &path, const CheckpointHeader &header,
+                             uint64_t &stream_offset,
+                             const std::function<void(node_id_t, std::istream &)> &load);
+
+  // the number of bytes a log record of num_supernodes supernodes occupies
+  static uint64_t log_record_bytes(uint64_t num_supernodes, uint64_t supernode_bytes) {
+    return page_size + round_to_page(num_supernodes * sizeof(node_id_t)) +
+           round_to_page(num_supernodes * supernode_bytes);
+  }
+
+  static std::string log_path(const std::string &path) { return path + ".log"; }
+
+  static uint64_t round_to_page(uint64_t bytes) {
+    return (bytes + page_size - 1) / page_size * page_size;
+  }
+
+  static constexpr uint64_t magic_number = 0x4b4843534e444cull; // "LDNSCHK"
+  static constexpr uint64_t log_magic_number = 0x474f4c534e444cull; // "LDNSLOG"
+  static constexpr uint64_t record_magic_number = 0x434552534e444cull; // "LDNSREC"
+  static constexpr uint64_t version = 2;
+  static constexpr size_t page_size = 4096;
+  static constexpr size_t chunk_bytes = 8 * 1024 * 1024; // bytes read or written per call
+
+ private:
+  // serialize num supernodes to the file at offset. get(i) returns the i-th supernode
+  static void write_supernodes(int fd, const std::string &path, uint64_t offset, size_t num,
+                               uint64_t supernode_bytes,
+                               const std::function<Supernode *(size_t)> &get);
+
+  // read num supernodes from the file at offset. node(i) returns the id of the i-th supernode
+  static void read_supernodes(int fd, const std::string &path, uint64_t offset, size_t num,
+                              uint64_t supernode_bytes,
+                              const std::function<node_id_t(size_t)> &node,
+                              const std::function<void(node_id_t, std::istream &)> &load);
+};
@@ -1,13 +1,17 @@
 #pragma once
+#include <array>
 #include <mutex>
 #include <sstream>
 #include <condition_variable>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <mpi.h>
 
 #include <guttering_system.h>
 #include <worker_cluster.h>
+#include "numa_placement.h"
+#include "cluster_metrics.h"
 
 // forward declarations
 class GraphDistribUpdate;
@@ -35,6 +39,12 @@ public:
   static void pause_workers();    // pause the WorkDistributors before CC
   static void unpause_workers();  // unpause the WorkDistributors to resume updates
 
+  /**
+   * Pin the threads of each WorkDistributor, and its helper threads, to a NUMA node. The
+   * WorkDistributors are assigned to NUMA nodes round robin. NO_NUMA unpins the threads.
+   */
+  static void pin_workers(NumaPolicy policy);
+
   /**
    * Returns whether the current thread is paused.
    */
@@ -52,8 +62,32 @@ public:
   }
 
   static bool is_shutdown() { return shutdown; }
+
+  // the number of batches waiting in batch messages that have not yet been sent
+  static size_t unsent_batches();
+
+  /*
+   * If enabled, pairs of identical updates within a batch are removed before the batch is
+   * sent or processed locally. cancelled_updates() returns how many updates were removed,
+   * each of which saved sizeof(node_id_t) bytes of network traffic if it would have been sent
+   * and the hashing of one update to every sketch of its supernode. Disabled again by
+   * start_workers().
+   */
+  static void set_cancel_duplicates(bool cancel) { cancel_duplicates = cancel; }
+  static uint64_t cancelled_updates() { return cancelled_local + cancelled_sent; }
+  static uint64_t cancelled_bytes() { return cancelled_sent * sizeof(node_id_t); }
   static constexpr size_t local_process_cutoff = 400;
+
+  // when every worker of a WorkDistributor is at least this utilized, as reported by their
+  // heartbeats, the WorkDistributor processes DataNodes of up to twice local_process_cutoff
+  // updates per batch locally rather than queueing them behind the workers
+  static constexpr double saturated_utilization = 0.9;
   static constexpr size_t num_helper_threads = 4;
+
+  // batches of small DataNodes are combined into one message until it holds coalesce_batches
+  // batches or the oldest batch has waited coalesce_deadline, even if no DataNode follows
+  static constexpr size_t coalesce_batches = 3 * WorkerCluster::num_batches / 4;
+  static constexpr std::chrono::microseconds coalesce_deadline{200};
 private:
   /**
    * Create a WorkDistributor object by setting metadata and spinning up a thread.
@@ -79,23 +113,45 @@ private:
     return nullptr;
   }
 
-  // send data_buffer to distributed worker for processing
+  // add the batches of data to the batch message, sending it once it is full enough
   void send_batches(WorkQueue::DataNode *data);
+  void send_pending_batches(); // send the batch message if it holds any batches. Hold send_lock
+
+  // sends the batch message once its oldest batch reaches coalesce_deadline
+  void do_coalesce_work();
 
   void do_send_work(); // function which runs to send batches
   void do_recv_work(); // function which runs to recieve deltas
+
+  // recieve the heartbeats of the workers until each has sent its final heartbeat
+  static void recv_heartbeats();
   int id;
   GraphDistribUpdate *graph;
   GutteringSystem *gts;
 
   std::atomic<uint64_t> num_updates;
   bool thr_paused;       // indicates if this WorkDistributor is paused
+  std::atomic<int> numa_node; // NUMA node this WorkDistributor is pinned to or -1
+  // the batch message is built by the send thread and sent by it or by the coalesce thread
+  std::mutex send_lock;
+  std::condition_variable coalesce_condition; // a batch message began or stop_coalescing
+  bool stop_coalescing = false;
   char* send_buf;
+  size_t send_bytes = 0;   // size of the batch message in send_buf
+  size_t send_batch_count = 0; // number of batches in the batch message
+  std::chrono::steady_clock::time_point send_oldest; // when the first batch was added
+
+  // span of the last call to get_data and of the get_data that began the batch message
+  std::chrono::steady_clock::time_point get_data_start, get_data_end;
+  std::chrono::steady_clock::time_point msg_get_data_start, msg_get_data_end;
+
   char* recv_buf;
   std::thread thr;       // Work Distributor thread that sends batches and does other things
   std::thread delta_thr; // helper thread that recieves deltas
+  std::thread coalesce_thr; // helper thread that sends batch messages past their deadline
   size_t outstanding_deltas = 0;
   Supernode *local_supernodes[num_helper_threads]; // For processing updates locally
+  std::vector<node_id_t> local_dests[num_helper_threads]; // Batches after cancelling duplicates
 
   // memory buffers involved in cluster communication for reuse between messages
   Supernode *network_supernode;
@@ -108,6 +164,14 @@ private:
   static std::mutex pause_lock;
   static int work_distrib_threads;
   static std::atomic<uint64_t> proc_locally;
+  static std::atomic<bool> cancel_duplicates;
+  static std::atomic<uint64_t> cancelled_local; // updates cancelled from local batches
+  static std::atomic<uint64_t> cancelled_sent;  // updates cancelled from sent batches
+
+  static std::thread heartbeat_thread;
+  static std::atomic<bool> stop_heartbeats; // stop recieving heartbeats before the final ones
+  // saturated[fid - 1] is true if every worker of forwarder fid is saturated
+  static std::array<std::atomic<bool>, WorkerCluster::num_msg_forwarders> saturated;
 
   // configuration
   static node_id_t supernode_size;
@@ -3,8 +3,12 @@
 #include <types.h>
 #include <guttering_system.h>
 
+#include <algorithm>
 #include <sstream>
 
+#include "batch_tracer.h"
+#include "memstream.h"
+
 typedef std::pair<node_id_t, std::vector<node_id_t>> batch_t;
 enum MessageCode {
   INIT,            // Initialize a process
@@ -13,11 +17,38 @@ enum MessageCode {
   QUERY,           // Perform a query across a set of sketches for main
   FLUSH,           // Tell worker to flush all its local buffers
   STOP,            // Tell the process to wait for new init message
-  SHUTDOWN         // Tell the process to shutdown
+  SHUTDOWN,        // Tell the process to shutdown
+  HEARTBEAT        // Periodic statistics from a distributed worker to main
 };
 
 class GraphDistribUpdate;
 
+/*
+ * Statistics a DistributedWorker reports with each FLUSH. Every count is since the last INIT
+ */
+struct WorkerStats {
+  int32_t worker_id;
+  uint32_t padding;
+  uint64_t updates;      // updates processed
+  uint64_t batch_msgs;   // batch messages processed
+  uint64_t delta_bytes;  // bytes of deltas returned to main
+  uint64_t busy_nanos;   // time spent generating deltas, summed over threads
+};
+
+/*
+ * The HEARTBEAT a DistributedWorker sends to main periodically while initialized
+ */
+struct WorkerHeartbeat {
+  WorkerStats stats;
+  uint64_t uptime_nanos;     // time since the last INIT
+  uint64_t buffer_bytes;     // memory of the message buffers and delta supernodes
+  uint64_t resident_bytes;   // memory of the resident deltas
+  uint32_t helper_threads;   // threads that generate deltas
+  uint32_t idle_handlers;    // message handlers waiting for a batch message
+  uint32_t pending_returns;  // messages of deltas waiting to be returned to main
+  uint32_t last;             // 1 if this is the final heartbeat before the worker stops
+};
+
 /*
  * This class provides communication infrastructure for the DistributedWorkers
  * and WorkDistributors.
@@ -60,6 +91,14 @@ private:
    */
   static MessageCode recv_message_from(int source, char* msg_addr, int& msg_size);
 
+  /*
+   * The DistributedWorkers served by the message forwarders with id fid are the workers
+   * with index first to last - 1, where the index of a worker is its process id minus
+   * distrib_worker_offset
+   */
+  static void forwarder_workers(int fid, int& first, int& last);
+  static int forwarder_of_worker(int worker_idx); // the fid of the forwarders that serve a worker
+
   /*
    * DistributedWorker: Take a message and parse it into a vector of batches
    * @param msg_addr   The address of the message
@@ -76,20 +115,42 @@ private:
    */
   static void serialize_delta(const node_id_t node_idx, Supernode &delta, std::ostream &serial_str);
 
+  /*
+   * WorkDistributor: Parse a message of deltas, calling apply(node_idx, delta) for each
+   * @param msg_buffer  Message buffer containing the serialized deltas
+   * @param msg_size    The size of the serialized deltas
+   * @param delta       The Supernode memory each delta is parsed into
+   */
+  template <class Apply>
+  static void parse_deltas(char* msg_buffer, int msg_size, Supernode* delta, Apply apply) {
+    imemstream msg_stream(msg_buffer, msg_size);
+    for (node_id_t d = 0; d < num_batches && msg_stream.tellg() < msg_size; d++) {
+      // read node_idx and Supernode from message
+      node_id_t node_idx;
+      msg_stream.read((char *) &node_idx, sizeof(node_id_t));
+      Supernode::makeSupernode(num_nodes, seed, msg_stream, delta);
+      apply(node_idx, delta);
+    }
+  }
+
   friend class WorkDistributor;       // class that sends out work
   friend class DistributedWorker;     // class that does work
   friend class BatchMessageForwarder; // class that forwards messages from WD to DW
   friend class DeltaMessageForwarder; // class that forwards messages from DW to WD
+  friend class WorkerClusterBench;    // microbenchmarks of the private hot paths
+  friend class BatchCapture;          // replays captured batch messages
 public:
   /*
    * WorkDistributor: Starts a worker cluster and spins up WorkDistributor threads
    * @param num_nodes   Number of nodes in the graph
    * @param seed        Random seed utilized by graph
    * @param batch_size  The size, in bytes, of a single batch
+   * @param resident_deltas  If true the DistributedWorkers accumulate deltas and only
+   *                         return them when flushed
    * @return            The number of workers in the cluster
    */
  static int start_cluster(node_id_t num_nodes, uint64_t seed, int batch_size,
-                          double sketches_factor);
+                          double sketches_factor, bool resident_deltas = false);
 
  /*
   * WorkDistributor: Tell the cluster that the current GraphDistribUpdate is stopping
@@ -104,13 +165,40 @@ public:
  static void shutdown_cluster();
 
  /*
-  * WorkDistributor: use this function to send a batch of updates to
+  * WorkDistributor: append the non-empty batches to a batch message so that the batches of
+  * many DataNodes may be sent to a DistributedWorker in a single message
+  * @param batches     The batches to serialize
+  * @param msg_buffer  The batch message
+  * @param msg_bytes   The current size of the message, updated to its new size
+  * @param cancelled   Incremented by the number of updates that were cancelled
+  * @param cancel      If true, pairs of identical updates within a batch are not serialized
+  * @return            The number of batches appended to the message
+  */
+ static size_t serialize_batches(const std::vector<update_batch>& batches, char* msg_buffer,
+                                 size_t& msg_bytes, size_t& cancelled, bool cancel = false);
+
+ /*
+  * WorkDistributor: use this function to send a message of batches to
   * a DistributedWorker
   * @param wid         The id of the DistributedWorker to send to
-  * @param batches     The data to send to the distributed worker
-  * @param msg_buffer  Memory buffer to use for recieving a message
+  * @param msg_buffer  The message created by serialize_batches()
+  * @param msg_bytes   The size of the message
+  */
+ static void send_batches(int wid, char* msg_buffer, size_t msg_bytes);
+
+ // the number of bytes a batch occupies in a batch message
+ static size_t batch_bytes(const update_batch& batch) {
+   return (batch.upd_vec.size() + 2) * sizeof(node_id_t);
+ }
+
+ /*
+  * Sort the destinations of a batch and remove pairs of identical destinations. Sketch
+  * updates are XORs, so an edge updated an even number of times has no effect on the sketch.
+  * @param dests      The destinations of the batch.
+  * @param num_dests  The number of destinations.
+  * @return           The number of destinations that remain at the start of dests.
   */
- static void send_batches(int wid, const std::vector<update_batch>& batches, char* msg_buffer);
+ static node_id_t cancel_duplicate_updates(node_id_t *dests, node_id_t num_dests);
 
  /*
   * WorkDistributor: use this function to wait for the deltas to be returned
@@ -138,7 +226,37 @@ public:
   */
  static void send_upds_processed(uint64_t num_updates);
 
+ /*
+  * DistributedWorker: send a heartbeat to main
+  */
+ static void send_heartbeat(const WorkerHeartbeat& heartbeat);
+
+ /*
+  * WorkDistributor: recieve a heartbeat from any DistributedWorker if one has arrived
+  * @return  false if no heartbeat was waiting
+  */
+ static bool try_recv_heartbeat(WorkerHeartbeat& heartbeat);
+
  static bool is_active() { return active; }
+ static int get_num_workers() { return num_workers; }
+
+ // the largest batch message, including its trailer, when each batch holds at most batch_size
+ // updates
+ static int batch_msg_size(int batch_size) {
+   return (2*sizeof(node_id_t) + sizeof(node_id_t) * batch_size) * num_batches + sizeof(int)
+          + BatchTracer::trailer_bytes;
+ }
+
+ // the largest delta message, num_batches deltas of supernode_bytes serialized bytes each
+ // and the trailer of their batch message
+ static int delta_msg_size(size_t supernode_bytes) {
+   return (sizeof(node_id_t) + supernode_bytes) * num_batches + BatchTracer::trailer_bytes;
+ }
+
+ // every message of a cluster whose batches hold at most batch_size updates fits in this
+ static int max_msg_size_of(int batch_size, size_t supernode_bytes) {
+   return std::max(batch_msg_size(batch_size), delta_msg_size(supernode_bytes));
+ }
 
  static constexpr size_t num_batches = 32;  // the number of Supernodes updated by each batch_msg
 
@@ -0,0 +1,125 @@
+#include "batch_capture.h"
+#include "batch_tracer.h"
+#include "worker_cluster.h"
+
+#include <graph.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <mpi.h>
+
+constexpr uint64_t BatchCapture::capture_magic;
+bool BatchCapture::capture_enabled = false;
+double BatchCapture::sample_rate = 0;
+uint64_t BatchCapture::max_messages = 0;
+std::string BatchCapture::capture_dir;
+int BatchCapture::rank = 0;
+int BatchCapture::num_inits = 0;
+std::ofstream BatchCapture::out;
+uint64_t BatchCapture::num_seen = 0;
+uint64_t BatchCapture::num_captured = 0;
+
+void BatchCapture::setup() {
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  // main decides whether to capture and shares the decision with every process
+  char dir[4096] = {};
+  if (rank == 0) {
+    const char *env_dir = std::getenv("LANDSCAPE_CAPTURE_DIR");
+    const char *env_rate = std::getenv("LANDSCAPE_CAPTURE_RATE");
+    const char *env_limit = std::getenv("LANDSCAPE_CAPTURE_LIMIT");
+    if (env_dir != nullptr) strncpy(dir, env_dir, sizeof(dir) - 1);
+    sample_rate = env_rate != nullptr ? std::atof(env_rate) : 0.01;
+    max_messages = env_limit != nullptr ? std::strtoull(env_limit, nullptr, 10) : 100000;
+  }
+  MPI_Bcast(dir, sizeof(dir), MPI_CHAR, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&sample_rate, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&max_messages, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+  capture_dir = dir;
+  capture_enabled = !capture_dir.empty() && sample_rate > 0 && max_messages > 0;
+}
+
+void BatchCapture::begin(const CaptureParams &params) {
+  if (!capture_enabled) return;
+  end();
+
+  std::string path = capture_dir + "/capture_" + std::to_string(rank) + "_" +
+                     std::to_string(num_inits++) + ".bin";
+  out.open(path, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    std::cerr << "BatchCapture: could not create capture file " << path << std::endl;
+    return;
+  }
+  out.write((const char *) &capture_magic, sizeof(capture_magic));
+  out.write((const char *) &params.num_nodes, sizeof(params.num_nodes));
+  out.write((const char *) &params.seed, sizeof(params.seed));
+  out.write((const char *) &params.sketches_factor, sizeof(params.sketches_factor));
+  out.write((const char *) &params.max_msg_size, sizeof(params.max_msg_size));
+  num_seen = 0;
+  num_captured = 0;
+}
+
+void BatchCapture::record(const char *msg, int msg_size) {
+  if (!out.is_open() || num_captured >= max_messages) return;
+
+  // capture evenly spaced messages, a sample_rate fraction of them
+  ++num_seen;
+  if ((uint64_t) (num_seen * sample_rate) == (uint64_t) ((num_seen - 1) * sample_rate)) return;
+
+  // the trailer is not part of the batches
+  BatchTracer::Trailer trailer;
+  if (BatchTracer::find_trailer(msg, msg_size, trailer)) msg_size -= BatchTracer::trailer_bytes;
+  out.write((const char *) &msg_size, sizeof(msg_size));
+  out.write(msg, msg_size);
+  ++num_captured;
+}
+
+void BatchCapture::end() {
+  if (out.is_open()) out.close();
+}
+
+bool BatchCapture::read(const std::string &path, CaptureParams &params,
+                        std::vector<std::vector<char>> &messages) {
+  std::ifstream in(path, std::ios::binary);
+  uint64_t magic = 0;
+  in.read((char *) &magic, sizeof(magic));
+  if (!in || magic != capture_magic) return false;
+  in.read((char *) &params.num_nodes, sizeof(params.num_nodes));
+  in.read((char *) &params.seed, sizeof(params.seed));
+  in.read((char *) &params.sketches_factor, sizeof(params.sketches_factor));
+  in.read((char *) &params.max_msg_size, sizeof(params.max_msg_size));
+  if (!in) return false;
+
+  int msg_size;
+  while (in.read((char *) &msg_size, sizeof(msg_size))) {
+    if (msg_size < 0 || msg_size > params.max_msg_size) return false;
+    std::vector<char> msg(msg_size);
+    if (!in.read(msg.data(), msg_size)) return false;
+    messages.push_back(std::move(msg));
+  }
+  return true;
+}
+
+void BatchCapture::configure(const CaptureParams &params) {
+  Supernode::configure(params.num_nodes, Supernode::default_num_columns, params.sketches_factor);
+  WorkerCluster::num_nodes = params.num_nodes;
+  WorkerCluster::seed = params.seed;
+  WorkerCluster::max_msg_size = params.max_msg_size;
+}
+
+size_t BatchCapture::process_message(char *msg, int msg_size, Supernode *delta,
+                                     std::ostream &serial_str) {
+  std::vector<batch_t> batches;
+  WorkerCluster::parse_batches(msg, msg_size, batches);
+
+  size_t num_updates = 0;
+  for (batch_t &batch : batches) {
+    num_updates += batch.second.size();
+    Graph::generate_delta_node(WorkerCluster::num_nodes, WorkerCluster::seed, batch.first,
+                               batch.second, delta);
+    WorkerCluster::serialize_delta(batch.first, *delta, serial_str);
+  }
+  return num_updates;
+}
@@ -0,0 +1,171 @@
+#include "batch_tracer.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include <mpi.h>
+
+constexpr size_t BatchTracer::trailer_bytes;
+constexpr uint64_t BatchTracer::trailer_magic;
+constexpr int BatchTracer::sync_tag;
+constexpr int BatchTracer::sync_rounds;
+constexpr size_t BatchTracer::max_buffered_events;
+bool BatchTracer::trace_enabled = false;
+double BatchTracer::sample_rate = 0;
+std::string BatchTracer::trace_dir;
+int BatchTracer::rank = 0;
+int64_t BatchTracer::clock_offset_ns = 0;
+std::atomic<uint64_t> BatchTracer::next_trace{0};
+std::mutex BatchTracer::events_lock;
+std::vector<BatchTracer::TraceEvent> BatchTracer::events;
+std::mutex BatchTracer::write_lock;
+
+void BatchTracer::setup() {
+  int num_ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+  // main decides whether to trace and shares the decision with every process
+  char dir[4096] = {};
+  if (rank == 0) {
+    const char *env_dir = std::getenv("LANDSCAPE_TRACE_DIR");
+    const char *env_rate = std::getenv("LANDSCAPE_TRACE_RATE");
+    if (env_dir != nullptr) strncpy(dir, env_dir, sizeof(dir) - 1);
+    sample_rate = env_rate != nullptr ? std::atof(env_rate) : 0.01;
+  }
+  MPI_Bcast(dir, sizeof(dir), MPI_CHAR, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&sample_rate, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  trace_dir = dir;
+  trace_enabled = !trace_dir.empty() && sample_rate > 0;
+  if (!trace_enabled) return;
+
+  clock_offset_ns = sync_clock(rank, num_ranks);
+
+  // begin the trace file of this process
+  std::ofstream out(trace_dir + "/trace_" + std::to_string(rank) + ".txt", std::ios::trunc);
+  if (!out.is_open()) {
+    std::cerr << "BatchTracer: could not create trace file in " << trace_dir << std::endl;
+    return;
+  }
+  out << "rank " << rank << " offset_ns " << clock_offset_ns << "\n";
+}
+
+int64_t BatchTracer::sync_clock(int rank, int num_ranks) {
+  if (rank == 0) {
+    // answer each request with the current time of main
+    for (int r = 1; r < num_ranks; r++) {
+      for (int i = 0; i < sync_rounds; i++) {
+        MPI_Recv(nullptr, 0, MPI_CHAR, r, sync_tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        int64_t now = to_ns(std::chrono::steady_clock::now());
+        MPI_Send(&now, 1, MPI_INT64_T, r, sync_tag, MPI_COMM_WORLD);
+      }
+    }
+    return 0;
+  }
+
+  // main's time was read about halfway between sending the request and getting the answer
+  int64_t best_delay = INT64_MAX;
+  int64_t offset = 0;
+  for (int i = 0; i < sync_rounds; i++) {
+    int64_t sent = to_ns(std::chrono::steady_clock::now());
+    MPI_Send(nullptr, 0, MPI_CHAR, 0, sync_tag, MPI_COMM_WORLD);
+    int64_t main_time;
+    MPI_Recv(&main_time, 1, MPI_INT64_T, 0, sync_tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    int64_t received = to_ns(std::chrono::steady_clock::now());
+    if (received - sent < best_delay) {
+      best_delay = received - sent;
+      offset = main_time - (sent + received) / 2;
+    }
+  }
+  return offset;
+}
+
+uint64_t BatchTracer::sample() {
+  if (!trace_enabled) return 0;
+  thread_local uint64_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+  // xorshift is plenty to pick a fraction of the messages
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  if ((state >> 11) / 9007199254740992.0 >= sample_rate) return 0; // uniform in [0, 1)
+  return next_trace.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void BatchTracer::record(uint64_t trace_id, TraceStage stage, time_point begin, time_point end) {
+  if (trace_id == 0) return;
+  uint64_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+  std::vector<TraceEvent> to_write;
+  {
+    std::lock_guard<std::mutex> lk(events_lock);
+    events.push_back({trace_id, stage, to_ns(begin), to_ns(end), thread});
+    if (events.size() < max_buffered_events) return;
+    to_write.swap(events);
+  }
+  write_events(to_write);
+}
+
+void BatchTracer::write() {
+  if (!trace_enabled) return;
+  std::vector<TraceEvent> to_write;
+  {
+    std::lock_guard<std::mutex> lk(events_lock);
+    to_write.swap(events);
+  }
+  write_events(to_write);
+}
+
+void BatchTracer::write_events(const std::vector<TraceEvent> &to_write) {
+  if (to_write.empty()) return;
+
+  std::lock_guard<std::mutex> lk(write_lock);
+  std::ofstream out(trace_dir + "/trace_" + std::to_string(rank) + ".txt", std::ios::app);
+  if (!out.is_open()) {
+    std::cerr << "BatchTracer: could not open trace file in " << trace_dir << std::endl;
+    return;
+  }
+  for (auto &event : to_write) {
+    out << event.trace_id << " " << stage_name(event.stage) << " " << event.begin_ns << " "
+        << event.end_ns << " " << event.thread % 1000000 << "\n";
+  }
+}
+
+bool BatchTracer::read(const std::string &path, int &rank, std::vector<TraceEvent> &events) {
+  std::ifstream in(path);
+  std::string word;
+  int64_t offset_ns;
+  if (!(in >> word >> rank >> word >> offset_ns)) return false;
+
+  TraceEvent event;
+  std::string stage;
+  while (in >> event.trace_id >> stage >> event.begin_ns >> event.end_ns >> event.thread) {
+    event.stage = stage_of(stage);
+    event.begin_ns += offset_ns;
+    event.end_ns += offset_ns;
+    events.push_back(event);
+  }
+  return true;
+}
+
+std::string BatchTracer::stage_name(TraceStage stage) {
+  switch (stage) {
+    case TRACE_GET_DATA:        return "get_data";
+    case TRACE_SEND_BATCHES:    return "send_batches";
+    case TRACE_FWD_BATCH:       return "forward_batch";
+    case TRACE_PARSE_BATCHES:   return "parse_batches";
+    case TRACE_GENERATE_DELTAS: return "generate_deltas";
+    case TRACE_RETURN_DELTAS:   return "return_deltas";
+    case TRACE_FWD_DELTA:       return "forward_delta";
+    case TRACE_APPLY_DELTAS:    return "apply_deltas";
+    default:                    return "unknown";
+  }
+}
+
+TraceStage BatchTracer::stage_of(const std::string &name) {
+  for (int s = 0; s < NUM_TRACE_STAGES; s++)
+    if (stage_name((TraceStage) s) == name) return (TraceStage) s;
+  return NUM_TRACE_STAGES;
+}
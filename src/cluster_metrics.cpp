@@ -0,0 +1,195 @@
+#include "cluster_metrics.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+constexpr int LatencyHistogram::sub_bucket_bits;
+constexpr int LatencyHistogram::sub_buckets;
+constexpr int LatencyHistogram::num_buckets;
+constexpr int ClusterMetrics::num_shards;
+std::array<ClusterMetrics::Shard, ClusterMetrics::num_shards> ClusterMetrics::shards;
+std::atomic<int> ClusterMetrics::next_shard{0};
+std::mutex ClusterMetrics::workers_lock;
+std::map<int, WorkerStats> ClusterMetrics::workers;
+std::map<int, ClusterMetrics::HeartbeatRecord> ClusterMetrics::heartbeats;
+std::array<ClusterMetrics::ForwarderMetrics, WorkerCluster::num_msg_forwarders>
+    ClusterMetrics::forwarders;
+std::unique_ptr<LatencyHistogram[]> ClusterMetrics::worker_round_trips;
+size_t ClusterMetrics::num_round_trip_workers = 0;
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+  if (count == 0) return 0;
+  uint64_t rank = p / 100 * count;
+  if (rank >= count) rank = count - 1;
+
+  uint64_t seen = 0;
+  for (size_t b = 0; b < buckets.size(); b++) {
+    seen += buckets[b];
+    if (seen > rank) {
+      // report the middle of the bucket, but never more than the largest latency
+      uint64_t low = LatencyHistogram::bucket_low(b);
+      uint64_t high = b + 1 < buckets.size() ? LatencyHistogram::bucket_low(b + 1) : low;
+      uint64_t mid = low + (high - low) / 2;
+      return mid < max ? mid : max;
+    }
+  }
+  return max;
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot &oth) {
+  if (buckets.size() < oth.buckets.size()) buckets.resize(oth.buckets.size());
+  for (size_t b = 0; b < oth.buckets.size(); b++)
+    buckets[b] += oth.buckets[b];
+  count += oth.count;
+  sum += oth.sum;
+  if (oth.max > max) max = oth.max;
+}
+
+uint64_t HistogramSnapshot::count_below(uint64_t nanos) const {
+  uint64_t ret = 0;
+  for (size_t b = 0; b + 1 < buckets.size(); b++) {
+    if (LatencyHistogram::bucket_low(b + 1) > nanos + 1) break; // bucket may exceed nanos
+    ret += buckets[b];
+  }
+  return ret;
+}
+
+HistogramSnapshot LatencyHistogram::snapshot() const {
+  HistogramSnapshot ret;
+  ret.buckets.resize(num_buckets);
+  for (int b = 0; b < num_buckets; b++) {
+    ret.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+    ret.count += ret.buckets[b]; // consistent with the buckets even while recording continues
+  }
+  ret.sum = sum.load(std::memory_order_relaxed);
+  ret.max = max.load(std::memory_order_relaxed);
+  return ret;
+}
+
+void LatencyHistogram::reset() {
+  for (auto &bucket : buckets)
+    bucket.store(0, std::memory_order_relaxed);
+  count = 0;
+  sum = 0;
+  max = 0;
+}
+
+MetricsSnapshot ClusterMetrics::snapshot() {
+  MetricsSnapshot ret;
+  for (auto &shard : shards)
+    for (int s = 0; s < NUM_METRIC_STAGES; s++)
+      ret.stages[s].merge(shard.stages[s].snapshot());
+  for (auto &fwd : forwarders) {
+    ForwarderSnapshot snap;
+    snap.bytes_sent = fwd.bytes_sent.load(std::memory_order_relaxed);
+    snap.messages_sent = fwd.messages_sent.load(std::memory_order_relaxed);
+    snap.bytes_received = fwd.bytes_received.load(std::memory_order_relaxed);
+    snap.messages_received = fwd.messages_received.load(std::memory_order_relaxed);
+    snap.round_trip = fwd.round_trip.snapshot();
+    ret.forwarders.push_back(snap);
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(workers_lock);
+    for (auto &worker : workers)
+      ret.workers.push_back(worker.second);
+    for (size_t w = 0; w < num_round_trip_workers; w++)
+      ret.worker_round_trips.push_back(worker_round_trips[w].snapshot());
+  }
+  ret.health = worker_health();
+  return ret;
+}
+
+void ClusterMetrics::record_worker_stats(const char *msg, size_t msg_size) {
+  std::lock_guard<std::mutex> lk(workers_lock);
+  for (size_t offset = 0; offset + sizeof(WorkerStats) <= msg_size; offset += sizeof(WorkerStats)) {
+    WorkerStats stats;
+    memcpy(&stats, msg + offset, sizeof(WorkerStats));
+    workers[stats.worker_id] = stats;
+  }
+}
+
+WorkerHealth ClusterMetrics::record_heartbeat(const WorkerHeartbeat &heartbeat) {
+  std::lock_guard<std::mutex> lk(workers_lock);
+  int worker_id = heartbeat.stats.worker_id;
+  workers[worker_id] = heartbeat.stats;
+
+  // rates are since the previous heartbeat, or since INIT if this is the first
+  WorkerHeartbeat prev = {};
+  auto it = heartbeats.find(worker_id);
+  if (it != heartbeats.end() && it->second.last.uptime_nanos < heartbeat.uptime_nanos)
+    prev = it->second.last;
+
+  HeartbeatRecord &record = heartbeats[worker_id];
+  record.last = heartbeat;
+  record.received = std::chrono::steady_clock::now();
+
+  WorkerHealth &health = record.health;
+  health.worker_id = worker_id;
+  double interval = (heartbeat.uptime_nanos - prev.uptime_nanos) / 1e9;
+  if (interval > 0) {
+    double busy = (heartbeat.stats.busy_nanos - prev.stats.busy_nanos) / 1e9;
+    health.utilization = std::min(1.0, busy / interval / std::max(heartbeat.helper_threads, 1u));
+    health.updates_per_sec = (heartbeat.stats.updates - prev.stats.updates) / interval;
+  }
+  health.idle_handlers = heartbeat.idle_handlers;
+  health.pending_returns = heartbeat.pending_returns;
+  health.buffer_bytes = heartbeat.buffer_bytes;
+  health.resident_bytes = heartbeat.resident_bytes;
+  health.heartbeat_age = 0;
+  health.stopped = heartbeat.last;
+  return health;
+}
+
+std::vector<WorkerHealth> ClusterMetrics::worker_health() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<WorkerHealth> ret;
+  std::lock_guard<std::mutex> lk(workers_lock);
+  for (auto &worker : heartbeats) {
+    WorkerHealth health = worker.second.health;
+    health.heartbeat_age = std::chrono::duration<double>(now - worker.second.received).count();
+    ret.push_back(health);
+  }
+  return ret;
+}
+
+void ClusterMetrics::reset() {
+  for (auto &shard : shards)
+    for (auto &stage : shard.stages)
+      stage.reset();
+  for (auto &fwd : forwarders) {
+    fwd.bytes_sent = 0;
+    fwd.messages_sent = 0;
+    fwd.bytes_received = 0;
+    fwd.messages_received = 0;
+    fwd.round_trip.reset();
+  }
+  std::lock_guard<std::mutex> lk(workers_lock);
+  workers.clear();
+  heartbeats.clear();
+
+  // The number of workers is fixed for the life of the MPI job. The histograms are allocated
+  // by the first reset, before any WorkDistributor records, and only cleared after that
+  size_t num_workers = std::max(WorkerCluster::get_num_workers(), 0);
+  if (num_workers != num_round_trip_workers) {
+    assert(worker_round_trips == nullptr);
+    worker_round_trips.reset(new LatencyHistogram[num_workers]);
+    num_round_trip_workers = num_workers;
+  }
+  for (size_t w = 0; w < num_round_trip_workers; w++)
+    worker_round_trips[w].reset();
+}
+
+std::string ClusterMetrics::stage_name(MetricStage stage) {
+  switch (stage) {
+    case QUEUE_WAIT_TIME:  return "queue_wait";
+    case COALESCE_TIME:    return "coalesce";
+    case SEND_TIME:        return "send";
+    case ROUND_TRIP_TIME:  return "round_trip";
+    case DELTA_APPLY_TIME: return "delta_apply";
+    case LOCAL_TIME:       return "local_process";
+    case FLUSH_TIME:       return "flush";
+    default:               return "unknown";
+  }
+}
@@ -1,28 +1,39 @@
 #include "distributed_worker.h"
 #include "worker_cluster.h"
 #include "graph_distrib_update.h"
+#include "batch_tracer.h"
+#include "memory_report.h"
 
 #include <mpi.h>
+#include <omp.h>
+#include <cassert>
+#include <chrono>
 #include <iostream>
 #include <thread>
 
-DistributedWorker::DistributedWorker(int _id) : id(_id) {
+constexpr std::chrono::milliseconds DistributedWorker::heartbeat_interval;
+
+DistributedWorker::DistributedWorker(int _id, int _machine_processes)
+    : id(_id), idle_handlers(0), pending_returns(0), num_resident_deltas(0),
+      machine_processes(_machine_processes) {
+  helper_threads = std::thread::hardware_concurrency();
   init_worker();
   running = true;
 
   // Create recieve message queue (send message queue starts empty)
-  helper_threads = std::thread::hardware_concurrency();
   for (size_t i = 0; i < 2 * helper_threads; i++) {
     BatchesToDeltasHandler msg_handler(max_msg_size, WorkerCluster::num_batches);
     MsgBufferQueue<BatchesToDeltasHandler>::QueueElm* q_elm =
         new MsgBufferQueue<BatchesToDeltasHandler>::QueueElm(msg_handler);
     recv_msg_queue.emplace_back(q_elm);
   }
+  idle_handlers = recv_msg_queue.size();
 
   // std::cout << "Successfully started distributed worker " << id << "!" << std::endl;
   run();
 }
 DistributedWorker::~DistributedWorker() {
+  stop_heartbeats();
   if (recv_msg_queue.size() != 2 * helper_threads) {
     std::cerr << "WARNING: recv queue not full when deleting DeltaNode -- memory leak" << std::endl;
   }
@@ -33,6 +44,9 @@ DistributedWorker::~DistributedWorker() {
 
 void DistributedWorker::run() {
   num_updates = 0;
+  num_batch_msgs = 0;
+  num_delta_bytes = 0;
+  busy_nanos = 0;
 #pragma omp parallel num_threads(helper_threads + 1)
 #pragma omp single
   {
@@ -45,6 +59,7 @@ void DistributedWorker::run() {
 
       MsgBufferQueue<BatchesToDeltasHandler>::QueueElm* q_elm = recv_msg_queue.front();
       recv_msg_queue.pop_front();
+      idle_handlers = recv_msg_queue.size();
 
       // Extract stuff from the data_handler
       // std::cout << "DistributedWorker: " << id << " waiting for message ..." << std::endl;
@@ -53,15 +68,25 @@ void DistributedWorker::run() {
 
       if (code == BATCH) {
         // std::cout << "DistributedWorker: " << id << " batch message" << std::endl;
-#pragma omp task firstprivate(q_elm, msg_size) default(none) shared(num_updates)
+#pragma omp task firstprivate(q_elm, msg_size) default(none) \
+    shared(num_updates, num_batch_msgs, busy_nanos, pending_returns)
         {
+          auto start = std::chrono::steady_clock::now();
           char* recv_buffer = q_elm->data.batches_buffer;
           std::vector<delta_t>& deltas = q_elm->data.deltas;
           omemstream& stream = q_elm->data.serial_stream;
 
+          // strip the trailer before parsing
+          BatchTracer::Trailer& trailer = q_elm->data.trailer;
+          q_elm->data.has_trailer = BatchTracer::find_trailer(recv_buffer, msg_size, trailer);
+          if (q_elm->data.has_trailer) msg_size -= BatchTracer::trailer_bytes;
+          uint64_t trace_id = trailer.trace_id;
+
           // deserialize data -- get id and vector of batches
           std::vector<batch_t> batches;
           WorkerCluster::parse_batches(recv_buffer, msg_size, batches);
+          auto parsed = std::chrono::steady_clock::now();
+          BatchTracer::record(trace_id, TRACE_PARSE_BATCHES, start, parsed);
 
           // create deltas 
           for (size_t i = 0; i < batches.size(); i++) {
@@ -72,9 +97,16 @@ void DistributedWorker::run() {
             delta.node_idx = batch.first;
             Graph::generate_delta_node(num_nodes, seed, delta.node_idx, batch.second,
                                        delta.supernode);
-            WorkerCluster::serialize_delta(delta.node_idx, *delta.supernode, stream);
+            if (!resident || !accumulate_delta(delta))
+              WorkerCluster::serialize_delta(delta.node_idx, *delta.supernode, stream);
           }
+          auto generated = std::chrono::steady_clock::now();
+          BatchTracer::record(trace_id, TRACE_GENERATE_DELTAS, parsed, generated);
+          num_batch_msgs += 1;
+          busy_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+              generated - start).count();
           // this message is ready for sending back to main so push to send_msg_queue
+          ++pending_returns;
           send_msg_queue.push(q_elm);
         }
         // back on main thread. If recv_msg_queue is empty then send a message back to main
@@ -87,21 +119,33 @@ void DistributedWorker::run() {
         int destination_id = q_elm->data.msg_src;
         if (destination_id > WorkerCluster::leader_proc)
           destination_id = WorkerCluster::batch_fwd_to_delta_fwd(destination_id);
-        MPI_Send(nullptr, 0, MPI_CHAR, destination_id, FLUSH, MPI_COMM_WORLD);
+        if (resident) return_resident_deltas(destination_id, q_elm->data);
+        WorkerStats stats = get_stats();
+        MPI_Send(&stats, sizeof(stats), MPI_CHAR, destination_id, FLUSH, MPI_COMM_WORLD);
         recv_msg_queue.push_back(q_elm);
       }
       else if (code == STOP) {
+        free_resident_deltas();
         free(delta_node);
-        free(msg_buffer);
+        MsgBufferPool::put(msg_buffer);
+
+        // main waits for the final heartbeat of every worker
+        stop_heartbeats();
+        WorkerCluster::send_heartbeat(get_heartbeat(true));
         WorkerCluster::send_upds_processed(num_updates.load()); // send number of updates to main
 
         // std::cout << "Number of updates processed = " << num_updates << std::endl;
 
         num_updates = 0;
+        num_batch_msgs = 0;
+        num_delta_bytes = 0;
+        busy_nanos = 0;
         recv_msg_queue.push_back(q_elm);
         init_worker(); // wait for init
       }
       else if (code == SHUTDOWN) {
+        free_resident_deltas();
+        stop_heartbeats();
         running = false;
         // std::cout << "DistributedWorker " << id << " shutting down" << std::endl;
         // if (num_updates > 0) 
@@ -138,24 +182,167 @@ void DistributedWorker::init_worker() {
   memcpy(&max_msg_size, init_buffer + sizeof(num_nodes) + sizeof(seed), sizeof(max_msg_size));
   memcpy(&sketches_factor, init_buffer + sizeof(num_nodes) + sizeof(seed) + sizeof(max_msg_size),
          sizeof(sketches_factor));
+  memcpy(&resident, init_buffer + sizeof(num_nodes) + sizeof(seed) + sizeof(max_msg_size) +
+         sizeof(sketches_factor), sizeof(resident));
 
   // std::cout << "DistributedWorker: " << id << " initialized!" << std::endl;
 
   Supernode::configure(num_nodes, Supernode::default_num_columns, sketches_factor);
   delta_node = (Supernode *) malloc(Supernode::get_size());
-  msg_buffer = (char *) malloc(max_msg_size);
+  msg_buffer = MsgBufferPool::get(max_msg_size);
+
+  // one map of resident deltas for each thread that processes batches
+  resident_deltas.clear();
+  resident_deltas.resize(helper_threads + 1);
+  size_t resident_limit = MemoryReport::physical_memory_bytes() * resident_memory_fraction
+                         / machine_processes;
+  max_resident_per_thread = resident_limit / Supernode::get_size() / (helper_threads + 1);
+
+  init_time = std::chrono::steady_clock::now();
+  start_heartbeats();
 }
 
 void DistributedWorker::process_send_queue_elm() {
   MsgBufferQueue<BatchesToDeltasHandler>::QueueElm* q_elm = send_msg_queue.pop();
+  --pending_returns;
   auto& data = q_elm->data;
 
   int destination_id = data.msg_src;
   if (destination_id > WorkerCluster::leader_proc)
     destination_id = WorkerCluster::batch_fwd_to_delta_fwd(destination_id);
   // std::cout << "DistributedWorker: " << id << " returning deltas to " << data.msg_src << std::endl;
-  WorkerCluster::return_deltas(destination_id, data.serial_delta_mem, data.serial_stream.tellp());
+  // every delta of this message may have been accumulated as a resident delta
+  if (data.serial_stream.tellp() > 0) {
+    auto start = std::chrono::steady_clock::now();
+    size_t msg_bytes = data.serial_stream.tellp();
+    if (data.has_trailer) {
+      // max_msg_size leaves room for the trailer after num_batches deltas
+      assert(msg_bytes + BatchTracer::trailer_bytes <= (size_t) max_msg_size);
+      char trailer[BatchTracer::trailer_bytes];
+      data.trailer.worker_id = id;
+      BatchTracer::write_trailer(trailer, data.trailer);
+      data.serial_stream.write(trailer, BatchTracer::trailer_bytes);
+    }
+    WorkerCluster::return_deltas(destination_id, data.serial_delta_mem, data.serial_stream.tellp());
+    num_delta_bytes += data.serial_stream.tellp();
+    BatchTracer::record(data.trailer.trace_id, TRACE_RETURN_DELTAS, start,
+                        std::chrono::steady_clock::now());
+  }
   data.serial_stream.reset();  // reset omemstream back to the beginning
+  data.trailer = BatchTracer::Trailer();
+  data.has_trailer = false;
 
   recv_msg_queue.push_back(q_elm);  // we've dealt with this queue elm so place it in recv
+  idle_handlers = recv_msg_queue.size();
+}
+
+bool DistributedWorker::accumulate_delta(delta_t &delta) {
+  auto &deltas = resident_deltas[omp_get_thread_num()];
+  auto it = deltas.find(delta.node_idx);
+  if (it != deltas.end()) {
+    it->second->apply_delta_update(delta.supernode);
+    return true;
+  }
+  if (deltas.size() >= max_resident_per_thread)
+    return false; // out of memory for resident deltas so return this one to main
+
+  deltas[delta.node_idx] = Supernode::makeSupernode(*delta.supernode);
+  ++num_resident_deltas;
+  return true;
+}
+
+void DistributedWorker::return_resident_deltas(int destination_id, BatchesToDeltasHandler &handler) {
+  // combine the deltas of each thread so that every node is returned once
+  auto &combined = resident_deltas[0];
+  for (size_t t = 1; t < resident_deltas.size(); t++) {
+    for (auto &node_delta : resident_deltas[t]) {
+      auto it = combined.find(node_delta.first);
+      if (it == combined.end()) {
+        combined[node_delta.first] = node_delta.second;
+      } else {
+        it->second->apply_delta_update(node_delta.second);
+        free(node_delta.second);
+      }
+    }
+    resident_deltas[t].clear();
+  }
+
+  // return the deltas num_batches at a time, the same size as a regular DELTA message
+  omemstream &stream = handler.serial_stream;
+  stream.reset();
+  size_t in_msg = 0;
+  for (auto &node_delta : combined) {
+    WorkerCluster::serialize_delta(node_delta.first, *node_delta.second, stream);
+    free(node_delta.second);
+    if (++in_msg == WorkerCluster::num_batches) {
+      WorkerCluster::return_deltas(destination_id, handler.serial_delta_mem, stream.tellp());
+      num_delta_bytes += stream.tellp();
+      stream.reset();
+      in_msg = 0;
+    }
+  }
+  if (in_msg > 0) {
+    WorkerCluster::return_deltas(destination_id, handler.serial_delta_mem, stream.tellp());
+    num_delta_bytes += stream.tellp();
+  }
+  stream.reset();
+  combined.clear();
+  num_resident_deltas = 0;
+}
+
+void DistributedWorker::free_resident_deltas() {
+  for (auto &deltas : resident_deltas) {
+    for (auto &node_delta : deltas)
+      free(node_delta.second);
+    deltas.clear();
+  }
+  num_resident_deltas = 0;
+}
+
+WorkerStats DistributedWorker::get_stats() {
+  WorkerStats stats;
+  stats.worker_id = id;
+  stats.padding = 0;
+  stats.updates = num_updates;
+  stats.batch_msgs = num_batch_msgs;
+  stats.delta_bytes = num_delta_bytes;
+  stats.busy_nanos = busy_nanos;
+  return stats;
+}
+
+WorkerHeartbeat DistributedWorker::get_heartbeat(bool last) {
+  WorkerHeartbeat heartbeat;
+  heartbeat.stats = get_stats();
+  heartbeat.uptime_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - init_time).count();
+  // each message handler holds num_batches delta supernodes. The pool holds every buffer
+  size_t handler_supernodes = 2 * helper_threads * WorkerCluster::num_batches + 1;
+  heartbeat.buffer_bytes = MsgBufferPool::bytes_mapped() + handler_supernodes * Supernode::get_size();
+  heartbeat.resident_bytes = num_resident_deltas * Supernode::get_size();
+  heartbeat.helper_threads = helper_threads + 1; // the main thread also generates deltas
+  heartbeat.idle_handlers = idle_handlers;
+  heartbeat.pending_returns = pending_returns;
+  heartbeat.last = last;
+  return heartbeat;
+}
+
+void DistributedWorker::start_heartbeats() {
+  heartbeat_stop = false;
+  heartbeat_thr = std::thread(&DistributedWorker::send_heartbeats, this);
+}
+
+void DistributedWorker::stop_heartbeats() {
+  if (!heartbeat_thr.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lk(heartbeat_lock);
+    heartbeat_stop = true;
+  }
+  heartbeat_cond.notify_one();
+  heartbeat_thr.join();
+}
+
+void DistributedWorker::send_heartbeats() {
+  std::unique_lock<std::mutex> lk(heartbeat_lock);
+  while (!heartbeat_cond.wait_for(lk, heartbeat_interval, [this]{ return heartbeat_stop; }))
+    WorkerCluster::send_heartbeat(get_heartbeat(false));
 }
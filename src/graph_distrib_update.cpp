@@ -3,10 +3,26 @@
 #include "distributed_worker.h"
 #include "message_forwarders.h"
 #include "worker_cluster.h"
+#include "query_coordinator.h"
+#include "sketch_checkpoint.h"
+#include "msg_buffer_pool.h"
+#include "metrics_exporter.h"
+#include "batch_tracer.h"
+#include "batch_capture.h"
+#include "memory_report.h"
+#include "memstream.h"
 #include <graph_worker.h>
 #include <mpi.h>
+#include <omp.h>
 
+#include <algorithm>
 #include <iostream>
+#include <thread>
+
+GraphDistribUpdate *GraphDistribUpdate::live_graph = nullptr;
+std::map<std::pair<node_id_t, node_id_t>, GraphDistribUpdate::SupernodeSizes>
+    GraphDistribUpdate::known_sizes;
+std::mutex GraphDistribUpdate::live_graph_lock;
 
 GraphConfiguration GraphDistribUpdate::graph_conf(node_id_t num_nodes, node_id_t k) {
   if (k == 0 || k > num_nodes) {
@@ -21,18 +37,115 @@ GraphConfiguration GraphDistribUpdate::graph_conf(node_id_t num_nodes, node_id_t
           .disk_dir(".")
           .backup_in_mem(true)
           .num_graph_workers(1024)
-          .batch_factor(k > 1 ? 1.0 : 1.2)
+          .batch_factor(batch_factor(k))
           .sketches_factor(k);
   retval.gutter_conf()
           .page_factor(1)
-          .buffer_exp(20)
-          .fanout(64)
-          .queue_factor(WorkerCluster::num_batches)
+          .buffer_exp(gutter_buffer_exp)
+          .fanout(gutter_fanout)
+          .queue_factor(gutter_queue_factor)
           .num_flushers(2)
           .wq_batch_per_elm(WorkerCluster::num_batches);
   return retval;
 }
 
+void GraphDistribUpdate::plan_main_memory(MemoryReport &report, node_id_t num_nodes,
+                                          size_t gutter_updates, int num_workers,
+                                          size_t supernode_bytes) {
+  report.supernodes = (uint64_t) num_nodes * supernode_bytes;
+  report.query_copies = report.supernodes; // the sketches are backed up in memory
+
+  // one gutter per vertex, the root buffers of the tree, and a work queue with a queue_factor
+  // of DataNodes for each WorkDistributor
+  size_t work_distributors = std::min(WorkerCluster::num_msg_forwarders, num_workers);
+  uint64_t gutter_bytes = gutter_updates * sizeof(node_id_t);
+  report.gutters = num_nodes * gutter_bytes;
+#ifndef USE_STANDALONE
+  report.gutters += (uint64_t) gutter_fanout << gutter_buffer_exp;
+#endif
+  report.gutters +=
+      gutter_queue_factor * work_distributors * WorkerCluster::num_batches * gutter_bytes;
+
+  report.work_distributors =
+      work_distributors * (WorkDistributor::num_helper_threads + 1) * supernode_bytes;
+  report.bookkeeping = 2 * (uint64_t) num_nodes * sizeof(node_id_t) + (num_nodes + 63) / 64 * 8;
+}
+
+GraphDistribUpdate::SupernodeSizes GraphDistribUpdate::supernode_sizes(node_id_t num_nodes,
+                                                                       node_id_t k) {
+  std::lock_guard<std::mutex> lk(live_graph_lock);
+  auto known = known_sizes.find({num_nodes, k});
+  if (known != known_sizes.end()) return known->second;
+  if (live_graph != nullptr) {
+    throw std::invalid_argument("Cannot plan a graph of " + std::to_string(num_nodes) +
+                                " nodes and k = " + std::to_string(k) + " while a graph of " +
+                                std::to_string(live_graph->num_nodes) + " nodes and k = " +
+                                std::to_string(live_graph->k) + " is alive");
+  }
+
+  // no graph reads the sizes, and the next graph configures Supernode for itself
+  Supernode::configure(num_nodes, Supernode::default_num_columns, k);
+  SupernodeSizes sizes{Supernode::get_size(), Supernode::get_serialized_size()};
+  known_sizes[{num_nodes, k}] = sizes;
+  return sizes;
+}
+
+MemoryReport GraphDistribUpdate::plan_memory(node_id_t num_nodes, node_id_t k, int num_workers,
+                                             int worker_threads) {
+  graph_conf(num_nodes, k); // validate k
+  return plan_memory_of(num_nodes, k, num_workers, worker_threads, supernode_sizes(num_nodes, k));
+}
+
+MemoryReport GraphDistribUpdate::plan_memory_of(node_id_t num_nodes, node_id_t k,
+                                                int num_workers, int worker_threads,
+                                                SupernodeSizes sizes) {
+  size_t gutter_updates = batch_factor(k) * sizes.serialized_bytes / sizeof(node_id_t);
+
+  MemoryReport report;
+  plan_main_memory(report, num_nodes, gutter_updates, num_workers, sizes.bytes);
+
+  // the WorkDistributors and workers allocate message buffers from their pools
+  size_t batch_size = std::max(gutter_updates, sizes.serialized_bytes);
+  size_t msg_bytes = MsgBufferPool::size_class(
+      WorkerCluster::max_msg_size_of(batch_size, sizes.serialized_bytes));
+  auto pool_bytes = [](size_t bytes) {
+    if (bytes >= MsgBufferPool::huge_page_size) return bytes;
+    return (bytes + MsgBufferPool::huge_page_size - 1) / MsgBufferPool::huge_page_size *
+           MsgBufferPool::huge_page_size;
+  };
+  size_t work_distributors = std::min(WorkerCluster::num_msg_forwarders, num_workers);
+  report.message_pool = pool_bytes(2 * work_distributors * msg_bytes);
+
+  // each worker has two message handlers per thread, with two buffers and num_batches delta
+  // supernodes each, and one more buffer for messages from main
+  WorkerMemory worker;
+  size_t handlers = 2 * worker_threads;
+  worker.buffer_bytes = pool_bytes((2 * handlers + 1) * msg_bytes) +
+      (handlers * WorkerCluster::num_batches + 1) * sizes.bytes;
+  for (int w = 0; w < num_workers; w++) {
+    worker.worker_id = w + WorkerCluster::distrib_worker_offset;
+    report.workers.push_back(worker);
+  }
+  return report;
+}
+
+MemoryReport GraphDistribUpdate::memory_report() const {
+  MemoryReport report;
+  plan_main_memory(report, num_nodes, gts->gutter_size(), WorkerCluster::get_num_workers(),
+                   Supernode::get_size());
+  report.message_pool = MsgBufferPool::bytes_mapped();
+  report.main_resident = MemoryReport::process_resident_bytes();
+
+  for (auto &health : ClusterMetrics::worker_health()) {
+    WorkerMemory worker;
+    worker.worker_id = health.worker_id;
+    worker.buffer_bytes = health.buffer_bytes;
+    worker.resident_bytes = health.resident_bytes;
+    report.workers.push_back(worker);
+  }
+  return report;
+}
+
 // Static functions for starting and shutting down the cluster
 void GraphDistribUpdate::setup_cluster(int argc, char** argv) {
   int provided;
@@ -51,19 +164,35 @@ void GraphDistribUpdate::setup_cluster(int argc, char** argv) {
     exit(EXIT_FAILURE);
   }
 
+  BatchTracer::setup(); // every process must take part
+  BatchCapture::setup();
+
+  // the processes on this machine share its memory
+  MPI_Comm machine_comm;
+  int machine_processes;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &machine_comm);
+  MPI_Comm_size(machine_comm, &machine_processes);
+  MPI_Comm_free(&machine_comm);
+
   int proc_id;
   MPI_Comm_rank(MPI_COMM_WORLD, &proc_id);
   if (proc_id >= WorkerCluster::distrib_worker_offset) {
     // we are a worker, start working!
-    DistributedWorker worker(proc_id);
+    DistributedWorker worker(proc_id, machine_processes);
+    BatchTracer::write();
+    MsgBufferPool::free_all();
     MPI_Finalize();
     exit(EXIT_SUCCESS);
   } else if (proc_id > WorkerCluster::num_msg_forwarders) {
     DeltaMessageForwarder forwarder(proc_id);
+    BatchTracer::write();
+    MsgBufferPool::free_all();
     MPI_Finalize();
     exit(EXIT_SUCCESS);
   } else if (proc_id > 0) {
     BatchMessageForwarder forwarder(proc_id);
+    BatchTracer::write();
+    MsgBufferPool::free_all();
     MPI_Finalize();
     exit(EXIT_SUCCESS);
   }
@@ -77,6 +206,8 @@ void GraphDistribUpdate::setup_cluster(int argc, char** argv) {
 
 void GraphDistribUpdate::teardown_cluster() {
   WorkerCluster::shutdown_cluster();
+  BatchTracer::write();
+  MsgBufferPool::free_all();
   MPI_Finalize();
 }
 
@@ -85,11 +216,58 @@ void GraphDistribUpdate::teardown_cluster() {
  ***************************************/
 
 // Construct a GraphDistribUpdate by first constructing a Graph
-GraphDistribUpdate::GraphDistribUpdate(node_id_t num_nodes, int num_inserters, node_id_t k) : 
- Graph(num_nodes, graph_conf(num_nodes, k), num_inserters), k(k) {
+GraphDistribUpdate::GraphDistribUpdate(node_id_t num_nodes, int num_inserters, node_id_t k,
+                                       bool resident_workers) :
+ Graph(num_nodes, graph_conf(num_nodes, k), num_inserters), k(k),
+ resident_workers(resident_workers), num_inserters(num_inserters),
+ inserter_flags(new InserterFlag[num_inserters]) {
+  start_ingestion();
+}
+
+// Construct a GraphDistribUpdate from a checkpoint
+GraphDistribUpdate::GraphDistribUpdate(const std::string &checkpoint_path, int num_inserters,
+                                       bool resident_workers)
+    : GraphDistribUpdate(SketchCheckpoint::read_header(checkpoint_path), checkpoint_path,
+                         num_inserters, resident_workers) {}
+
+GraphDistribUpdate::GraphDistribUpdate(const CheckpointHeader &header,
+                                       const std::string &checkpoint_path, int num_inserters,
+                                       bool resident_workers)
+    : Graph(header.num_nodes, graph_conf(header.num_nodes, header.k), num_inserters),
+      k(header.k), stream_offset(header.stream_offset), resident_workers(resident_workers),
+      num_inserters(num_inserters), inserter_flags(new InserterFlag[num_inserters]) {
+  if (header.supernode_bytes != Supernode::get_serialized_size())
+    throw std::invalid_argument("Checkpoint supernode size does not match this build");
+
+  // replace the empty supernodes with those of the checkpoint and then its log
+  seed = header.seed;
+  auto load = [this](node_id_t node_idx, std::istream &in) {
+    Supernode::makeSupernode(num_nodes, seed, in, supernodes[node_idx]);
+  };
+  SketchCheckpoint::read_supernodes(checkpoint_path, header, load);
+  checkpoint_log_end = SketchCheckpoint::replay_log(checkpoint_path, header, stream_offset, load);
+  if (checkpoint_log_end > 0) last_checkpoint_path = checkpoint_path;
+  base_path = checkpoint_path;
+  base_id = header.checkpoint_id;
+  base_log_applied = checkpoint_log_end > SketchCheckpoint::page_size;
+  dsu_valid = false; // the DSU describes an empty graph
+  std::cout << "Restored " << num_nodes << " supernodes from " << checkpoint_path
+            << " at stream offset " << stream_offset << std::endl;
+  start_ingestion();
+}
+
+void GraphDistribUpdate::start_ingestion() {
+  {
+    // Supernode is configured for this graph until it is destroyed
+    std::lock_guard<std::mutex> lk(live_graph_lock);
+    live_graph = this;
+    known_sizes[{num_nodes, k}] = {Supernode::get_size(), Supernode::get_serialized_size()};
+  }
+  dirty_nodes.reset(new std::atomic<uint64_t>[(num_nodes + 63) / 64]());
   // TODO: figure out a better solution than this.
   GraphWorker::stop_workers(); // shutdown the graph workers because we aren't using them
   WorkDistributor::start_workers(this, gts); // start threads and distributed cluster
+  coordinator.reset(new QueryCoordinator(this, QueryCoordinator::default_coalesce_window));
 #ifdef USE_EAGER_DSU
   std::cout << "USING EAGER_DSU" << std::endl;
 #endif
@@ -97,67 +275,113 @@ GraphDistribUpdate::GraphDistribUpdate(node_id_t num_nodes, int num_inserters, n
 }
 
 GraphDistribUpdate::~GraphDistribUpdate() {
+  {
+    std::lock_guard<std::mutex> lk(live_graph_lock);
+    live_graph = nullptr;
+  }
+  coordinator.reset(); // answer any outstanding queries before stopping the cluster
+  exporter.reset();
+
   // inform the worker threads they should wait for new init or shutdown
   uint64_t updates = WorkDistributor::stop_workers();
+  BatchTracer::write();
   std::cout << "Total updates processed by cluster since last init = " << updates << std::endl;
+  if (WorkDistributor::cancelled_updates() > 0)
+    std::cout << "Duplicate updates cancelled = " << WorkDistributor::cancelled_updates()
+              << ", bytes not sent = " << WorkDistributor::cancelled_bytes() << std::endl;
 }
 
 std::vector<std::set<node_id_t>> GraphDistribUpdate::get_connected_components(bool cont) {
-  // DSU check before calling force_flush()
-  if (dsu_valid && cont) {
-    cc_alg_start = flush_start = flush_end = std::chrono::steady_clock::now();
-    std::cout << "~ Used existing DSU" << std::endl;
-#ifdef VERIFY_SAMPLES_F
-    for (node_id_t src = 0; src < num_nodes; ++src) {
-      for (const auto& dst : spanning_forest[src]) {
-        verifier->verify_edge({src, dst});
-      }
-    }
-#endif
-    auto retval = cc_from_dsu();
-    cc_alg_end = std::chrono::steady_clock::now();
-    return retval;
-  }
+  if (cont) return async_connected_components().get();
 
+  return coordinator->submit_exclusive_query<std::vector<std::set<node_id_t>>>([this]() {
+    return final_connected_components();
+  }).get();
+}
+
+std::future<std::vector<std::set<node_id_t>>> GraphDistribUpdate::async_connected_components() {
+  return coordinator->submit_dsu_query<std::vector<std::set<node_id_t>>>([this]() {
+    return cc_from_dsu();
+  });
+}
+
+std::vector<std::set<node_id_t>> GraphDistribUpdate::final_connected_components() {
+  check_unsharded();
+  close_update_gate();
   flush_start = std::chrono::steady_clock::now();
   gts->force_flush(); // flush everything in buffering system to make final updates
   WorkDistributor::pause_workers(); // wait for the workers to finish applying the updates
   flush_end = std::chrono::steady_clock::now();
   // after this point all updates have been processed from the guttering system
 
-  if (!cont)
-    return boruvka_emulation(false); // merge in place
-  
-  // if backing up in memory then perform copying in boruvka
-  bool except = false;
-  std::exception_ptr err;
+  // the graph stays locked to updates, later inserters throw UpdateLockedException
   std::vector<std::set<node_id_t>> ret;
   try {
-    ret = boruvka_emulation(true);
+    ret = boruvka_emulation(false); // merge in place
   } catch (...) {
-    except = true;
-    err = std::current_exception();
+    open_update_gate();
+    throw;
   }
+  open_update_gate();
+  return ret;
+}
 
-  // get ready for ingesting more from the stream
-  // reset dsu and resume graph workers
-  for (node_id_t i = 0; i < num_nodes; i++) {
-    supernodes[i]->reset_query_state();
+void GraphDistribUpdate::close_update_gate() {
+  gate_closed = true;
+  for (int i = 0; i < num_inserters; i++) {
+    while (inserter_flags[i].active) std::this_thread::yield();
   }
-  update_locked = false;
-  WorkDistributor::unpause_workers();
+}
 
-  // check if boruvka errored
-  if (except) std::rethrow_exception(err);
+void GraphDistribUpdate::open_update_gate() {
+  std::unique_lock<std::mutex> lk(gate_lock);
+  gate_closed = false;
+  lk.unlock();
+  gate_condition.notify_all();
+}
 
-  return ret;
+void GraphDistribUpdate::wait_at_update_gate() {
+  std::unique_lock<std::mutex> lk(gate_lock);
+  gate_condition.wait(lk, [&]{ return !gate_closed; });
 }
 
 std::vector<std::set<node_id_t>> GraphDistribUpdate::k_spanning_forests(node_id_t user_k) {
+  return async_k_spanning_forests(user_k).get();
+}
+
+std::future<std::vector<std::set<node_id_t>>> GraphDistribUpdate::async_k_spanning_forests(
+ node_id_t user_k) {
   if (user_k > k) {
     throw std::invalid_argument("Requested k out of range 0 < k < " + std::to_string(k));
   }
+  return coordinator->submit_exclusive_query<std::vector<std::set<node_id_t>>>([this, user_k]() {
+    SpanningForests forests = compute_k_spanning_forests(user_k);
+
+    std::vector<std::set<node_id_t>> adj_list(num_nodes);
+    for (const Edge &edge : forests.edges) {
+#ifdef VERIFY_SAMPLES_F
+      if (adj_list[edge.src].count(edge.dst) != 0) {
+        throw std::runtime_error("Duplicate edge found when building k spanning forests!");
+      }
+#endif
+      adj_list[edge.src].insert(edge.dst);
+    }
+    return adj_list;
+  });
+}
 
+SpanningForests GraphDistribUpdate::k_spanning_forests_compact(node_id_t user_k) {
+  if (user_k > k) {
+    throw std::invalid_argument("Requested k out of range 0 < k < " + std::to_string(k));
+  }
+  return coordinator->submit_exclusive_query<SpanningForests>([this, user_k]() {
+    return compute_k_spanning_forests(user_k);
+  }).get();
+}
+
+SpanningForests GraphDistribUpdate::compute_k_spanning_forests(node_id_t user_k) {
+  check_unsharded();
+  close_update_gate();
   flush_start = std::chrono::steady_clock::now();
   gts->force_flush(); // flush everything in buffering system to make final updates
   WorkDistributor::pause_workers(); // wait for the workers to finish applying the updates
@@ -165,7 +389,9 @@ std::vector<std::set<node_id_t>> GraphDistribUpdate::k_spanning_forests(node_id_
   // after this point all updates have been processed from the guttering system
 
   auto k_cc_start = std::chrono::steady_clock::now();
-  std::vector<std::set<node_id_t>> adj_list(num_nodes);
+  SpanningForests forests;
+  forests.forest_offsets.reserve(user_k + 1);
+  forests.forest_offsets.push_back(0);
   bool except = false;
   std::exception_ptr err;
   for (size_t t = 0; t < user_k; t++) {
@@ -177,18 +403,22 @@ std::vector<std::set<node_id_t>> GraphDistribUpdate::k_spanning_forests(node_id_
     }
     if (except) break;
 
-    for (node_id_t src = 0; src < num_nodes; src++) {
-      for (node_id_t dst : spanning_forest[src]) {
-        supernodes[src]->update(concat_pairing_fn(src, dst));
-        supernodes[dst]->update(concat_pairing_fn(src, dst));
-#ifdef VERIFY_SAMPLES_F
-        if (adj_list[dst].count(dst) != 0) {
-          throw std::runtime_error("Duplicate edge found when building k spanning forests!");
-        }
-#endif
-        adj_list[src].insert(dst);
-      }
-    }
+    size_t forest_start = forests.edges.size();
+    append_forest_edges(forests.edges);
+    forests.forest_offsets.push_back(forests.edges.size());
+
+    // remove this forest from the sketches so the next round finds new edges
+    // the last forest need not be removed as no round follows it
+    if (t + 1 < user_k)
+      peel_forest_edges(forests.edges.data() + forest_start, forests.edges.size() - forest_start);
+  }
+
+  // peeling is its own inverse, so peeling the removed forests again restores the sketches.
+  // The DSU then describes a subgraph and must be rebuilt by the next query
+  size_t num_peeled = std::min(forests.num_forests(), size_t(user_k - 1));
+  if (num_peeled > 0) {
+    peel_forest_edges(forests.edges.data(), forests.forest_offsets[num_peeled]);
+    dsu_valid = false;
   }
 
   // get ready for ingesting more from the stream
@@ -197,6 +427,7 @@ std::vector<std::set<node_id_t>> GraphDistribUpdate::k_spanning_forests(node_id_
     supernodes[i]->reset_query_state();
   }
   update_locked = false;
+  open_update_gate();
   WorkDistributor::unpause_workers();
 
   // check if boruvka errored
@@ -205,14 +436,119 @@ std::vector<std::set<node_id_t>> GraphDistribUpdate::k_spanning_forests(node_id_
   cc_alg_start = k_cc_start;
   cc_alg_end = std::chrono::steady_clock::now();
 
-  return adj_list;
+  return forests;
+}
+
+void GraphDistribUpdate::append_forest_edges(std::vector<Edge> &edges) {
+  // count the edges of each node and compute where each node's edges begin
+  std::vector<size_t> node_offsets(num_nodes + 1);
+  node_offsets[0] = 0;
+#pragma omp parallel for
+  for (node_id_t src = 0; src < num_nodes; src++)
+    node_offsets[src + 1] = spanning_forest[src].size();
+  for (node_id_t src = 0; src < num_nodes; src++)
+    node_offsets[src + 1] += node_offsets[src];
+
+  // each node writes its edges to its own region so that no locking is required
+  size_t base = edges.size();
+  edges.resize(base + node_offsets[num_nodes]);
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (node_id_t src = 0; src < num_nodes; src++) {
+    Edge *node_edges = edges.data() + base + node_offsets[src];
+    size_t num_edges = 0;
+    for (node_id_t dst : spanning_forest[src])
+      node_edges[num_edges++] = {src, dst};
+    std::sort(node_edges, node_edges + num_edges, [](const Edge &a, const Edge &b) {
+      return a.dst < b.dst;
+    });
+  }
+}
+
+void GraphDistribUpdate::check_query_node(node_id_t node) const {
+  if (node >= num_nodes)
+    throw std::invalid_argument("Query node " + std::to_string(node) +
+                                " out of range 0 <= node < " + std::to_string(num_nodes));
+}
+
+void GraphDistribUpdate::check_unsharded() const {
+  if (num_shards > 1)
+    throw std::runtime_error("Cannot query shard " + std::to_string(shard_id) + " of " +
+                             std::to_string(num_shards) + ", merge the exports of every shard");
 }
 
 bool GraphDistribUpdate::point_to_point_query(node_id_t a, node_id_t b) {
+  check_query_node(a);
+  check_query_node(b);
+  return coordinator->submit_dsu_query<bool>([this, a, b]() {
+    return find_root(a) == find_root(b);
+  }).get();
+}
+
+std::vector<bool> GraphDistribUpdate::point_to_point_queries(
+ const std::vector<std::pair<node_id_t, node_id_t>> &pairs) {
+  // reject bad ids before the query so they cannot index past the end of the DSU
+  for (auto &pair : pairs) {
+    check_query_node(pair.first);
+    check_query_node(pair.second);
+  }
+  // answer every pair from the DSU. find_root does not modify the DSU so this is thread safe
+  return coordinator->submit_dsu_query<std::vector<bool>>([this, &pairs]() {
+    std::vector<char> connected(pairs.size());
+#pragma omp parallel for
+    for (size_t i = 0; i < pairs.size(); i++)
+      connected[i] = find_root(pairs[i].first) == find_root(pairs[i].second);
+    return std::vector<bool>(connected.begin(), connected.end());
+  }).get();
+}
+
+std::vector<node_id_t> GraphDistribUpdate::get_component_labels() {
+  return coordinator->submit_dsu_query<std::vector<node_id_t>>([this]() {
+    std::vector<node_id_t> labels;
+    labels_from_dsu(labels);
+    return labels;
+  }).get();
+}
+
+std::vector<node_id_t> GraphDistribUpdate::get_component_sizes() {
+  std::vector<node_id_t> labels = get_component_labels();
+
+  std::vector<node_id_t> counts(num_nodes, 0);
+  for (node_id_t i = 0; i < num_nodes; i++)
+    ++counts[labels[i]];
+
+  std::vector<node_id_t> sizes;
+  for (node_id_t root = 0; root < num_nodes; root++)
+    if (counts[root] > 0) sizes.push_back(counts[root]);
+  return sizes;
+}
+
+void GraphDistribUpdate::labels_from_dsu(std::vector<node_id_t> &labels) const {
+  labels.resize(num_nodes);
+  std::vector<node_id_t> next(num_nodes);
+#pragma omp parallel for
+  for (node_id_t i = 0; i < num_nodes; i++)
+    labels[i] = parent[i];
+
+  // path compression by pointer jumping. Each round halves the distance of every
+  // vertex to its root. Reads and writes go to separate arrays so no locking is required
+  bool changed = true;
+  while (changed) {
+    changed = false;
+#pragma omp parallel for reduction(||:changed)
+    for (node_id_t i = 0; i < num_nodes; i++) {
+      next[i] = labels[labels[i]];
+      changed = changed || next[i] != labels[i];
+    }
+    std::swap(labels, next);
+  }
+}
+
+void GraphDistribUpdate::query_dsu(const std::function<void()> &answer) {
+  check_unsharded();
   // DSU check before calling force_flush()
-  if (dsu_valid) {
+  dsu_fast_path = dsu_valid;
+  if (dsu_fast_path) {
     cc_alg_start = flush_start = flush_end = std::chrono::steady_clock::now();
-    std::cout << "~ Used existing DSU" << std::endl;
 #ifdef VERIFY_SAMPLES_F
     for (node_id_t src = 0; src < num_nodes; ++src) {
       for (const auto& dst : spanning_forest[src]) {
@@ -220,11 +556,12 @@ bool GraphDistribUpdate::point_to_point_query(node_id_t a, node_id_t b) {
       }
     }
 #endif
-    bool retval = (get_parent(a) == get_parent(b));
+    answer();
     cc_alg_end = std::chrono::steady_clock::now();
-    return retval;
+    return;
   }
 
+  close_update_gate(); // so that no update is missed by the DSU we are about to build
   flush_start = std::chrono::steady_clock::now();
   gts->force_flush(); // flush everything in buffering system to make final updates
   WorkDistributor::pause_workers(); // wait for the workers to finish applying the updates
@@ -234,10 +571,9 @@ bool GraphDistribUpdate::point_to_point_query(node_id_t a, node_id_t b) {
   // if backing up in memory then perform copying in boruvka
   bool except = false;
   std::exception_ptr err;
-  bool ret;
   try {
     boruvka_emulation(true);
-    ret = (get_parent(a) == get_parent(b));
+    answer();
   } catch (...) {
     except = true;
     err = std::current_exception();
@@ -249,10 +585,326 @@ bool GraphDistribUpdate::point_to_point_query(node_id_t a, node_id_t b) {
     supernodes[i]->reset_query_state();
   }
   update_locked = false;
+  open_update_gate();
   WorkDistributor::unpause_workers();
 
   // check if boruvka errored
   if (except) std::rethrow_exception(err);
+}
 
-  return ret;
+void GraphDistribUpdate::peel_forest_edges(const Edge *edges, size_t num_edges) {
+  // group the deletions by supernode. Each edge deletes from both of its endpoints
+  std::vector<size_t> node_offsets(num_nodes + 1, 0);
+  for (size_t e = 0; e < num_edges; e++) {
+    ++node_offsets[edges[e].src + 1];
+    ++node_offsets[edges[e].dst + 1];
+  }
+  std::vector<node_id_t> touched_nodes;
+  for (node_id_t node = 0; node < num_nodes; node++) {
+    if (node_offsets[node + 1] > 0) touched_nodes.push_back(node);
+    node_offsets[node + 1] += node_offsets[node];
+  }
+
+  std::vector<node_id_t> deletions(node_offsets[num_nodes]);
+  std::vector<size_t> fill_pos(node_offsets.begin(), node_offsets.end() - 1);
+  for (size_t e = 0; e < num_edges; e++) {
+    deletions[fill_pos[edges[e].src]++] = edges[e].dst;
+    deletions[fill_pos[edges[e].dst]++] = edges[e].src;
+  }
+
+  // apply one delta per supernode. Every supernode is owned by a single thread
+  int num_threads = omp_get_max_threads();
+  std::vector<Supernode *> delta_nodes(num_threads);
+  for (int i = 0; i < num_threads; i++)
+    delta_nodes[i] = (Supernode *) malloc(Supernode::get_size());
+
+#pragma omp parallel num_threads(num_threads)
+  {
+    Supernode *delta = delta_nodes[omp_get_thread_num()];
+    std::vector<node_id_t> node_deletions;
+#pragma omp for schedule(dynamic, 64)
+    for (size_t i = 0; i < touched_nodes.size(); i++) {
+      node_id_t node = touched_nodes[i];
+      node_deletions.assign(deletions.begin() + node_offsets[node],
+                            deletions.begin() + node_offsets[node + 1]);
+      generate_delta_node(num_nodes, seed, node, node_deletions, delta);
+      supernodes[node]->apply_delta_update(delta);
+      mark_dirty(node);
+    }
+  }
+
+  for (auto delta : delta_nodes)
+    free(delta);
+}
+
+void GraphDistribUpdate::set_query_coalesce_window(std::chrono::microseconds window) {
+  coordinator->set_coalesce_window(window);
+}
+
+void GraphDistribUpdate::checkpoint(const std::string &path, uint64_t offset) {
+  take_checkpoint(path, offset, false);
+}
+
+void GraphDistribUpdate::incremental_checkpoint(const std::string &path, uint64_t offset) {
+  take_checkpoint(path, offset, true);
+}
+
+void GraphDistribUpdate::take_checkpoint(const std::string &path, uint64_t offset,
+                                         bool incremental) {
+  coordinator->submit_exclusive_query<bool>([&]() {
+    gts->force_flush(); // flush everything in buffering system to make final updates
+    WorkDistributor::pause_workers(); // wait for the workers to finish applying the updates
+    // after this point all updates have been processed from the guttering system
+
+    // no deltas are applied while paused so the dirty set is exactly what changed
+    std::vector<node_id_t> dirty = take_dirty_nodes();
+    uint64_t supernode_bytes = Supernode::get_serialized_size();
+    double full_bytes = (double) num_nodes * supernode_bytes;
+
+    // append to the log unless it has grown large enough that it should be compacted
+    // into a new full checkpoint
+    bool append = incremental && path == last_checkpoint_path && checkpoint_log_end > 0 &&
+                  checkpoint_log_end + SketchCheckpoint::log_record_bytes(dirty.size(), supernode_bytes)
+                  <= log_compaction_factor * full_bytes;
+
+    bool except = false;
+    std::exception_ptr err;
+    try {
+      if (append) {
+        checkpoint_log_end = SketchCheckpoint::append_log(path, checkpoint_log_end, offset, dirty,
+                                                          supernodes, supernode_bytes);
+      } else {
+        CheckpointHeader header;
+        header.num_nodes = num_nodes;
+        header.k = k;
+        header.seed = seed;
+        header.stream_offset = offset;
+        header.supernode_bytes = supernode_bytes;
+        header.base_id = base_id;
+        SketchCheckpoint::write(path, header, supernodes);
+        last_checkpoint_path = path;
+        checkpoint_log_end = SketchCheckpoint::page_size;
+      }
+    } catch (...) {
+      except = true;
+      err = std::current_exception();
+      for (node_id_t node_idx : dirty) mark_dirty(node_idx); // not yet written
+    }
+    WorkDistributor::unpause_workers();
+
+    // check if writing the checkpoint errored
+    if (except) std::rethrow_exception(err);
+    stream_offset = offset;
+    return true;
+  }).get();
+}
+
+std::vector<node_id_t> GraphDistribUpdate::take_dirty_nodes() {
+  std::vector<node_id_t> dirty;
+  for (node_id_t w = 0; w < (num_nodes + 63) / 64; w++) {
+    uint64_t word = dirty_nodes[w].exchange(0, std::memory_order_relaxed);
+    while (word != 0) {
+      dirty.push_back(w * 64 + __builtin_ctzll(word));
+      word &= word - 1; // clear lowest set bit
+    }
+  }
+  return dirty;
+}
+
+void GraphDistribUpdate::export_sketches(const std::string &path) {
+  coordinator->submit_exclusive_query<bool>([&]() {
+    // last_checkpoint_path is only modified by the query thread
+    if (path == last_checkpoint_path) {
+      throw std::invalid_argument("Cannot export sketches to " + path +
+                                  ": incremental checkpoints are appended to it");
+    }
+
+    gts->force_flush(); // flush everything in buffering system to make final updates
+    WorkDistributor::pause_workers(); // wait for the workers to finish applying the updates
+    // after this point all updates have been processed from the guttering system
+
+    CheckpointHeader header;
+    header.num_nodes = num_nodes;
+    header.k = k;
+    header.seed = seed;
+    header.stream_offset = stream_offset;
+    header.supernode_bytes = Supernode::get_serialized_size();
+    header.base_id = base_id;
+
+    bool except = false;
+    std::exception_ptr err;
+    try {
+      // an export is never appended to so it has no incremental log
+      SketchCheckpoint::write(path, header, supernodes, false);
+    } catch (...) {
+      except = true;
+      err = std::current_exception();
+    }
+    WorkDistributor::unpause_workers();
+
+    // check if writing the export errored
+    if (except) std::rethrow_exception(err);
+    return true;
+  }).get();
+}
+
+void GraphDistribUpdate::merge_sketches(const std::string &path) {
+  CheckpointHeader header = SketchCheckpoint::read_header(path);
+  if (header.seed != seed || header.num_nodes != num_nodes || header.k != k ||
+      header.supernode_bytes != Supernode::get_serialized_size()) {
+    throw std::invalid_argument("Cannot merge sketches of " + path +
+                                ": seed, number of nodes or k does not match");
+  }
+  if (header.base_id != base_id) {
+    throw std::invalid_argument("Cannot merge sketches of " + path +
+                                ": it was not restored from the same checkpoint as this graph");
+  }
+
+  // the base is in both sketches, so it cancels out of the XOR and must be added back
+  CheckpointHeader base_header;
+  if (base_id != 0) {
+    if (base_log_applied) {
+      throw std::invalid_argument("Cannot merge sketches of " + path + ": base " + base_path +
+                                  " was restored with its incremental log");
+    }
+    base_header = SketchCheckpoint::read_header(base_path);
+    if (base_header.checkpoint_id != base_id) {
+      throw std::invalid_argument("Cannot merge sketches of " + path + ": base " + base_path +
+                                  " has been overwritten since this graph was restored");
+    }
+  }
+
+  coordinator->submit_exclusive_query<bool>([&]() {
+    gts->force_flush(); // flush everything in buffering system to make final updates
+    WorkDistributor::pause_workers(); // wait for the workers to finish applying the updates
+    // after this point all updates have been processed from the guttering system
+
+    // each reading thread deserializes into its own delta and XORs it into our supernode
+    int num_threads = omp_get_max_threads();
+    std::vector<Supernode *> delta_nodes(num_threads);
+    for (int i = 0; i < num_threads; i++)
+      delta_nodes[i] = (Supernode *) malloc(Supernode::get_size());
+
+    auto merge = [&](node_id_t node_idx, std::istream &in) {
+      Supernode *delta = delta_nodes[omp_get_thread_num()];
+      Supernode::makeSupernode(num_nodes, seed, in, delta);
+      supernodes[node_idx]->apply_delta_update(delta);
+      mark_dirty(node_idx);
+    };
+
+    bool except = false;
+    std::exception_ptr err;
+    try {
+      SketchCheckpoint::read_supernodes(path, header, merge);
+      if (base_id != 0) SketchCheckpoint::read_supernodes(base_path, base_header, merge);
+    } catch (...) {
+      except = true;
+      err = std::current_exception();
+    }
+    for (auto delta : delta_nodes)
+      free(delta);
+
+    dsu_valid = false; // the merged updates are not reflected in the DSU
+    WorkDistributor::unpause_workers();
+
+    // check if merging errored
+    if (except) std::rethrow_exception(err);
+    return true;
+  }).get();
+}
+
+void GraphDistribUpdate::serve_metrics(int port) {
+  exporter.reset(); // release the socket of any previous exporter first
+  exporter.reset(new MetricsExporter(port, this));
+}
+
+void GraphDistribUpdate::serve_metrics(const std::string &socket_path) {
+  exporter.reset();
+  exporter.reset(new MetricsExporter(socket_path, this));
+}
+
+void GraphDistribUpdate::set_cancel_duplicate_updates(bool cancel) {
+  WorkDistributor::set_cancel_duplicates(cancel);
+}
+
+uint64_t GraphDistribUpdate::get_cancelled_updates() const {
+  return WorkDistributor::cancelled_updates();
+}
+
+void GraphDistribUpdate::set_numa_policy(NumaPolicy policy) {
+  coordinator->submit_exclusive_query<bool>([&]() {
+    gts->force_flush(); // flush everything in buffering system to make final updates
+    WorkDistributor::pause_workers(); // no thread may touch a supernode while it moves
+
+    if (policy != NO_NUMA) place_supernodes(policy);
+    WorkDistributor::pin_workers(policy);
+    WorkDistributor::unpause_workers();
+    return true;
+  }).get();
+}
+
+void GraphDistribUpdate::place_supernodes(NumaPolicy policy) {
+  int numa_nodes = NumaPlacement::num_numa_nodes();
+  int threads_per_node = std::max(1, omp_get_max_threads() / numa_nodes);
+
+  // Each supernode is copied into pages of its own, so that moving it to its NUMA node does
+  // not move the malloc neighbours that belong to other NUMA nodes. Supernodes can only be
+  // copied into given memory by deserializing them.
+  size_t supernode_bytes = Supernode::get_serialized_size();
+  std::atomic<node_id_t> not_moved{0};
+  std::atomic<node_id_t> not_allocated{0};
+
+  // one thread per NUMA node, its OpenMP threads inherit its affinity
+  std::vector<std::thread> placers;
+  for (int numa = 0; numa < numa_nodes; numa++) {
+    placers.emplace_back([&, numa]() {
+      NumaPlacement::pin_this_thread(numa);
+#pragma omp parallel num_threads(threads_per_node)
+      {
+        std::vector<char> buffer(supernode_bytes);
+#pragma omp for schedule(dynamic, 64)
+        for (node_id_t i = 0; i < num_nodes; i++) {
+          if (NumaPlacement::numa_node_of(i, num_nodes, policy) != numa) continue;
+          void *loc = NumaPlacement::alloc_pages(Supernode::get_size());
+          if (loc == nullptr) {
+            not_allocated++; // the supernode stays where it is
+            continue;
+          }
+          omemstream out(buffer.data(), buffer.size());
+          supernodes[i]->write_binary(out);
+          imemstream in(buffer.data(), buffer.size());
+          Supernode *placed = Supernode::makeSupernode(num_nodes, seed, in, loc);
+          if (!NumaPlacement::move_to_numa_node(placed, Supernode::get_size(), numa))
+            not_moved++;
+          free(supernodes[i]);
+          supernodes[i] = placed;
+        }
+      }
+    });
+  }
+  for (auto &placer : placers)
+    placer.join();
+
+  if (not_allocated > 0 || not_moved > 0)
+    std::cerr << "WARNING: NUMA placement could not allocate " << not_allocated
+              << " supernodes and could not move " << not_moved
+              << " supernodes to their NUMA node" << std::endl;
+}
+
+void GraphDistribUpdate::set_shard(int _shard_id, int _num_shards) {
+  if (_num_shards < 1 || _shard_id < 0 || _shard_id >= _num_shards)
+    throw std::invalid_argument("Shard id must satisfy 0 <= shard_id < num_shards");
+
+  shard_id = _shard_id;
+  num_shards = _num_shards;
+  // the first node id whose shard_of() is at least shard
+  auto first_node = [&](int shard) {
+    return (node_id_t) (((uint64_t) shard * num_nodes + num_shards - 1) / num_shards);
+  };
+  shard_begin = first_node(shard_id);
+  shard_end = first_node(shard_id + 1);
+  // update() no longer maintains the DSU, which would be of this shard's edges only
+  dsu_valid = false;
+  std::cout << "Shard " << shard_id << "/" << num_shards << " owns supernodes ["
+            << shard_begin << ", " << shard_end << ")" << std::endl;
 }
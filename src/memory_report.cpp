@@ -0,0 +1,42 @@
+#include "memory_report.h"
+
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <unistd.h>
+
+static void print_line(std::ostream &out, const char *name, uint64_t bytes) {
+  out << std::left << std::setw(24) << name << std::right << std::setw(12) << std::fixed
+      << std::setprecision(1) << bytes / 1048576.0 << " MiB" << std::endl;
+}
+
+void MemoryReport::print(std::ostream &out) const {
+  out << "===== Memory Report =====" << std::endl;
+  print_line(out, "Supernodes", supernodes);
+  print_line(out, "Query copies", query_copies);
+  print_line(out, "Gutters", gutters);
+  print_line(out, "WorkDistributors", work_distributors);
+  print_line(out, "Message buffers", message_pool);
+  print_line(out, "Bookkeeping", bookkeeping);
+  print_line(out, "Main total", main_total());
+  if (main_resident > 0) print_line(out, "Main resident set", main_resident);
+  for (auto &worker : workers) {
+    std::string name = "Worker " + std::to_string(worker.worker_id);
+    print_line(out, name.c_str(), worker.total());
+  }
+  print_line(out, "Workers total", workers_total());
+  print_line(out, "Cluster total", total());
+}
+
+uint64_t MemoryReport::process_resident_bytes() {
+  // the second field of statm is the number of resident pages
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size, resident;
+  if (!(statm >> size >> resident)) return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+uint64_t MemoryReport::physical_memory_bytes() {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  return pages < 0 ? 0 : pages * sysconf(_SC_PAGESIZE);
+}
@@ -1,4 +1,7 @@
 #include "message_forwarders.h"
+#include "msg_buffer_pool.h"
+#include "batch_tracer.h"
+#include "batch_capture.h"
 
 #include "mpi.h"
 
@@ -38,6 +41,10 @@ void BatchMessageForwarder::run() {
 }
 
 void BatchMessageForwarder::send_batch() {
+  auto start = std::chrono::steady_clock::now();
+  BatchTracer::Trailer trailer;
+  BatchTracer::find_trailer(msg_buffer, msg_size, trailer);
+  BatchCapture::record(msg_buffer, msg_size);
   int which_buf;
   if (num_batch_sent < num_distrib) {
     which_buf = num_batch_sent;
@@ -53,6 +60,7 @@ void BatchMessageForwarder::send_batch() {
   std::swap(msg_buffer, batch_msg_buffers[which_buf]);
   MPI_Isend(batch_msg_buffers[which_buf], msg_size, MPI_CHAR, which_buf + distrib_offset,
             BATCH, MPI_COMM_WORLD, &batch_requests[which_buf]);
+  BatchTracer::record(trailer.trace_id, TRACE_FWD_BATCH, start, std::chrono::steady_clock::now());
 }
 
 void BatchMessageForwarder::send_flush() {
@@ -64,9 +72,10 @@ void BatchMessageForwarder::send_flush() {
 }
 
 void BatchMessageForwarder::cleanup() {
-  delete[] msg_buffer;
+  BatchCapture::end();
+  MsgBufferPool::put(msg_buffer);
   for (int i = 0; i < num_distrib; i++)
-    delete[] batch_msg_buffers[i];
+    MsgBufferPool::put(batch_msg_buffers[i]);
   delete[] batch_msg_buffers;
   delete[] batch_requests;
 }
@@ -87,17 +96,21 @@ void BatchMessageForwarder::init() {
 
   memcpy(&max_msg_size, init_buffer, sizeof(max_msg_size));
   memcpy(&WorkerCluster::num_workers, init_buffer + sizeof(max_msg_size), sizeof(WorkerCluster::num_workers));
-  msg_buffer = new char[max_msg_size];
+  msg_buffer = MsgBufferPool::get(max_msg_size);
+
+  // the parameters of the workers, for capturing the messages they will recieve
+  CaptureParams params;
+  size_t offset = sizeof(max_msg_size) + sizeof(WorkerCluster::num_workers);
+  memcpy(&params.num_nodes, init_buffer + offset, sizeof(params.num_nodes));
+  memcpy(&params.seed, init_buffer + offset + sizeof(params.num_nodes), sizeof(params.seed));
+  memcpy(&params.sketches_factor, init_buffer + offset + sizeof(params.num_nodes) + sizeof(params.seed),
+         sizeof(params.sketches_factor));
+  params.max_msg_size = max_msg_size;
+  BatchCapture::begin(params);
 
   // calculate the number of DistributedWorkers we will communicate with
-  int min = ceil((id-1) * (double)WorkerCluster::num_workers / WorkerCluster::num_msg_forwarders);
-  int max = ceil(id * (double)WorkerCluster::num_workers / WorkerCluster::num_msg_forwarders);
-
-  // Edge case for when num_workers < num_msg_forwarders
-  if (WorkerCluster::num_workers < WorkerCluster::num_msg_forwarders) {
-    min = id-1;
-    max = id-1 < WorkerCluster::num_workers ? id : id-1;
-  }
+  int min, max;
+  WorkerCluster::forwarder_workers(id, min, max);
 
   // std::cout << "BatchMessageForwarder: " << id << " min = " << min << " max = " << max << std::endl;
   num_distrib = max - min;
@@ -107,7 +120,7 @@ void BatchMessageForwarder::init() {
   batch_msg_buffers = new char*[num_distrib];
   batch_requests = new MPI_Request[num_distrib];
   for (int i = 0; i < num_distrib; i++)
-    batch_msg_buffers[i] = new char[max_msg_size];
+    batch_msg_buffers[i] = MsgBufferPool::get(max_msg_size);
 
   num_batch_sent = 0;
 }
@@ -149,21 +162,33 @@ void DeltaMessageForwarder::run() {
 
 void DeltaMessageForwarder::send_delta() {
   // std::cout << "DeltaMessageForwarder " << id << " forwarding delta" << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  BatchTracer::Trailer trailer;
+  BatchTracer::find_trailer(msg_buffer, msg_size, trailer);
   MPI_Send(msg_buffer, msg_size, MPI_CHAR, WorkerCluster::leader_proc, DELTA, MPI_COMM_WORLD);
+  BatchTracer::record(trailer.trace_id, TRACE_FWD_DELTA, start, std::chrono::steady_clock::now());
 }
 
 void DeltaMessageForwarder::process_distrib_worker_done() {
   num_distrib_flushed += 1;
+  if (msg_size == sizeof(WorkerStats)) {
+    WorkerStats stats;
+    memcpy(&stats, msg_buffer, sizeof(WorkerStats));
+    flush_stats.push_back(stats);
+  }
   // std::cout << "DeltaMessageForwarder " << id << " got flush from " << num_distrib_flushed << "/"
   //           << num_distrib << std::endl;
   if (num_distrib_flushed >= num_distrib) {
-    MPI_Send(nullptr, 0, MPI_CHAR, WorkerCluster::leader_proc, FLUSH, MPI_COMM_WORLD);
+    // pass the stats of our workers to main along with the flush
+    MPI_Send(flush_stats.data(), flush_stats.size() * sizeof(WorkerStats), MPI_CHAR,
+             WorkerCluster::leader_proc, FLUSH, MPI_COMM_WORLD);
     num_distrib_flushed = 0;
+    flush_stats.clear();
   }
 }
 
 void DeltaMessageForwarder::cleanup() {
-  delete[] msg_buffer;
+  MsgBufferPool::put(msg_buffer);
 }
 
 void DeltaMessageForwarder::init() {
@@ -183,18 +208,12 @@ void DeltaMessageForwarder::init() {
   memcpy(&max_msg_size, init_buffer, sizeof(max_msg_size));
   memcpy(&WorkerCluster::num_workers, init_buffer + sizeof(max_msg_size),
          sizeof(WorkerCluster::num_workers));
-  msg_buffer = new char[max_msg_size];
+  msg_buffer = MsgBufferPool::get(max_msg_size);
 
   // calculate the number of DistributedWorkers we will communicate with
   int fid = WorkerCluster::delta_fwd_to_batch_fwd(id);
-  int min = ceil((fid-1) * (double)WorkerCluster::num_workers / WorkerCluster::num_msg_forwarders);
-  int max = ceil(fid * (double)WorkerCluster::num_workers / WorkerCluster::num_msg_forwarders);
-
-  // Edge case for when num_workers < num_msg_forwarders
-  if (WorkerCluster::num_workers < WorkerCluster::num_msg_forwarders) {
-    min = fid-1;
-    max = fid-1 < WorkerCluster::num_workers ? fid : fid-1;
-  }
+  int min, max;
+  WorkerCluster::forwarder_workers(fid, min, max);
   
   
 
@@ -0,0 +1,270 @@
+#include "metrics_exporter.h"
+#include "cluster_metrics.h"
+#include "work_distributor.h"
+#include "graph_distrib_update.h"
+#include "memory_report.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+constexpr int MetricsExporter::poll_interval_ms;
+
+static std::runtime_error exporter_error(const std::string &msg) {
+  return std::runtime_error("MetricsExporter: " + msg + ": " + std::strerror(errno));
+}
+
+MetricsExporter::MetricsExporter(int port, const GraphDistribUpdate *graph)
+    : graph(graph), running(true) {
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) throw exporter_error("could not create socket");
+  int reuse = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listen_fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(listen_fd);
+    throw exporter_error("could not bind to port " + std::to_string(port));
+  }
+  start();
+}
+
+MetricsExporter::MetricsExporter(const std::string &_socket_path,
+                                 const GraphDistribUpdate *graph)
+    : graph(graph), running(true) {
+  sockaddr_un addr = {};
+  if (_socket_path.size() >= sizeof(addr.sun_path))
+    throw std::invalid_argument("MetricsExporter: socket path is too long " + _socket_path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) throw exporter_error("could not create socket");
+
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, _socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(_socket_path.c_str()); // remove the socket of a previous exporter
+  if (bind(listen_fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(listen_fd);
+    throw exporter_error("could not bind to " + _socket_path);
+  }
+  socket_path = _socket_path;
+  start();
+}
+
+void MetricsExporter::start() {
+  if (listen(listen_fd, 16) != 0) {
+    close(listen_fd);
+    throw exporter_error("could not listen");
+  }
+  serve_thr = std::thread(&MetricsExporter::serve, this);
+}
+
+MetricsExporter::~MetricsExporter() {
+  running = false;
+  serve_thr.join();
+  close(listen_fd);
+  if (!socket_path.empty()) unlink(socket_path.c_str());
+}
+
+void MetricsExporter::serve() {
+  while (running) {
+    pollfd pfd = {listen_fd, POLLIN, 0};
+    if (poll(&pfd, 1, poll_interval_ms) <= 0) continue;
+
+    int conn_fd = accept(listen_fd, nullptr, nullptr);
+    if (conn_fd < 0) continue;
+    answer(conn_fd);
+    close(conn_fd);
+  }
+}
+
+void MetricsExporter::answer(int conn_fd) {
+  // read the request until the end of its headers. Its contents do not matter
+  char request[4096];
+  size_t request_size = 0;
+  while (request_size < sizeof(request) - 1) {
+    pollfd pfd = {conn_fd, POLLIN, 0};
+    if (poll(&pfd, 1, poll_interval_ms) <= 0) return; // client is not sending a request
+    ssize_t got = read(conn_fd, request + request_size, sizeof(request) - 1 - request_size);
+    if (got <= 0) return;
+    request_size += got;
+    request[request_size] = '\0';
+    if (strstr(request, "\r\n\r\n") != nullptr) break;
+  }
+
+  std::string body = render(graph);
+  std::string response = "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                         "Connection: close\r\n\r\n" + body;
+  size_t written = 0;
+  while (written < response.size()) {
+    ssize_t ret = send(conn_fd, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return;
+    written += ret;
+  }
+}
+
+// write the header of a metric family
+static void family(std::ostream &out, const std::string &name, const std::string &type,
+                   const std::string &help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+// write a histogram in seconds with buckets at each power of ten from 1us to 10s
+static void histogram(std::ostream &out, const std::string &name, const std::string &labels,
+                      const HistogramSnapshot &hist) {
+  std::string sep = labels.empty() ? "" : ",";
+  uint64_t le_nanos = 1000;
+  for (const char *le : {"1e-06", "1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10"}) {
+    out << name << "_bucket{" << labels << sep << "le=\"" << le << "\"} "
+        << hist.count_below(le_nanos) << "\n";
+    le_nanos *= 10;
+  }
+  out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << hist.count << "\n";
+  std::string braces = labels.empty() ? "" : "{" + labels + "}";
+  out << name << "_sum" << braces << " " << hist.sum / 1e9 << "\n";
+  out << name << "_count" << braces << " " << hist.count << "\n";
+}
+
+std::string MetricsExporter::render(const GraphDistribUpdate *graph) {
+  MetricsSnapshot metrics = ClusterMetrics::snapshot();
+  std::vector<std::pair<uint64_t, WorkerStatus>> status = WorkDistributor::get_status();
+  std::ostringstream out;
+
+  uint64_t updates = 0;
+  uint64_t num_status[4] = {0, 0, 0, 0};
+  for (auto &distributor : status) {
+    updates += distributor.first;
+    ++num_status[distributor.second];
+  }
+  family(out, "landscape_updates_total", "counter",
+         "Stream updates taken from the gutters by the WorkDistributors.");
+  out << "landscape_updates_total " << updates << "\n";
+  family(out, "landscape_cancelled_updates_total", "counter",
+         "Updates removed from batches because they cancel.");
+  out << "landscape_cancelled_updates_total " << WorkDistributor::cancelled_updates() << "\n";
+  family(out, "landscape_distributors", "gauge", "WorkDistributors in each state.");
+  const char *status_names[4] = {"queue_wait", "distrib_processing", "apply_delta", "paused"};
+  for (int s = 0; s < 4; s++)
+    out << "landscape_distributors{state=\"" << status_names[s] << "\"} " << num_status[s] << "\n";
+
+  family(out, "landscape_stage_seconds", "histogram", "Latency of each stage of ingestion.");
+  for (int s = 0; s < NUM_METRIC_STAGES; s++) {
+    histogram(out, "landscape_stage_seconds",
+              "stage=\"" + ClusterMetrics::stage_name((MetricStage) s) + "\"", metrics.stages[s]);
+  }
+
+  family(out, "landscape_forwarder_sent_bytes_total", "counter",
+         "Bytes of batch messages sent through each forwarder.");
+  for (size_t f = 0; f < metrics.forwarders.size(); f++)
+    out << "landscape_forwarder_sent_bytes_total{forwarder=\"" << f + 1 << "\"} "
+        << metrics.forwarders[f].bytes_sent << "\n";
+  family(out, "landscape_forwarder_sent_messages_total", "counter",
+         "Batch messages sent through each forwarder.");
+  for (size_t f = 0; f < metrics.forwarders.size(); f++)
+    out << "landscape_forwarder_sent_messages_total{forwarder=\"" << f + 1 << "\"} "
+        << metrics.forwarders[f].messages_sent << "\n";
+  family(out, "landscape_forwarder_received_bytes_total", "counter",
+         "Bytes of delta messages received through each forwarder.");
+  for (size_t f = 0; f < metrics.forwarders.size(); f++)
+    out << "landscape_forwarder_received_bytes_total{forwarder=\"" << f + 1 << "\"} "
+        << metrics.forwarders[f].bytes_received << "\n";
+  family(out, "landscape_forwarder_received_messages_total", "counter",
+         "Delta messages received through each forwarder.");
+  for (size_t f = 0; f < metrics.forwarders.size(); f++)
+    out << "landscape_forwarder_received_messages_total{forwarder=\"" << f + 1 << "\"} "
+        << metrics.forwarders[f].messages_received << "\n";
+  family(out, "landscape_forwarder_round_trip_seconds", "histogram",
+         "Batch to delta round trip of the workers of each forwarder.");
+  for (size_t f = 0; f < metrics.forwarders.size(); f++) {
+    histogram(out, "landscape_forwarder_round_trip_seconds",
+              "forwarder=\"" + std::to_string(f + 1) + "\"", metrics.forwarders[f].round_trip);
+  }
+  family(out, "landscape_worker_round_trip_seconds", "histogram",
+         "Batch to delta round trip of each worker.");
+  for (size_t w = 0; w < metrics.worker_round_trips.size(); w++) {
+    histogram(out, "landscape_worker_round_trip_seconds",
+              "worker=\"" + std::to_string(w + WorkerCluster::distrib_worker_offset) + "\"",
+              metrics.worker_round_trips[w]);
+  }
+
+  // worker statistics are as of the last heartbeat or flush and are reset when the cluster is
+  // stopped
+  family(out, "landscape_worker_updates", "gauge", "Updates processed by each worker.");
+  for (auto &w : metrics.workers)
+    out << "landscape_worker_updates{worker=\"" << w.worker_id << "\"} " << w.updates << "\n";
+  family(out, "landscape_worker_batch_messages", "gauge",
+         "Batch messages processed by each worker.");
+  for (auto &w : metrics.workers)
+    out << "landscape_worker_batch_messages{worker=\"" << w.worker_id << "\"} " << w.batch_msgs
+        << "\n";
+  family(out, "landscape_worker_delta_bytes", "gauge", "Bytes of deltas returned by each worker.");
+  for (auto &w : metrics.workers)
+    out << "landscape_worker_delta_bytes{worker=\"" << w.worker_id << "\"} " << w.delta_bytes
+        << "\n";
+  family(out, "landscape_worker_busy_seconds", "gauge",
+         "Time each worker spent generating deltas, summed over its threads.");
+  for (auto &w : metrics.workers)
+    out << "landscape_worker_busy_seconds{worker=\"" << w.worker_id << "\"} "
+        << w.busy_nanos / 1e9 << "\n";
+
+  family(out, "landscape_worker_utilization", "gauge",
+         "Fraction of the time of each worker's threads spent generating deltas.");
+  for (auto &h : metrics.health)
+    out << "landscape_worker_utilization{worker=\"" << h.worker_id << "\"} " << h.utilization
+        << "\n";
+  family(out, "landscape_worker_updates_per_second", "gauge",
+         "Updates processed per second by each worker.");
+  for (auto &h : metrics.health)
+    out << "landscape_worker_updates_per_second{worker=\"" << h.worker_id << "\"} "
+        << h.updates_per_sec << "\n";
+  family(out, "landscape_worker_idle_handlers", "gauge",
+         "Message handlers of each worker waiting for a batch message.");
+  for (auto &h : metrics.health)
+    out << "landscape_worker_idle_handlers{worker=\"" << h.worker_id << "\"} " << h.idle_handlers
+        << "\n";
+  family(out, "landscape_worker_pending_returns", "gauge",
+         "Delta messages of each worker waiting to be returned to main.");
+  for (auto &h : metrics.health)
+    out << "landscape_worker_pending_returns{worker=\"" << h.worker_id << "\"} "
+        << h.pending_returns << "\n";
+  family(out, "landscape_worker_heartbeat_age_seconds", "gauge",
+         "Time since the last heartbeat of each worker.");
+  for (auto &h : metrics.health)
+    out << "landscape_worker_heartbeat_age_seconds{worker=\"" << h.worker_id << "\"} "
+        << h.heartbeat_age << "\n";
+
+  if (graph != nullptr) {
+    MemoryReport memory = graph->memory_report();
+    family(out, "landscape_memory_bytes", "gauge", "Memory of each component of main.");
+    std::pair<const char *, uint64_t> components[] = {
+        {"supernodes", memory.supernodes},         {"query_copies", memory.query_copies},
+        {"gutters", memory.gutters},               {"work_distributors", memory.work_distributors},
+        {"message_buffers", memory.message_pool}, {"bookkeeping", memory.bookkeeping}};
+    for (auto &component : components)
+      out << "landscape_memory_bytes{component=\"" << component.first << "\"} "
+          << component.second << "\n";
+    family(out, "landscape_resident_bytes", "gauge", "Resident set size of main.");
+    out << "landscape_resident_bytes " << memory.main_resident << "\n";
+    family(out, "landscape_worker_memory_bytes", "gauge", "Memory of each component of each worker.");
+    for (auto &w : memory.workers) {
+      out << "landscape_worker_memory_bytes{worker=\"" << w.worker_id
+          << "\",component=\"buffers\"} " << w.buffer_bytes << "\n";
+      out << "landscape_worker_memory_bytes{worker=\"" << w.worker_id
+          << "\",component=\"resident_deltas\"} " << w.resident_bytes << "\n";
+    }
+  }
+  return out.str();
+}
@@ -0,0 +1,120 @@
+#include "msg_buffer_pool.h"
+
+#include <mpi.h>
+#include <new>
+#include <sys/mman.h>
+
+constexpr size_t MsgBufferPool::huge_page_size;
+constexpr size_t MsgBufferPool::min_buffer_size;
+std::mutex MsgBufferPool::pool_lock;
+std::map<size_t, std::vector<char *>> MsgBufferPool::free_buffers;
+std::unordered_map<char *, size_t> MsgBufferPool::buffer_sizes;
+std::vector<MsgBufferPool::Chunk> MsgBufferPool::chunks;
+char *MsgBufferPool::chunk_pos = nullptr;
+size_t MsgBufferPool::chunk_left = 0;
+
+static size_t round_to_huge_page(size_t bytes) {
+  return (bytes + MsgBufferPool::huge_page_size - 1) / MsgBufferPool::huge_page_size *
+         MsgBufferPool::huge_page_size;
+}
+
+size_t MsgBufferPool::size_class(size_t bytes) {
+  size_t size = min_buffer_size;
+  while (size < bytes) size *= 2;
+  return size;
+}
+
+MsgBufferPool::Chunk MsgBufferPool::alloc_chunk(size_t bytes) {
+#ifdef USE_MPI_ALLOC_MEM
+  // over allocate so that the chunk may be aligned to a huge page
+  char *mem;
+  if (MPI_Alloc_mem(bytes + huge_page_size, MPI_INFO_NULL, &mem) != MPI_SUCCESS)
+    throw std::bad_alloc();
+  size_t offset = (huge_page_size - (size_t) mem % huge_page_size) % huge_page_size;
+  madvise(mem + offset, bytes, MADV_HUGEPAGE);
+  return {mem, mem + offset, bytes};
+#else
+  // prefer reserved huge pages and otherwise ask for transparent huge pages
+  void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) return {(char *) mem, (char *) mem, bytes};
+
+  mem = mmap(nullptr, bytes + huge_page_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) throw std::bad_alloc();
+
+  // unmap the portions before and after the aligned chunk
+  char *base = (char *) mem;
+  size_t offset = (huge_page_size - (size_t) base % huge_page_size) % huge_page_size;
+  if (offset > 0) munmap(base, offset);
+  if (huge_page_size - offset > 0) munmap(base + offset + bytes, huge_page_size - offset);
+  madvise(base + offset, bytes, MADV_HUGEPAGE);
+  return {base + offset, base + offset, bytes};
+#endif
+}
+
+void MsgBufferPool::free_chunk(Chunk chunk) {
+#ifdef USE_MPI_ALLOC_MEM
+  MPI_Free_mem(chunk.base);
+#else
+  munmap(chunk.mem, chunk.bytes);
+#endif
+}
+
+char *MsgBufferPool::get(size_t bytes) {
+  size_t size = size_class(bytes);
+  std::lock_guard<std::mutex> lk(pool_lock);
+  auto &free_list = free_buffers[size];
+  if (!free_list.empty()) {
+    char *buf = free_list.back();
+    free_list.pop_back();
+    return buf;
+  }
+
+  char *buf;
+  if (size >= huge_page_size) {
+    // large buffers receive their own chunk
+    Chunk chunk = alloc_chunk(round_to_huge_page(size));
+    chunks.push_back(chunk);
+    buf = chunk.mem;
+  } else {
+    if (chunk_left < size) {
+      Chunk chunk = alloc_chunk(huge_page_size);
+      chunks.push_back(chunk);
+      chunk_pos = chunk.mem;
+      chunk_left = huge_page_size;
+    }
+    buf = chunk_pos;
+    chunk_pos += size;
+    chunk_left -= size;
+  }
+  buffer_sizes[buf] = size;
+  return buf;
+}
+
+void MsgBufferPool::put(char *buf) {
+  if (buf == nullptr) return;
+  std::lock_guard<std::mutex> lk(pool_lock);
+  auto it = buffer_sizes.find(buf);
+  if (it == buffer_sizes.end()) return; // released by free_all()
+  free_buffers[it->second].push_back(buf);
+}
+
+size_t MsgBufferPool::bytes_mapped() {
+  std::lock_guard<std::mutex> lk(pool_lock);
+  size_t bytes = 0;
+  for (auto &chunk : chunks)
+    bytes += chunk.bytes;
+  return bytes;
+}
+
+void MsgBufferPool::free_all() {
+  std::lock_guard<std::mutex> lk(pool_lock);
+  for (auto chunk : chunks)
+    free_chunk(chunk);
+  chunks.clear();
+  free_buffers.clear();
+  buffer_sizes.clear();
+  chunk_pos = nullptr;
+  chunk_left = 0;
+}
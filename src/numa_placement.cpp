@@ -0,0 +1,114 @@
+#include "numa_placement.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static constexpr int mpol_mf_move = 1 << 1; // MPOL_MF_MOVE of numaif.h
+
+// parse a sysfs cpu list such as "0-7,16-23"
+static std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) continue;
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+const std::vector<std::vector<int>> &NumaPlacement::numa_cpus() {
+  static const std::vector<std::vector<int>> cpus = []() {
+    std::vector<std::vector<int>> ret;
+    for (int node = 0; ; node++) {
+      std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      std::string list;
+      if (!in.is_open() || !std::getline(in, list)) break;
+      std::vector<int> node_cpus = parse_cpu_list(list);
+      if (node_cpus.empty()) break; // a memory only NUMA node ends the list
+      ret.push_back(node_cpus);
+    }
+    if (ret.empty()) {
+      // no NUMA information so every cpu belongs to a single NUMA node
+      ret.emplace_back();
+      for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+        ret[0].push_back(cpu);
+    }
+    return ret;
+  }();
+  return cpus;
+}
+
+int NumaPlacement::num_numa_nodes() {
+  return numa_cpus().size();
+}
+
+bool NumaPlacement::pin_thread(pthread_t thr, int numa_node) {
+  const auto &cpus = numa_cpus();
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int node = 0; node < (int) cpus.size(); node++) {
+    if (numa_node >= 0 && node != numa_node % (int) cpus.size()) continue;
+    for (int cpu : cpus[node])
+      if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(thr, sizeof(set), &set) == 0;
+}
+
+void NumaPlacement::pin_this_thread(int numa_node) {
+  thread_local int pinned_to = -1;
+  if (pinned_to == numa_node) return;
+  if (pin_thread(pthread_self(), numa_node)) pinned_to = numa_node;
+}
+
+// the page aligned addresses of the pages that hold [addr, addr + bytes)
+static std::vector<void *> pages_of(const void *addr, size_t bytes) {
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t) addr & ~(page_size - 1);
+  uintptr_t end = (uintptr_t) addr + bytes;
+  std::vector<void *> pages;
+  for (uintptr_t page = first; page < end; page += page_size)
+    pages.push_back((void *) page);
+  return pages;
+}
+
+void *NumaPlacement::alloc_pages(size_t bytes) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  void *addr;
+  if (posix_memalign(&addr, page_size, (bytes + page_size - 1) / page_size * page_size) != 0)
+    return nullptr;
+  return addr;
+}
+
+bool NumaPlacement::move_to_numa_node(const void *addr, size_t bytes, int numa_node) {
+  if (num_numa_nodes() == 1) return true;
+  std::vector<void *> pages = pages_of(addr, bytes);
+  std::vector<int> nodes(pages.size(), numa_node);
+  std::vector<int> status(pages.size());
+  if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nodes.data(), status.data(),
+              mpol_mf_move) != 0)
+    return false;
+  // the call succeeds even if some pages could not be moved, each status is a node or -errno
+  for (int page_node : status)
+    if (page_node != numa_node) return false;
+  return true;
+}
+
+int NumaPlacement::numa_node_of_address(const void *addr) {
+  // without target nodes move_pages only reports where each page is
+  void *page = pages_of(addr, 1)[0];
+  int status = -1;
+  if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0) return -1;
+  return status < 0 ? -1 : status;
+}
@@ -0,0 +1,69 @@
+#include "query_coordinator.h"
+#include "graph_distrib_update.h"
+
+constexpr std::chrono::microseconds QueryCoordinator::default_coalesce_window;
+
+QueryCoordinator::QueryCoordinator(GraphDistribUpdate *_graph, std::chrono::microseconds _window)
+    : graph(_graph), window(_window), query_thr(&QueryCoordinator::do_query_work, this) {}
+
+QueryCoordinator::~QueryCoordinator() {
+  std::unique_lock<std::mutex> lk(queue_lock);
+  shutdown = true;
+  lk.unlock();
+  queue_condition.notify_all();
+  query_thr.join();
+}
+
+void QueryCoordinator::enqueue(Query &&query) {
+  std::unique_lock<std::mutex> lk(queue_lock);
+  pending.push_back(std::move(query));
+  lk.unlock();
+  queue_condition.notify_all();
+}
+
+void QueryCoordinator::do_query_work() {
+  while (true) {
+    std::unique_lock<std::mutex> lk(queue_lock);
+    queue_condition.wait(lk, [&]{ return !pending.empty() || shutdown; });
+    if (pending.empty()) return; // shutdown and no more queries to answer
+
+    if (pending.front().exclusive) {
+      Query query = std::move(pending.front());
+      pending.pop_front();
+      lk.unlock();
+      query.answer();
+      continue;
+    }
+
+    // give other callers a chance to join this flush and Boruvka. A valid DSU needs
+    // neither, so its queries are answered at once
+    if (!graph->dsu_valid) {
+      auto deadline = std::chrono::steady_clock::now() + window.load();
+      queue_condition.wait_until(lk, deadline, [&]{ return shutdown; });
+    }
+
+    // gather the DSU queries at the front of the queue. Stop at an exclusive query so
+    // that queries are answered in the order they were submitted
+    std::vector<Query> queries;
+    while (!pending.empty() && !pending.front().exclusive) {
+      queries.push_back(std::move(pending.front()));
+      pending.pop_front();
+    }
+    lk.unlock();
+    run_dsu_queries(queries);
+  }
+}
+
+void QueryCoordinator::run_dsu_queries(std::vector<Query> &queries) {
+  size_t answered = 0;
+  try {
+    graph->query_dsu([&]() {
+      for (; answered < queries.size(); answered++)
+        queries[answered].answer();
+    });
+  } catch (...) {
+    // the flush or Boruvka failed so inform every caller we have not yet answered
+    for (; answered < queries.size(); answered++)
+      queries[answered].fail(std::current_exception());
+  }
+}
@@ -0,0 +1,291 @@
+#include "sketch_checkpoint.h"
+#include "memstream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+constexpr uint64_t SketchCheckpoint::magic_number;
+constexpr uint64_t SketchCheckpoint::log_magic_number;
+constexpr uint64_t SketchCheckpoint::record_magic_number;
+constexpr uint64_t SketchCheckpoint::version;
+constexpr size_t SketchCheckpoint::page_size;
+constexpr size_t SketchCheckpoint::chunk_bytes;
+
+static std::runtime_error checkpoint_error(const std::string &msg, const std::string &path) {
+  return std::runtime_error("SketchCheckpoint: " + msg + " " + path + ": " + std::strerror(errno));
+}
+
+// pwrite and pread may transfer fewer bytes than requested so loop until done
+static bool pwrite_all(int fd, const char *buf, size_t bytes, off_t offset) {
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, buf, bytes, offset);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    buf += written;
+    bytes -= written;
+    offset += written;
+  }
+  return true;
+}
+
+static bool pread_all(int fd, char *buf, size_t bytes, off_t offset) {
+  while (bytes > 0) {
+    ssize_t num_read = pread(fd, buf, bytes, offset);
+    if (num_read < 0 && errno == EINTR) continue;
+    if (num_read <= 0) return false;
+    buf += num_read;
+    bytes -= num_read;
+    offset += num_read;
+  }
+  return true;
+}
+
+// write a struct to the start of a zeroed page at offset
+template <class T>
+static bool pwrite_page(int fd, const T &data, off_t offset) {
+  static_assert(sizeof(T) <= SketchCheckpoint::page_size, "struct must fit in one page");
+  char page[SketchCheckpoint::page_size] = {};
+  memcpy(page, &data, sizeof(T));
+  return pwrite_all(fd, page, SketchCheckpoint::page_size, offset);
+}
+
+// create the file at path by writing it to a temporary file and renaming it into place
+static void write_and_rename(const std::string &path, const std::function<void(int, const std::string&)> &fill) {
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw checkpoint_error("could not open", tmp_path);
+
+  try {
+    fill(fd, tmp_path);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  if (fsync(fd) != 0) {
+    close(fd);
+    throw checkpoint_error("could not sync", tmp_path);
+  }
+  close(fd);
+
+  if (std::rename(tmp_path.c_str(), path.c_str()))
+    throw checkpoint_error("could not rename checkpoint to", path);
+}
+
+void SketchCheckpoint::write_supernodes(int fd, const std::string &path, uint64_t offset,
+                                        size_t num, uint64_t supernode_bytes,
+                                        const std::function<Supernode *(size_t)> &get) {
+  // each chunk of supernodes is serialized and written by a single thread
+  size_t per_chunk = std::max((size_t)1, chunk_bytes / supernode_bytes);
+  size_t num_chunks = (num + per_chunk - 1) / per_chunk;
+  bool io_failed = false;
+  bool bad_size = false;
+
+#pragma omp parallel
+  {
+    std::vector<char> buffer(per_chunk * supernode_bytes);
+#pragma omp for schedule(dynamic, 1)
+    for (size_t c = 0; c < num_chunks; c++) {
+      size_t first = c * per_chunk;
+      size_t last = std::min(first + per_chunk, num);
+      omemstream stream(buffer.data(), buffer.size());
+      for (size_t i = first; i < last; i++)
+        get(i)->write_binary(stream);
+
+      size_t bytes = (last - first) * supernode_bytes;
+      if ((size_t)stream.tellp() != bytes) {
+#pragma omp critical
+        bad_size = true;
+      }
+      else if (!pwrite_all(fd, buffer.data(), bytes, offset + first * supernode_bytes)) {
+#pragma omp critical
+        io_failed = true;
+      }
+    }
+  }
+
+  if (io_failed)
+    throw checkpoint_error("could not write supernodes to", path);
+  if (bad_size)
+    throw std::runtime_error("SketchCheckpoint: serialized supernode size does not match " +
+                             std::to_string(supernode_bytes));
+}
+
+void SketchCheckpoint::read_supernodes(int fd, const std::string &path, uint64_t offset,
+                                       size_t num, uint64_t supernode_bytes,
+                                       const std::function<node_id_t(size_t)> &node,
+                                       const std::function<void(node_id_t, std::istream &)> &load) {
+  size_t per_chunk = std::max((size_t)1, chunk_bytes / supernode_bytes);
+  size_t num_chunks = (num + per_chunk - 1) / per_chunk;
+  bool failed = false;
+  std::exception_ptr err;
+
+#pragma omp parallel
+  {
+    std::vector<char> buffer(per_chunk * supernode_bytes);
+#pragma omp for schedule(dynamic, 1)
+    for (size_t c = 0; c < num_chunks; c++) {
+      size_t first = c * per_chunk;
+      size_t last = std::min(first + per_chunk, num);
+      size_t bytes = (last - first) * supernode_bytes;
+      if (!pread_all(fd, buffer.data(), bytes, offset + first * supernode_bytes)) {
+#pragma omp critical
+        failed = true;
+        continue;
+      }
+
+      try {
+        for (size_t i = first; i < last; i++) {
+          imemstream stream(buffer.data() + (i - first) * supernode_bytes, supernode_bytes);
+          load(node(i), stream);
+        }
+      } catch (...) {
+        // exceptions may not leave the parallel region so rethrow after it
+#pragma omp critical
+        err = std::current_exception();
+      }
+    }
+  }
+
+  if (failed) throw checkpoint_error("could not read supernodes of", path);
+  if (err) std::rethrow_exception(err);
+}
+
+uint64_t SketchCheckpoint::write(const std::string &path, CheckpointHeader header,
+                                 Supernode **supernodes, bool begin_log) {
+  header.magic = magic_number;
+  header.version = version;
+  std::random_device rd;
+  header.checkpoint_id = ((uint64_t)rd() << 32) | rd();
+
+  write_and_rename(path, [&](int fd, const std::string &tmp_path) {
+    if (!pwrite_page(fd, header, 0))
+      throw checkpoint_error("could not write header to", tmp_path);
+    write_supernodes(fd, tmp_path, page_size, header.num_nodes, header.supernode_bytes,
+                     [&](size_t i) { return supernodes[i]; });
+  });
+
+  if (!begin_log) return header.checkpoint_id;
+
+  // begin an empty log. Any existing log belongs to a previous checkpoint
+  CheckpointLogHeader log_header{log_magic_number, header.checkpoint_id};
+  write_and_rename(log_path(path), [&](int fd, const std::string &tmp_path) {
+    if (!pwrite_page(fd, log_header, 0))
+      throw checkpoint_error("could not write header to", tmp_path);
+  });
+  return header.checkpoint_id;
+}
+
+CheckpointHeader SketchCheckpoint::read_header(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw checkpoint_error("could not open", path);
+
+  CheckpointHeader header;
+  bool ok = pread_all(fd, (char *) &header, sizeof(header), 0);
+  close(fd);
+  if (!ok) throw checkpoint_error("could not read header of", path);
+
+  if (header.magic != magic_number)
+    throw std::invalid_argument("SketchCheckpoint: " + path + " is not a sketch checkpoint");
+  if (header.version != version)
+    throw std::invalid_argument("SketchCheckpoint: " + path + " has unsupported version " +
+                                std::to_string(header.version));
+  return header;
+}
+
+void SketchCheckpoint::read_supernodes(const std::string &path, const CheckpointHeader &header,
+                 const std::function<void(node_id_t, std::istream &)> &load) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw checkpoint_error("could not open", path);
+
+  try {
+    read_supernodes(fd, path, page_size, header.num_nodes, header.supernode_bytes,
+                    [](size_t i) { return (node_id_t) i; }, load);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+uint64_t SketchCheckpoint::append_log(const std::string &path, uint64_t log_end,
+                                      uint64_t stream_offset, const std::vector<node_id_t> &nodes,
+                                      Supernode **supernodes, uint64_t supernode_bytes) {
+  std::string log = log_path(path);
+  int fd = open(log.c_str(), O_WRONLY);
+  if (fd < 0) throw checkpoint_error("could not open", log);
+
+  uint64_t ids_offset = log_end + page_size;
+  uint64_t ids_bytes = nodes.size() * sizeof(node_id_t);
+  uint64_t supernodes_offset = ids_offset + round_to_page(ids_bytes);
+  try {
+    // write the body of the record and only then its header so that a partially written
+    // record is never mistaken for a valid one
+    if (!pwrite_all(fd, (const char *) nodes.data(), ids_bytes, ids_offset))
+      throw checkpoint_error("could not write record to", log);
+    write_supernodes(fd, log, supernodes_offset, nodes.size(), supernode_bytes,
+                     [&](size_t i) { return supernodes[nodes[i]]; });
+    if (fdatasync(fd) != 0)
+      throw checkpoint_error("could not sync", log);
+
+    CheckpointLogRecord record{record_magic_number, stream_offset, nodes.size()};
+    if (!pwrite_page(fd, record, log_end))
+      throw checkpoint_error("could not write record to", log);
+    if (fdatasync(fd) != 0)
+      throw checkpoint_error("could not sync", log);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return log_end + log_record_bytes(nodes.size(), supernode_bytes);
+}
+
+uint64_t SketchCheckpoint::replay_log(const std::string &path, const CheckpointHeader &header,
+                                      uint64_t &stream_offset,
+                                      const std::function<void(node_id_t, std::istream &)> &load) {
+  stream_offset = header.stream_offset;
+  std::string log = log_path(path);
+  int fd = open(log.c_str(), O_RDONLY);
+  if (fd < 0) return 0; // no log so there is nothing to apply
+
+  CheckpointLogHeader log_header;
+  if (!pread_all(fd, (char *) &log_header, sizeof(log_header), 0) ||
+      log_header.magic != log_magic_number || log_header.checkpoint_id != header.checkpoint_id) {
+    close(fd);
+    return 0; // the log belongs to a different checkpoint
+  }
+
+  uint64_t log_end = page_size;
+  try {
+    while (true) {
+      CheckpointLogRecord record;
+      if (!pread_all(fd, (char *) &record, sizeof(record), log_end) ||
+          record.magic != record_magic_number)
+        break; // reached the end of the valid records
+
+      std::vector<node_id_t> nodes(record.num_supernodes);
+      uint64_t ids_offset = log_end + page_size;
+      uint64_t ids_bytes = nodes.size() * sizeof(node_id_t);
+      if (!pread_all(fd, (char *) nodes.data(), ids_bytes, ids_offset))
+        throw checkpoint_error("could not read record of", log);
+      read_supernodes(fd, log, ids_offset + round_to_page(ids_bytes), nodes.size(),
+                      header.supernode_bytes, [&](size_t i) { return nodes[i]; }, load);
+
+      stream_offset = record.stream_offset;
+      log_end += log_record_bytes(nodes.size(), header.supernode_bytes);
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return log_end;
+}
@@ -1,6 +1,8 @@
 #include "work_distributor.h"
 #include "worker_cluster.h"
 #include "graph_distrib_update.h"
+#include "msg_buffer_pool.h"
+#include "batch_tracer.h"
 
 #include <string>
 #include <iostream>
@@ -12,6 +14,8 @@
 bool WorkDistributor::shutdown = false;
 bool WorkDistributor::paused   = false; // controls whether threads should pause or resume work
 constexpr size_t WorkDistributor::local_process_cutoff;
+constexpr size_t WorkDistributor::coalesce_batches;
+constexpr std::chrono::microseconds WorkDistributor::coalesce_deadline;
 int WorkDistributor::work_distrib_threads;
 node_id_t WorkDistributor::supernode_size;
 WorkDistributor **WorkDistributor::workers;
@@ -19,6 +23,13 @@ std::condition_variable WorkDistributor::pause_condition;
 std::mutex WorkDistributor::pause_lock;
 std::thread WorkDistributor::status_thread;
 std::atomic<size_t> WorkDistributor::proc_locally;
+std::atomic<bool> WorkDistributor::cancel_duplicates{false};
+std::atomic<uint64_t> WorkDistributor::cancelled_local{0};
+std::atomic<uint64_t> WorkDistributor::cancelled_sent{0};
+std::thread WorkDistributor::heartbeat_thread;
+std::atomic<bool> WorkDistributor::stop_heartbeats{false};
+std::array<std::atomic<bool>, WorkerCluster::num_msg_forwarders> WorkDistributor::saturated;
+constexpr double WorkDistributor::saturated_utilization;
 
 // Queries the work distributors for their current status and writes it to a file
 void status_querier() {
@@ -79,6 +90,20 @@ void status_querier() {
     tmp_file << "DISTRIB_PROCESSING " << d_total << std::endl;
     tmp_file << "APPLY_DELTA        " << a_total << std::endl;
     tmp_file << "PAUSED             " << paused  << std::endl;
+    if (WorkDistributor::cancelled_updates() > 0)
+      tmp_file << "Cancelled Updates: " << WorkDistributor::cancelled_updates() << ", Bytes Saved: "
+               << WorkDistributor::cancelled_bytes() << std::endl;
+
+    // the health of each worker as of its last heartbeat
+    std::vector<WorkerHealth> health = ClusterMetrics::worker_health();
+    if (health.size() > 0)
+      tmp_file << "Worker\tUtilization\tUpdates/s\tIdle Handlers\tPending Returns\tLast Heartbeat"
+               << std::endl;
+    for (auto &worker : health) {
+      tmp_file << worker.worker_id << "\t" << worker.utilization << "\t\t"
+               << (uint64_t) worker.updates_per_sec << "\t\t" << worker.idle_handlers << "\t\t"
+               << worker.pending_returns << "\t\t" << worker.heartbeat_age << "s ago" << std::endl;
+    }
 
     // rename temporary file to actual status file then sleep
     tmp_file.flush();
@@ -98,13 +123,14 @@ void status_querier() {
 void WorkDistributor::start_workers(GraphDistribUpdate *_graph, GutteringSystem *_gts) {
   size_t buffer_size = std::max((size_t)_gts->gutter_size(), Supernode::get_serialized_size());
   WorkerCluster::start_cluster(_graph->get_num_nodes(), _graph->get_seed(), buffer_size,
-                               _graph->get_k());
+                               _graph->get_k(), _graph->get_resident_workers());
   _gts->set_non_block(false); // make the WorkDistributors wait on queue
   shutdown = false;
   paused   = false;
   supernode_size = Supernode::get_size();
   work_distrib_threads = std::min(WorkerCluster::num_msg_forwarders, WorkerCluster::num_workers);
 
+  ClusterMetrics::reset(); // before any WorkDistributor records
   workers = new WorkDistributor*[work_distrib_threads];
   for (int i = 0; i < work_distrib_threads; i++) {
     // calculate number of workers this distributor is responsible for
@@ -112,6 +138,12 @@ void WorkDistributor::start_workers(GraphDistribUpdate *_graph, GutteringSystem
   }
   status_thread = std::thread(status_querier);
   proc_locally = 0;
+  cancelled_local = 0;
+  cancelled_sent = 0;
+  cancel_duplicates = false; // each graph opts in for itself
+  for (auto &fwd_saturated : saturated) fwd_saturated = false;
+  stop_heartbeats = false;
+  heartbeat_thread = std::thread(recv_heartbeats);
 }
 
 uint64_t WorkDistributor::stop_workers() {
@@ -127,13 +159,44 @@ uint64_t WorkDistributor::stop_workers() {
     delete workers[i];
   }
   delete[] workers;
-  if (WorkerCluster::is_active()) // catch edge case where stop after teardown_cluster()
-    return WorkerCluster::stop_cluster() + proc_locally;
-  else
-    return 0;
+  // cancelled updates are counted as processed as their effect on the sketches is applied
+  if (WorkerCluster::is_active()) { // catch edge case where stop after teardown_cluster()
+    uint64_t updates = WorkerCluster::stop_cluster() + proc_locally + cancelled_sent;
+    heartbeat_thread.join(); // every worker has sent its final heartbeat
+    return updates;
+  }
+  stop_heartbeats = true;
+  heartbeat_thread.join();
+  return 0;
+}
+
+void WorkDistributor::recv_heartbeats() {
+  std::vector<double> utilization(WorkerCluster::num_workers, 0);
+  int num_stopped = 0;
+  while (num_stopped < WorkerCluster::num_workers && !stop_heartbeats) {
+    WorkerHeartbeat heartbeat;
+    if (!WorkerCluster::try_recv_heartbeat(heartbeat)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    WorkerHealth health = ClusterMetrics::record_heartbeat(heartbeat);
+    if (health.stopped) ++num_stopped;
+
+    // a forwarder is saturated if all of its workers are
+    int worker_idx = health.worker_id - WorkerCluster::distrib_worker_offset;
+    utilization[worker_idx] = health.stopped ? 0 : health.utilization;
+    int fid = WorkerCluster::forwarder_of_worker(worker_idx);
+    int first, last;
+    WorkerCluster::forwarder_workers(fid, first, last);
+    bool all_saturated = true;
+    for (int w = first; w < last; w++)
+      all_saturated = all_saturated && utilization[w] >= saturated_utilization;
+    saturated[fid - 1] = all_saturated;
+  }
 }
 
 void WorkDistributor::pause_workers() {
+  auto pause_start = std::chrono::steady_clock::now();
   paused = true;
   workers[0]->gts->set_non_block(true); // make the WorkDistributors bypass waiting in queue
 
@@ -157,7 +220,11 @@ void WorkDistributor::pause_workers() {
     }
     lk.unlock();
 
-    if (all_paused) return; // all workers are done so exit
+    if (all_paused) {
+      // all workers are done so exit
+      ClusterMetrics::record(FLUSH_TIME, std::chrono::steady_clock::now() - pause_start);
+      return;
+    }
   }
 }
 
@@ -190,11 +257,23 @@ void WorkDistributor::unpause_workers() {
   }
 }
 
+void WorkDistributor::pin_workers(NumaPolicy policy) {
+  int numa_nodes = NumaPlacement::num_numa_nodes();
+  for (int i = 0; i < work_distrib_threads; i++) {
+    int node = policy == NO_NUMA ? -1 : i % numa_nodes;
+    NumaPlacement::pin_thread(workers[i]->thr.native_handle(), node);
+    NumaPlacement::pin_thread(workers[i]->delta_thr.native_handle(), node);
+    NumaPlacement::pin_thread(workers[i]->coalesce_thr.native_handle(), node);
+    workers[i]->numa_node = node; // helper threads pin themselves when next used
+  }
+}
+
 WorkDistributor::WorkDistributor(int _id, GraphDistribUpdate *_graph, GutteringSystem *_gts)
-    : id(_id), graph(_graph), gts(_gts), num_updates(0), thr_paused(false), 
-      send_buf(new char[WorkerCluster::max_msg_size]), 
-      recv_buf(new char[WorkerCluster::max_msg_size]),
-      thr(start_send_worker, this), delta_thr(start_recv_worker, this) {
+    : id(_id), graph(_graph), gts(_gts), num_updates(0), thr_paused(false), numa_node(-1),
+      send_buf(MsgBufferPool::get(WorkerCluster::max_msg_size)),
+      recv_buf(MsgBufferPool::get(WorkerCluster::max_msg_size)),
+      thr(start_send_worker, this), delta_thr(start_recv_worker, this),
+      coalesce_thr(&WorkDistributor::do_coalesce_work, this) {
   network_supernode = (Supernode *) malloc(Supernode::get_size());
   for (size_t i = 0; i < num_helper_threads; i++)
     local_supernodes[i] = (Supernode *) malloc(Supernode::get_size());
@@ -205,11 +284,16 @@ WorkDistributor::WorkDistributor(int _id, GraphDistribUpdate *_graph, GutteringS
 WorkDistributor::~WorkDistributor() {
   thr.join();
   delta_thr.join();
+  std::unique_lock<std::mutex> lk(send_lock);
+  stop_coalescing = true;
+  lk.unlock();
+  coalesce_condition.notify_one();
+  coalesce_thr.join();
   free(network_supernode);
   for (auto supernode : local_supernodes)
     free(supernode);
-  delete[] send_buf;
-  delete[] recv_buf;
+  MsgBufferPool::put(send_buf);
+  MsgBufferPool::put(recv_buf);
 }
 
 void WorkDistributor::do_send_work() {
@@ -220,7 +304,10 @@ void WorkDistributor::do_send_work() {
       distributor_status = QUEUE_WAIT;
       // call get_data which will handle waiting on the queue
       // and will enforce locking.
+      get_data_start = std::chrono::steady_clock::now();
       bool valid = gts->get_data(data);
+      get_data_end = std::chrono::steady_clock::now();
+      ClusterMetrics::record(QUEUE_WAIT_TIME, get_data_end - get_data_start);
       if (!valid && (shutdown || paused)) {
         break;
       }
@@ -234,18 +321,31 @@ void WorkDistributor::do_send_work() {
       }
 
 
-      if (upds_in_batches < local_process_cutoff * num_batches) {
+      size_t cutoff = saturated[id - 1] ? 2 * local_process_cutoff : local_process_cutoff;
+      if (upds_in_batches < cutoff * num_batches) {
         distributor_status = DISTRIB_PROCESSING;
+        auto local_start = std::chrono::steady_clock::now();
         // process locally instead of sending over network
 #pragma omp parallel for num_threads(num_helper_threads)
         for (size_t i = 0; i < data->get_batches().size(); i++) {
           auto& batch = data->get_batches()[i];
-          if (batch.upd_vec.size() > 0)
-            graph->batch_update(batch.node_idx, batch.upd_vec,
-                                local_supernodes[omp_get_thread_num()]);
+          NumaPlacement::pin_this_thread(numa_node);
+          const std::vector<node_id_t> *upds = &batch.upd_vec;
+          if (cancel_duplicates && batch.upd_vec.size() > 1) {
+            std::vector<node_id_t> &dests = local_dests[omp_get_thread_num()];
+            dests = batch.upd_vec;
+            dests.resize(WorkerCluster::cancel_duplicate_updates(dests.data(), dests.size()));
+            cancelled_local += batch.upd_vec.size() - dests.size();
+            upds = &dests;
+          }
+          if (upds->size() > 0) {
+            graph->batch_update(batch.node_idx, *upds, local_supernodes[omp_get_thread_num()]);
+            graph->mark_dirty(batch.node_idx);
+          }
         }
         gts->get_data_callback(data);
         proc_locally += upds_in_batches;
+        ClusterMetrics::record(LOCAL_TIME, std::chrono::steady_clock::now() - local_start);
       }
       else {
         // std::cout << "WorkDistributor " << id << " got valid data" << std::endl;
@@ -254,6 +354,9 @@ void WorkDistributor::do_send_work() {
       }
       num_updates += upds_in_batches;
     }
+    std::unique_lock<std::mutex> send_lk(send_lock);
+    send_pending_batches(); // the workers must recieve every batch before they flush
+    send_lk.unlock();
 
     if (shutdown) {
       // Tell the DistributedWorkers to flush their message queues and then shutdown
@@ -282,10 +385,89 @@ void WorkDistributor::do_send_work() {
 void WorkDistributor::send_batches(WorkQueue::DataNode *data) {
   // std::cout << "WorkDistributor " << id << " sending batches to DistributedWorker" << std::endl;
   distributor_status = DISTRIB_PROCESSING;
-  WorkerCluster::send_batches(id, data->get_batches(), send_buf);
+  size_t num_batches = 0;
+  size_t bytes = 0;
+  for (auto &batch : data->get_batches()) {
+    if (batch.upd_vec.size() == 0) continue;
+    ++num_batches;
+    bytes += WorkerCluster::batch_bytes(batch);
+  }
+
+  std::unique_lock<std::mutex> lk(send_lock);
+  // send the batch message first if these batches do not fit along with the trailer
+  if (send_batch_count + num_batches > WorkerCluster::num_batches ||
+      send_bytes + bytes + BatchTracer::trailer_bytes > (size_t) WorkerCluster::max_msg_size)
+    send_pending_batches();
+
+  bool begins_message = send_batch_count == 0;
+  if (begins_message) {
+    send_oldest = std::chrono::steady_clock::now();
+    msg_get_data_start = get_data_start;
+    msg_get_data_end = get_data_end;
+  }
+  size_t cancelled = 0;
+  send_batch_count += WorkerCluster::serialize_batches(data->get_batches(), send_buf, send_bytes,
+                                                       cancelled, cancel_duplicates);
+  cancelled_sent += cancelled;
 
-  // add DataNodes back to work queue
+  // add DataNodes back to work queue now that their batches are copied
   gts->get_data_callback(data);
+
+  if (send_batch_count >= coalesce_batches ||
+      std::chrono::steady_clock::now() - send_oldest >= coalesce_deadline) {
+    send_pending_batches();
+  } else if (begins_message) {
+    lk.unlock();
+    coalesce_condition.notify_one(); // the coalesce thread sends it if no DataNode follows
+  }
+}
+
+void WorkDistributor::do_coalesce_work() {
+  std::unique_lock<std::mutex> lk(send_lock);
+  while (!stop_coalescing) {
+    if (send_batch_count == 0) {
+      coalesce_condition.wait(lk);
+      continue;
+    }
+    auto deadline = send_oldest + coalesce_deadline;
+    if (std::chrono::steady_clock::now() < deadline) {
+      coalesce_condition.wait_until(lk, deadline);
+      continue;
+    }
+    send_pending_batches();
+  }
+}
+
+size_t WorkDistributor::unsent_batches() {
+  size_t batches = 0;
+  if (shutdown) return batches;
+  for (int i = 0; i < work_distrib_threads; i++) {
+    std::lock_guard<std::mutex> lk(workers[i]->send_lock);
+    batches += workers[i]->send_batch_count;
+  }
+  return batches;
+}
+
+void WorkDistributor::send_pending_batches() {
+  if (send_batch_count > 0) {
+    auto send_start = std::chrono::steady_clock::now();
+    ClusterMetrics::record(COALESCE_TIME, send_start - send_oldest);
+
+    // the trailer carries the send time, and the trace id if sampled, to the worker and back
+    BatchTracer::Trailer trailer;
+    trailer.trace_id = BatchTracer::sample();
+    trailer.sent_ns = BatchTracer::to_ns(send_start);
+    BatchTracer::write_trailer(send_buf + send_bytes, trailer);
+    send_bytes += BatchTracer::trailer_bytes;
+    WorkerCluster::send_batches(id, send_buf, send_bytes);
+    auto send_end = std::chrono::steady_clock::now();
+    ClusterMetrics::record(SEND_TIME, send_end - send_start);
+    ClusterMetrics::record_sent(id, send_bytes);
+    BatchTracer::record(trailer.trace_id, TRACE_GET_DATA, msg_get_data_start, msg_get_data_end);
+    BatchTracer::record(trailer.trace_id, TRACE_SEND_BATCHES, send_start, send_end);
+  }
+  send_bytes = 0;
+  send_batch_count = 0;
 }
 
 void WorkDistributor::do_recv_work() {
@@ -296,8 +478,21 @@ void WorkDistributor::do_recv_work() {
     MessageCode code = WorkerCluster::recv_message_from(recv_from, recv_buf, msg_size);
     if (code == DELTA) {
       distributor_status = APPLY_DELTA;
+      auto apply_start = std::chrono::steady_clock::now();
+      ClusterMetrics::record_received(id, msg_size);
+      // resident deltas returned by a flush answer no batch message and carry no trailer
+      BatchTracer::Trailer trailer;
+      if (BatchTracer::find_trailer(recv_buf, msg_size, trailer)) {
+        msg_size -= BatchTracer::trailer_bytes;
+        ClusterMetrics::record_round_trip(id, trailer.worker_id,
+                                          apply_start - BatchTracer::from_ns(trailer.sent_ns));
+      }
       WorkerCluster::parse_and_apply_deltas(recv_buf, msg_size, network_supernode, graph);
+      auto apply_end = std::chrono::steady_clock::now();
+      ClusterMetrics::record(DELTA_APPLY_TIME, apply_end - apply_start);
+      BatchTracer::record(trailer.trace_id, TRACE_APPLY_DELTAS, apply_start, apply_end);
     } else if (code == FLUSH) {
+      ClusterMetrics::record_worker_stats(recv_buf, msg_size);
       if (shutdown) {
         // std::cout << "WorkDistributor: " << id << " recv shutting down!" << std::endl;
         return;
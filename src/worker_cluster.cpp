@@ -4,6 +4,8 @@
 #include "message_forwarders.h"
 #include "graph_distrib_update.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <mpi.h>
 
@@ -16,33 +18,42 @@ bool WorkerCluster::active = false;
 constexpr int WorkerCluster::num_msg_forwarders;
 
 int WorkerCluster::start_cluster(node_id_t n_nodes, uint64_t _seed, int batch_size,
-                                 double sketches_factor) {
+                                 double sketches_factor, bool resident_deltas) {
   num_nodes = n_nodes;
   seed = _seed;
-  max_msg_size = (2*sizeof(node_id_t) + sizeof(node_id_t) * batch_size) * num_batches + sizeof(int);
+  max_msg_size = max_msg_size_of(batch_size, Supernode::get_serialized_size());
   active = true;
 
   MPI_Comm_size(MPI_COMM_WORLD, &total_processes);
   num_workers = total_processes - distrib_worker_offset; // don't count msg forwarders and main
 
-  // Initialize the MessageForwarders
-  size_t init_fwd_size = sizeof(max_msg_size) + sizeof(num_workers);
+  // Initialize the MessageForwarders. They recieve the parameters of the workers for BatchCapture
+  size_t init_fwd_size = sizeof(max_msg_size) + sizeof(num_workers) + sizeof(num_nodes) + sizeof(seed)
+                         + sizeof(sketches_factor);
   char init_fwd[init_fwd_size];
   memcpy(init_fwd, &max_msg_size, sizeof(max_msg_size));
   memcpy(init_fwd + sizeof(max_msg_size), &num_workers, sizeof(num_workers));
+  memcpy(init_fwd + sizeof(max_msg_size) + sizeof(num_workers), &num_nodes, sizeof(num_nodes));
+  memcpy(init_fwd + sizeof(max_msg_size) + sizeof(num_workers) + sizeof(num_nodes), &seed,
+         sizeof(seed));
+  memcpy(init_fwd + sizeof(max_msg_size) + sizeof(num_workers) + sizeof(num_nodes) + sizeof(seed),
+         &sketches_factor, sizeof(sketches_factor));
   std::cout << "Number of Message Forwarders: " << distrib_worker_offset - 1 << std::endl;
   for (int i = 0; i < distrib_worker_offset - 1; i++)
     MPI_Send(init_fwd, init_fwd_size, MPI_CHAR, i+1, INIT, MPI_COMM_WORLD);
 
   // Initialize the DistributedWorkers
   std::cout << "Number of workers is " << num_workers << ". Initializing!" << std::endl;
-  size_t init_size = sizeof(num_nodes) + sizeof(seed) + sizeof(max_msg_size) + sizeof(sketches_factor);
+  size_t init_size = sizeof(num_nodes) + sizeof(seed) + sizeof(max_msg_size) + sizeof(sketches_factor)
+                     + sizeof(resident_deltas);
   char init_data[init_size];
   memcpy(init_data, &num_nodes, sizeof(num_nodes));
   memcpy(init_data + sizeof(num_nodes), &seed, sizeof(seed));
   memcpy(init_data + sizeof(num_nodes) + sizeof(seed), &max_msg_size, sizeof(max_msg_size));
   memcpy(init_data + sizeof(num_nodes) + sizeof(seed) + sizeof(max_msg_size), &sketches_factor,
          sizeof(sketches_factor));
+  memcpy(init_data + sizeof(num_nodes) + sizeof(seed) + sizeof(max_msg_size) + sizeof(sketches_factor),
+         &resident_deltas, sizeof(resident_deltas));
   for (int i = 0; i < num_workers; i++)
     MPI_Ssend(init_data, init_size, MPI_CHAR, i + distrib_worker_offset, INIT, MPI_COMM_WORLD);
 
@@ -77,15 +88,10 @@ void WorkerCluster::shutdown_cluster() {
   active = false;
 }
 
-void WorkerCluster::send_batches(int fid, const std::vector<update_batch> &batches,
- char *msg_buffer) {
-  node_id_t msg_bytes = 0;
-
-  if (fid < 1 || fid > num_msg_forwarders) {
-    throw BadMessageException("send_batches(): Bad process ID");
-  }
-
-  for (auto batch : batches) {
+size_t WorkerCluster::serialize_batches(const std::vector<update_batch> &batches,
+ char *msg_buffer, size_t &msg_bytes, size_t &cancelled, bool cancel) {
+  size_t num_serialized = 0;
+  for (auto &batch : batches) {
     if (batch.upd_vec.size() > 0) {
       // serialize batch to char *
       node_id_t node_idx = batch.node_idx;
@@ -96,25 +102,50 @@ void WorkerCluster::send_batches(int fid, const std::vector<update_batch> &batch
       memcpy(msg_buffer + msg_bytes + sizeof(node_idx), &dests_size, sizeof(node_id_t));
 
       // write the batch data
-      memcpy(msg_buffer + msg_bytes + 2*sizeof(node_idx), batch.upd_vec.data(), dests_size * sizeof(node_id_t));
+      node_id_t *dests = (node_id_t *) (msg_buffer + msg_bytes + 2*sizeof(node_idx));
+      memcpy(dests, batch.upd_vec.data(), dests_size * sizeof(node_id_t));
+      if (cancel) {
+        // cancel the duplicates in place and then rewrite the size of the batch
+        node_id_t remaining = cancel_duplicate_updates(dests, dests_size);
+        cancelled += dests_size - remaining;
+        dests_size = remaining;
+        if (dests_size == 0) continue; // every update cancelled so skip this batch
+        memcpy(msg_buffer + msg_bytes + sizeof(node_idx), &dests_size, sizeof(node_id_t));
+      }
       msg_bytes += dests_size * sizeof(node_id_t) + 2 * sizeof(node_id_t);
+      ++num_serialized;
     }
   }
+  return num_serialized;
+}
+
+void WorkerCluster::send_batches(int fid, char *msg_buffer, size_t msg_bytes) {
+  if (fid < 1 || fid > num_msg_forwarders) {
+    throw BadMessageException("send_batches(): Bad process ID");
+  }
+
   // Send the message to the worker
   MPI_Send(msg_buffer, msg_bytes, MPI_CHAR, fid, BATCH, MPI_COMM_WORLD);
 }
 
+node_id_t WorkerCluster::cancel_duplicate_updates(node_id_t *dests, node_id_t num_dests) {
+  std::sort(dests, dests + num_dests);
+  node_id_t remaining = 0;
+  for (node_id_t i = 0; i < num_dests; ) {
+    node_id_t run_end = i + 1;
+    while (run_end < num_dests && dests[run_end] == dests[i]) ++run_end;
+    if ((run_end - i) % 2 == 1) dests[remaining++] = dests[i]; // odd number of updates survive
+    i = run_end;
+  }
+  return remaining;
+}
+
 void WorkerCluster::parse_and_apply_deltas(char *msg_buffer, int msg_size, Supernode *delta,
                                            GraphDistribUpdate *graph) {
-  // parse the message into Supernodes
-  imemstream msg_stream(msg_buffer, msg_size);
-  for (node_id_t d = 0; d < WorkerCluster::num_batches && msg_stream.tellg() < msg_size; d++) {
-    // read node_idx and Supernode from message
-    node_id_t node_idx;
-    msg_stream.read((char *) &node_idx, sizeof(node_id_t));
-    Supernode::makeSupernode(num_nodes, seed, msg_stream, delta);
+  parse_deltas(msg_buffer, msg_size, delta, [graph](node_id_t node_idx, Supernode *delta) {
     graph->get_supernode(node_idx)->apply_delta_update(delta);
-  }
+    graph->mark_dirty(node_idx);
+  });
 }
 
 MessageCode WorkerCluster::recv_message(char *msg_addr, int &msg_size, int &msg_src) {
@@ -185,3 +216,38 @@ void WorkerCluster::return_deltas(int dst_id, char* delta_msg, size_t delta_msg_
 void WorkerCluster::send_upds_processed(uint64_t num_updates) {
   MPI_Send(&num_updates, sizeof(uint64_t), MPI_CHAR, 0, 0, MPI_COMM_WORLD);
 }
+
+void WorkerCluster::send_heartbeat(const WorkerHeartbeat &heartbeat) {
+  MPI_Send(&heartbeat, sizeof(heartbeat), MPI_CHAR, leader_proc, HEARTBEAT, MPI_COMM_WORLD);
+}
+
+bool WorkerCluster::try_recv_heartbeat(WorkerHeartbeat &heartbeat) {
+  int waiting;
+  MPI_Status status;
+  MPI_Iprobe(MPI_ANY_SOURCE, HEARTBEAT, MPI_COMM_WORLD, &waiting, &status);
+  if (!waiting) return false;
+
+  MPI_Recv(&heartbeat, sizeof(heartbeat), MPI_CHAR, status.MPI_SOURCE, HEARTBEAT, MPI_COMM_WORLD,
+           MPI_STATUS_IGNORE);
+  return true;
+}
+
+void WorkerCluster::forwarder_workers(int fid, int &first, int &last) {
+  first = ceil((fid-1) * (double)num_workers / num_msg_forwarders);
+  last = ceil(fid * (double)num_workers / num_msg_forwarders);
+
+  // Edge case for when num_workers < num_msg_forwarders
+  if (num_workers < num_msg_forwarders) {
+    first = fid-1;
+    last = fid-1 < num_workers ? fid : fid-1;
+  }
+}
+
+int WorkerCluster::forwarder_of_worker(int worker_idx) {
+  for (int fid = 1; fid <= num_msg_forwarders; fid++) {
+    int first, last;
+    forwarder_workers(fid, first, last);
+    if (worker_idx >= first && worker_idx < last) return fid;
+  }
+  throw BadMessageException("forwarder_of_worker(): Bad worker index");
+}
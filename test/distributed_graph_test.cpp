@@ -4,6 +4,15 @@
 #include <mat_graph_verifier.h>
 #include <graph_gen.h>
 #include "work_distributor.h"
+#include "metrics_exporter.h"
+#include "distributed_worker.h"
+#include "memory_report.h"
+#include "batch_tracer.h"
+#include "sketch_checkpoint.h"
+#include "msg_buffer_pool.h"
+#include "test_util.h"
+#include <thread>
+#include <unistd.h>
 
 TEST(DistributedGraphTest, SmallRandomGraphs) {
   int num_trials = 5;
@@ -245,3 +254,661 @@ TEST(DistributedGraphTest, TestFewBatches) {
   g.set_verifier(std::make_unique<MatGraphVerifier>(verify));
   ASSERT_EQ(g.get_connected_components().size(), 1022);
 }
+
+TEST(DistributedGraphTest, BatchedPointQueries) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  GraphDistribUpdate g{num_nodes, 1};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+
+  std::vector<std::pair<node_id_t, node_id_t>> pairs;
+  for (node_id_t i = 0; i < 100; i++)
+    pairs.push_back({(i * 7919) % num_nodes, (i * 104729 + 1) % num_nodes});
+  std::vector<bool> connected = g.point_to_point_queries(pairs);
+  ASSERT_EQ(connected.size(), pairs.size());
+
+  std::vector<node_id_t> labels = brute_force_labels(num_nodes, edges);
+  ASSERT_EQ(multiples_graph_ccs, std::set<node_id_t>(labels.begin(), labels.end()).size());
+  for (size_t i = 0; i < pairs.size(); i++)
+    ASSERT_EQ(connected[i], labels[pairs[i].first] == labels[pairs[i].second]);
+
+  // nothing was inserted since, so the DSU answers the same queries without a flush
+  ASSERT_EQ(g.point_to_point_queries(pairs), connected);
+  ASSERT_TRUE(g.dsu_fast_path);
+
+  // node ids outside the graph are rejected rather than read past the end of the DSU
+  pairs.push_back({0, num_nodes});
+  ASSERT_THROW(g.point_to_point_queries(pairs), std::invalid_argument);
+  ASSERT_THROW(g.point_to_point_query(num_nodes, 0), std::invalid_argument);
+}
+
+TEST(DistributedGraphTest, ComponentLabelsAndSizes) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  GraphDistribUpdate g{num_nodes, 1};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+
+  std::vector<node_id_t> labels = g.get_component_labels();
+  ASSERT_EQ(labels.size(), num_nodes);
+  std::set<node_id_t> distinct(labels.begin(), labels.end());
+  ASSERT_EQ(multiples_graph_ccs, distinct.size());
+
+  std::vector<node_id_t> sizes = g.get_component_sizes();
+  ASSERT_EQ(multiples_graph_ccs, sizes.size());
+  node_id_t total = 0;
+  for (node_id_t size : sizes) total += size;
+  ASSERT_EQ(num_nodes, total);
+}
+
+TEST(DistributedGraphTest, ConcurrentQueries) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  GraphDistribUpdate g{num_nodes, 1};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+
+  constexpr int num_threads = 8;
+  std::vector<size_t> num_ccs(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      if (t % 2 == 0)
+        num_ccs[t] = g.get_connected_components(true).size();
+      else
+        num_ccs[t] = g.get_component_sizes().size();
+    });
+  }
+  for (auto &thr : threads) thr.join();
+
+  for (int t = 0; t < num_threads; t++)
+    ASSERT_EQ(multiples_graph_ccs, num_ccs[t]);
+}
+
+TEST(DistributedGraphTest, AsyncQuery) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  GraphDistribUpdate g{num_nodes, 2};
+  insert_edges(g, edges);
+
+  // an edge between two vertices of the same component that are not adjacent. Inserting it
+  // does not change the components so the answer does not depend on when the query runs
+  std::vector<node_id_t> labels = brute_force_labels(num_nodes, edges);
+  std::set<std::pair<node_id_t, node_id_t>> adjacent;
+  for (const Edge &edge : edges) {
+    adjacent.insert({edge.src, edge.dst});
+    adjacent.insert({edge.dst, edge.src});
+  }
+  Edge extra = {0, 0};
+  for (node_id_t a = 0; a < num_nodes && extra.src == extra.dst; a++) {
+    for (node_id_t b = a + 1; b < num_nodes; b++) {
+      if (labels[a] == labels[b] && adjacent.count({a, b}) == 0) {
+        extra = {a, b};
+        break;
+      }
+    }
+  }
+  ASSERT_NE(extra.src, extra.dst);
+
+  // another thread inserts while the query is pending. Every insertion is cancelled by the
+  // next so the graph is unchanged once the thread is done. The inserter polls its own copy
+  // of the shared future, a std::future may not be waited on by two threads at once
+  std::shared_future<std::vector<std::set<node_id_t>>> cc =
+      g.async_connected_components().share();
+  std::atomic<bool> update_failed{false};
+  std::thread inserter([&, cc]() {
+    try {
+      do {
+        g.update({extra, INSERT}, 1);
+        g.update({extra, DELETE}, 1);
+      } while (cc.wait_for(std::chrono::seconds(0)) != std::future_status::ready);
+    } catch (UpdateLockedException &) {
+      update_failed = true;
+    }
+  });
+  ASSERT_EQ(multiples_graph_ccs, cc.get().size());
+  inserter.join();
+  ASSERT_FALSE(update_failed);
+
+  // the query did not lock the graph so we may continue ingesting the stream
+  ASSERT_NO_THROW(g.update({{1, 2}, INSERT}));
+  ASSERT_NO_THROW(g.update({{1, 2}, INSERT}));
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, g.get_connected_components(true).size());
+}
+
+TEST(DistributedGraphTest, CheckpointRestore) {
+  TempFiles files{"./checkpoint_test.ckpt"};
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  edge_id_t total = edges.size();
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    insert_edges(g, edges);
+    g.checkpoint("./checkpoint_test.ckpt", total);
+  }
+
+  GraphDistribUpdate restored{"./checkpoint_test.ckpt", 1};
+  ASSERT_EQ(restored.get_num_nodes(), num_nodes);
+  ASSERT_EQ(restored.get_stream_offset(), total);
+  restored.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, restored.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, CheckpointRestoreResidentWorkers) {
+  TempFiles files{"./resident_restore_test.ckpt"};
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  size_t half = edges.size() / 2;
+  {
+    GraphDistribUpdate g{num_nodes, 1, 1, true};
+    insert_edges(g, edges, 0, half);
+    g.checkpoint("./resident_restore_test.ckpt", half);
+  }
+
+  // the restored graph resumes the stream with resident workers as the original did
+  GraphDistribUpdate restored{"./resident_restore_test.ckpt", 1, true};
+  ASSERT_TRUE(restored.get_resident_workers());
+  insert_edges(restored, edges, restored.get_stream_offset(), edges.size());
+  restored.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, restored.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, IncrementalCheckpointRestore) {
+  TempFiles files{"./incremental_test.ckpt"};
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  edge_id_t total = edges.size();
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    // the first checkpoint is a full one and the later ones append to its log
+    for (int c = 1; c <= 4; c++) {
+      edge_id_t upto = total * c / 4;
+      insert_edges(g, edges, total * (c - 1) / 4, upto);
+      g.incremental_checkpoint("./incremental_test.ckpt", upto);
+
+      // an export would overwrite the checkpoint that the next records are appended to
+      if (c == 2) {
+        ASSERT_THROW(g.export_sketches("./incremental_test.ckpt"), std::invalid_argument);
+      }
+    }
+  }
+
+  GraphDistribUpdate restored{"./incremental_test.ckpt", 1};
+  ASSERT_EQ(restored.get_stream_offset(), total);
+  restored.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, restored.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, MergeExportedSketches) {
+  TempFiles files{"./merge_test_base.ckpt", "./merge_test_site_one.ckpt"};
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  size_t m = edges.size();
+
+  // both sites start from the same empty sketches so that they share a seed
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    g.export_sketches("./merge_test_base.ckpt");
+  }
+  {
+    GraphDistribUpdate site_one{"./merge_test_base.ckpt", 1};
+    insert_edges(site_one, edges, 0, m / 2);
+    site_one.export_sketches("./merge_test_site_one.ckpt");
+  }
+  // an export is not a checkpoint that may be appended to so it has no incremental log
+  ASSERT_FALSE(std::ifstream{"./merge_test_site_one.ckpt.log"}.is_open());
+
+  GraphDistribUpdate site_two{"./merge_test_base.ckpt", 1};
+  insert_edges(site_two, edges, m / 2, m);
+  site_two.merge_sketches("./merge_test_site_one.ckpt");
+  site_two.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, site_two.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, MergeWithCommonBase) {
+  TempFiles files{"./merge_base_test_base.ckpt", "./merge_base_test_site_one.ckpt"};
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  size_t m = edges.size();
+
+  // the base holds the first third of the stream and each site ingests another third
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    insert_edges(g, edges, 0, m / 3);
+    g.checkpoint("./merge_base_test_base.ckpt", m / 3);
+  }
+  {
+    GraphDistribUpdate site_one{"./merge_base_test_base.ckpt", 1};
+    insert_edges(site_one, edges, m / 3, 2 * m / 3);
+    site_one.export_sketches("./merge_base_test_site_one.ckpt");
+  }
+
+  GraphDistribUpdate site_two{"./merge_base_test_base.ckpt", 1};
+  insert_edges(site_two, edges, 2 * m / 3, m);
+  site_two.merge_sketches("./merge_base_test_site_one.ckpt");
+  site_two.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, site_two.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, MergeRejectsDifferentBase) {
+  TempFiles files{"./merge_reject_test_base.ckpt", "./merge_reject_test_site.ckpt"};
+  node_id_t num_nodes = 1024;
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    g.update({{1, 2}, INSERT});
+    g.checkpoint("./merge_reject_test_base.ckpt");
+  }
+  {
+    GraphDistribUpdate site{"./merge_reject_test_base.ckpt", 1};
+    site.update({{2, 3}, INSERT});
+    site.export_sketches("./merge_reject_test_site.ckpt");
+  }
+
+  // a graph restored from the export has the export as its base, not the checkpoint
+  GraphDistribUpdate other{"./merge_reject_test_site.ckpt", 1};
+  ASSERT_THROW(other.merge_sketches("./merge_reject_test_site.ckpt"), std::invalid_argument);
+}
+
+TEST(DistributedGraphTest, PartitionedIngestion) {
+  constexpr int num_parts = 4;
+  TempFiles files{"./partition_test_base.ckpt"};
+  for (int part = 0; part < num_parts; part++)
+    files.add("./partition_test_" + std::to_string(part) + ".ckpt");
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  size_t m = edges.size();
+
+  // the base holds a prefix of the stream and each instance ingests a share of the rest
+  size_t prefix = m / 5;
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    insert_edges(g, edges, 0, prefix);
+    g.checkpoint("./partition_test_base.ckpt", prefix);
+  }
+  for (int part = 0; part < num_parts; part++) {
+    GraphDistribUpdate g{"./partition_test_base.ckpt", 1};
+    insert_edges(g, edges, prefix + (m - prefix) * part / num_parts,
+                 prefix + (m - prefix) * (part + 1) / num_parts);
+    g.export_sketches("./partition_test_" + std::to_string(part) + ".ckpt");
+  }
+
+  GraphDistribUpdate query{"./partition_test_base.ckpt", 1};
+  for (int part = 0; part < num_parts; part++)
+    query.merge_sketches("./partition_test_" + std::to_string(part) + ".ckpt");
+  query.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, query.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, ShardedIngestion) {
+  constexpr int num_shards = 3;
+  TempFiles files{"./shard_test_base.ckpt"};
+  for (int shard = 0; shard < num_shards; shard++)
+    files.add("./shard_test_" + std::to_string(shard) + ".ckpt");
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    g.checkpoint("./shard_test_base.ckpt");
+  }
+
+  // read the serialized supernodes of a checkpoint so that they may be compared byte by byte
+  auto read_sketches = [](const std::string &path) {
+    CheckpointHeader header = SketchCheckpoint::read_header(path);
+    std::vector<std::string> sketches(header.num_nodes, std::string(header.supernode_bytes, 0));
+    SketchCheckpoint::read_supernodes(path, header, [&](node_id_t node, std::istream &in) {
+      in.read(&sketches[node][0], header.supernode_bytes);
+    });
+    return sketches;
+  };
+  std::vector<std::string> base = read_sketches("./shard_test_base.ckpt");
+
+  for (int shard = 0; shard < num_shards; shard++) {
+    GraphDistribUpdate g{"./shard_test_base.ckpt", 1};
+    g.set_shard(shard, num_shards);
+    // the inserter routes each update to the shards that own one of its endpoints
+    for (const Edge &edge : edges) {
+      if (GraphDistribUpdate::shard_of(edge.src, num_nodes, num_shards) == shard ||
+          GraphDistribUpdate::shard_of(edge.dst, num_nodes, num_shards) == shard)
+        g.update({edge, INSERT});
+    }
+    ASSERT_THROW(g.get_connected_components(), std::runtime_error);
+    g.export_sketches("./shard_test_" + std::to_string(shard) + ".ckpt");
+
+    // only the supernodes this shard owns were updated by its leader
+    std::vector<std::string> sketches = read_sketches("./shard_test_" + std::to_string(shard) +
+                                                      ".ckpt");
+    node_id_t updated = 0;
+    for (node_id_t node = 0; node < num_nodes; node++) {
+      ASSERT_EQ(g.owns(node), GraphDistribUpdate::shard_of(node, num_nodes, num_shards) == shard);
+      if (!g.owns(node)) {
+        ASSERT_EQ(sketches[node], base[node]);
+      } else if (sketches[node] != base[node]) {
+        updated++;
+      }
+    }
+    ASSERT_GT(updated, 0);
+  }
+
+  GraphDistribUpdate query{"./shard_test_base.ckpt", 1};
+  for (int shard = 0; shard < num_shards; shard++)
+    query.merge_sketches("./shard_test_" + std::to_string(shard) + ".ckpt");
+  query.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, query.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, ResidentWorkersQueryDuringStream) {
+  generate_stream({1024, 0.002, 0.5, 0, "./sample.txt", "./cumul_sample.txt"});
+  std::ifstream in{"./sample.txt"};
+  ASSERT_TRUE(in.is_open());
+  node_id_t n;
+  edge_id_t m;
+  in >> n >> m;
+  GraphDistribUpdate g(n, 1, 1, true);
+  MatGraphVerifier verify(n);
+
+  // each query must see the deltas held by the workers
+  int type;
+  node_id_t a, b;
+  edge_id_t quarter = m / 4;
+  for(int j = 0; j < 3; j++) {
+    for (edge_id_t i = 0; i < quarter; i++) {
+      in >> type >> a >> b;
+      g.update({{a,b}, (UpdateType)type});
+      verify.edge_update(a, b);
+    }
+    verify.reset_cc_state();
+    g.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+    g.get_connected_components(true);
+  }
+  m -= 3 * quarter;
+  while(m--) {
+    in >> type >> a >> b;
+    g.update({{a,b}, (UpdateType)type});
+    verify.edge_update(a, b);
+  }
+  verify.reset_cc_state();
+  g.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+  g.get_connected_components();
+}
+
+TEST(DistributedGraphTest, NumaPlacement) {
+  if (NumaPlacement::num_numa_nodes() == 1)
+    GTEST_SKIP() << "placement cannot be observed on a single NUMA node";
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  GraphDistribUpdate g{num_nodes, 1};
+
+  // every supernode has pages of its own on the NUMA node the policy assigns it
+  uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  auto check_placement = [&](NumaPolicy policy) {
+    for (node_id_t i = 0; i < num_nodes; i++) {
+      ASSERT_EQ((uintptr_t) g.get_supernode(i) % page_size, 0);
+      ASSERT_EQ(NumaPlacement::numa_node_of_address(g.get_supernode(i)),
+                NumaPlacement::numa_node_of(i, num_nodes, policy));
+    }
+  };
+
+  // change the placement in the middle of the stream
+  insert_edges(g, edges, 0, edges.size() / 2);
+  g.set_numa_policy(NUMA_PARTITION);
+  check_placement(NUMA_PARTITION);
+  insert_edges(g, edges, edges.size() / 2, edges.size());
+  g.set_numa_policy(NUMA_INTERLEAVE);
+  check_placement(NUMA_INTERLEAVE);
+  // the copies hold the same sketches
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, g.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, MsgBufferPoolPutAfterFreeAll) {
+  // a WorkDistributor stopped after teardown returns buffers the pool has already released
+  char *send_buf = MsgBufferPool::get(MsgBufferPool::huge_page_size);
+  char *recv_buf = MsgBufferPool::get(MsgBufferPool::min_buffer_size);
+  MsgBufferPool::free_all();
+  ASSERT_EQ(MsgBufferPool::bytes_mapped(), 0);
+  ASSERT_NO_THROW(MsgBufferPool::put(send_buf));
+  ASSERT_NO_THROW(MsgBufferPool::put(recv_buf));
+
+  // the released buffers are not handed out again and the pool maps new memory when used
+  ASSERT_EQ(MsgBufferPool::bytes_mapped(), 0);
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  GraphDistribUpdate g{num_nodes, 1};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  ASSERT_EQ(multiples_graph_ccs, g.get_connected_components().size());
+  ASSERT_GT(MsgBufferPool::bytes_mapped(), 0);
+}
+
+TEST(DistributedGraphTest, CancelDuplicateUpdates) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+  // every edge is toggled three times so only the final insertion remains
+  auto toggle_edges = [&](GraphDistribUpdate &g) {
+    for (const Edge &edge : edges) {
+      g.update({edge, INSERT});
+      g.update({edge, DELETE});
+      g.update({edge, INSERT});
+    }
+    g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+    g.get_connected_components();
+  };
+  {
+    GraphDistribUpdate g{num_nodes, 1};
+    g.set_cancel_duplicate_updates(true);
+    toggle_edges(g);
+    ASSERT_GT(g.get_cancelled_updates(), 0);
+  }
+
+  // the setting does not carry over to the next graph
+  GraphDistribUpdate g{num_nodes, 1};
+  toggle_edges(g);
+  ASSERT_EQ(g.get_cancelled_updates(), 0);
+}
+
+TEST(DistributedGraphTest, CoalesceDeadlineWhenStreamStops) {
+  node_id_t num_nodes = 1024;
+  GraphDistribUpdate g{num_nodes, 1};
+
+  // node 0 receives enough updates to fill its gutter many times, so its batches are sent to
+  // the workers while the stream runs. Every edge is toggled an even number of times
+  for (int rep = 0; rep < 256; rep++) {
+    for (node_id_t i = 1; i < num_nodes; i++)
+      g.update({{0, i}, INSERT});
+  }
+
+  // the stream stops. The last batch message must not wait for another DataNode or a query
+  std::this_thread::sleep_for(500 * WorkDistributor::coalesce_deadline);
+  ASSERT_GT(g.get_metrics().stages[SEND_TIME].count, 0);
+  ASSERT_EQ(WorkDistributor::unsent_batches(), 0);
+
+  ASSERT_EQ(num_nodes, g.get_connected_components().size());
+}
+
+TEST(DistributedGraphTest, IngestionMetrics) {
+  generate_stream({1024, 0.002, 0.5, 0, "./sample.txt", "./cumul_sample.txt"});
+  std::ifstream in{"./sample.txt"};
+  ASSERT_TRUE(in.is_open());
+  node_id_t n;
+  edge_id_t m;
+  in >> n >> m;
+  GraphDistribUpdate g(n, 1);
+  int type;
+  node_id_t a, b;
+  while (m--) {
+    in >> type >> a >> b;
+    g.update({{a,b}, (UpdateType)type});
+  }
+  g.set_verifier(std::make_unique<FileGraphVerifier>(n, "./cumul_sample.txt"));
+  g.get_connected_components(true);
+
+  MetricsSnapshot metrics = g.get_metrics();
+  ASSERT_GT(metrics.stages[FLUSH_TIME].count, 0);
+  ASSERT_GT(metrics.stages[SEND_TIME].count + metrics.stages[LOCAL_TIME].count, 0);
+
+  // every message sent is counted by its forwarder and every delta message was applied
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  for (auto &fwd : metrics.forwarders) {
+    sent += fwd.messages_sent;
+    received += fwd.messages_received;
+  }
+  ASSERT_EQ(sent, metrics.stages[SEND_TIME].count);
+  ASSERT_EQ(received, metrics.stages[DELTA_APPLY_TIME].count);
+
+  // the workers are not resident so every delta message answers a batch message, and the
+  // message size leaves room for the trailer that identifies its worker
+  uint64_t worker_round_trips = 0;
+  for (auto &round_trip : metrics.worker_round_trips)
+    worker_round_trips += round_trip.count;
+  ASSERT_EQ(metrics.stages[ROUND_TRIP_TIME].count, received);
+  ASSERT_EQ(worker_round_trips, received);
+  ASSERT_LE(metrics.stages[FLUSH_TIME].percentile(50), metrics.stages[FLUSH_TIME].max);
+
+  // every worker reported its statistics when flushed for the query
+  ASSERT_GT(metrics.workers.size(), 0);
+  std::string text = MetricsExporter::render();
+  ASSERT_NE(text.find("landscape_stage_seconds_count{stage=\"flush\"}"), std::string::npos);
+  ASSERT_NE(text.find("landscape_worker_updates{worker="), std::string::npos);
+}
+
+TEST(DistributedGraphTest, WorkerHeartbeats) {
+  generate_stream({1024, 0.002, 0.5, 0, "./sample.txt", "./cumul_sample.txt"});
+  std::ifstream in{"./sample.txt"};
+  ASSERT_TRUE(in.is_open());
+  node_id_t n;
+  edge_id_t m;
+  in >> n >> m;
+  GraphDistribUpdate g(n, 1);
+  int type;
+  node_id_t a, b;
+  while (m--) {
+    in >> type >> a >> b;
+    g.update({{a,b}, (UpdateType)type});
+  }
+  g.set_verifier(std::make_unique<FileGraphVerifier>(n, "./cumul_sample.txt"));
+  g.get_connected_components(true);
+  std::this_thread::sleep_for(3 * DistributedWorker::heartbeat_interval);
+
+  // every worker is alive and reported its health recently
+  std::vector<WorkerHealth> health = g.get_worker_health();
+  ASSERT_EQ(health.size(), g.get_metrics().workers.size());
+  ASSERT_GT(health.size(), 0);
+  for (auto &worker : health) {
+    ASSERT_FALSE(worker.stopped);
+    ASSERT_LT(worker.heartbeat_age, 1.0);
+    ASSERT_GE(worker.utilization, 0);
+    ASSERT_LE(worker.utilization, 1);
+  }
+  std::string text = MetricsExporter::render();
+  ASSERT_NE(text.find("landscape_worker_utilization{worker="), std::string::npos);
+}
+
+TEST(DistributedGraphTest, MemoryReport) {
+  node_id_t num_nodes = 1024;
+  int num_processes;
+  MPI_Comm_size(MPI_COMM_WORLD, &num_processes);
+  int num_workers = num_processes - WorkerCluster::distrib_worker_offset;
+  MemoryReport plan = GraphDistribUpdate::plan_memory(num_nodes, 2, num_workers);
+  ASSERT_EQ(plan.workers.size(), (size_t) num_workers);
+  ASSERT_GT(plan.workers_total(), 0);
+  ASSERT_EQ(plan.main_resident, 0);
+  MemoryReport other = GraphDistribUpdate::plan_memory(2 * num_nodes, 3, num_workers);
+  ASSERT_GT(other.supernodes, plan.supernodes);
+
+  GraphDistribUpdate g(num_nodes, 1, 2);
+  for (node_id_t i = 1; i < num_nodes; i++)
+    g.update({{i - 1, i}, INSERT});
+  g.k_spanning_forests(2);
+  std::this_thread::sleep_for(3 * DistributedWorker::heartbeat_interval);
+
+  // the sketches are exactly as planned and every worker reported its memory
+  MemoryReport report = g.memory_report();
+  ASSERT_EQ(report.supernodes, plan.supernodes);
+  ASSERT_EQ(report.bookkeeping, plan.bookkeeping);
+  ASSERT_EQ(report.workers.size(), plan.workers.size());
+  for (auto &worker : report.workers)
+    ASSERT_GT(worker.buffer_bytes, 0);
+  ASSERT_GE(report.main_resident, report.supernodes);
+  ASSERT_EQ(report.total(), report.main_total() + report.workers_total());
+
+  // while this graph is alive a graph planned before may be planned again, without touching
+  // the configuration of this one. A graph never planned cannot be
+  size_t supernode_size = Supernode::get_size();
+  ASSERT_EQ(GraphDistribUpdate::plan_memory(2 * num_nodes, 3, num_workers).supernodes,
+            other.supernodes);
+  ASSERT_EQ(GraphDistribUpdate::plan_memory(num_nodes, 2, num_workers).total(), plan.total());
+  ASSERT_THROW(GraphDistribUpdate::plan_memory(4 * num_nodes + 1, 3, num_workers),
+               std::invalid_argument);
+  ASSERT_EQ(Supernode::get_size(), supernode_size);
+  ASSERT_EQ(g.memory_report().supernodes, plan.supernodes);
+  g.update({{0, num_nodes - 1}, INSERT});
+  ASSERT_EQ(g.get_connected_components(true).size(), (size_t) 1);
+
+  std::string text = MetricsExporter::render(&g);
+  ASSERT_NE(text.find("landscape_memory_bytes{component=\"supernodes\"}"), std::string::npos);
+}
+
+TEST(DistributedGraphTest, TraceTrailer) {
+  std::vector<char> msg(64 + BatchTracer::trailer_bytes, 1);
+  BatchTracer::Trailer found;
+  ASSERT_FALSE(BatchTracer::find_trailer(msg.data(), 64, found));
+
+  BatchTracer::Trailer trailer;
+  trailer.trace_id = 7;
+  trailer.sent_ns = 123456789;
+  trailer.worker_id = 21;
+  BatchTracer::write_trailer(msg.data() + 64, trailer);
+  ASSERT_TRUE(BatchTracer::find_trailer(msg.data(), msg.size(), found));
+  ASSERT_EQ(found.trace_id, trailer.trace_id);
+  ASSERT_EQ(found.sent_ns, trailer.sent_ns);
+  ASSERT_EQ(found.worker_id, trailer.worker_id);
+  ASSERT_EQ(msg[63], 1); // the message itself is untouched
+
+  // too short to hold a trailer
+  ASSERT_FALSE(BatchTracer::find_trailer(msg.data() + 65, BatchTracer::trailer_bytes - 1, found));
+}
+
+TEST(DistributedGraphTest, ReadTraceFile) {
+  const std::string trace_file = "./trace_test.txt";
+  TempFiles temp_files{trace_file};
+  {
+    std::ofstream out(trace_file);
+    out << "rank 12 offset_ns 1000\n";
+    out << "5 forward_batch 100 250 42\n";
+    out << "9 forward_delta 300 320 43\n";
+  }
+
+  int rank = 0;
+  std::vector<BatchTracer::TraceEvent> events;
+  ASSERT_TRUE(BatchTracer::read(trace_file, rank, events));
+  ASSERT_EQ(rank, 12);
+  ASSERT_EQ(events.size(), (size_t) 2);
+
+  // the events are adjusted to the clock of main
+  ASSERT_EQ(events[0].trace_id, (uint64_t) 5);
+  ASSERT_EQ(events[0].stage, TRACE_FWD_BATCH);
+  ASSERT_EQ(events[0].begin_ns, 1100);
+  ASSERT_EQ(events[0].end_ns, 1250);
+  ASSERT_EQ(events[0].thread, (uint64_t) 42);
+  ASSERT_EQ(events[1].stage, TRACE_FWD_DELTA);
+  ASSERT_EQ(events[1].begin_ns, 1300);
+
+  ASSERT_FALSE(BatchTracer::read("./no_such_trace.txt", rank, events));
+}
@@ -2,6 +2,7 @@
 #include "graph_distrib_update.h"
 #include <file_graph_verifier.h>
 #include <mat_graph_verifier.h>
+#include "test_util.h"
 
 TEST(KConnectivityTest, SimpleTest) {
   const std::string file = "./_deps/graphzeppelin-src/test/res/multiples_graph_1024.txt";
@@ -28,3 +29,63 @@ TEST(KConnectivityTest, SimpleTest) {
   }
   std::cout << "number of spanning forest edges: " << edges << std::endl;
 }
+
+TEST(KConnectivityTest, CompactForests) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+
+  GraphDistribUpdate g{num_nodes, 1, 4};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  SpanningForests forests = g.k_spanning_forests_compact(4);
+
+  ASSERT_EQ(forests.num_forests(), 4);
+  ASSERT_EQ(forests.forest_offsets.back(), forests.edges.size());
+  // the first forest is a spanning forest of a graph with 78 connected components
+  ASSERT_EQ(forests.forest_offsets[1] - forests.forest_offsets[0], num_nodes - multiples_graph_ccs);
+  for (size_t t = 0; t < forests.num_forests(); t++) {
+    for (size_t e = forests.forest_offsets[t] + 1; e < forests.forest_offsets[t + 1]; e++) {
+      const Edge &prev = forests.edges[e - 1];
+      const Edge &cur = forests.edges[e];
+      ASSERT_TRUE(prev.src < cur.src || (prev.src == cur.src && prev.dst < cur.dst));
+    }
+  }
+}
+
+TEST(KConnectivityTest, AsyncForests) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+
+  GraphDistribUpdate g{num_nodes, 1, 2};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+  std::future<std::vector<std::set<node_id_t>>> forests = g.async_k_spanning_forests(2);
+  std::vector<std::set<node_id_t>> adj = forests.get();
+
+  ASSERT_EQ(adj.size(), num_nodes);
+  size_t forest_edges = 0;
+  for (node_id_t src = 0; src < num_nodes; src++) {
+    forest_edges += adj[src].size();
+  }
+  ASSERT_GE(forest_edges, num_nodes - multiples_graph_ccs);
+}
+
+TEST(KConnectivityTest, RepeatedForests) {
+  std::vector<Edge> edges;
+  node_id_t num_nodes = read_graph_edges(multiples_graph_file, edges);
+  ASSERT_GT(num_nodes, 0);
+
+  GraphDistribUpdate g{num_nodes, 1, 4};
+  insert_edges(g, edges);
+  g.set_verifier(std::make_unique<FileGraphVerifier>(num_nodes, multiples_graph_file));
+
+  // the query restores the sketches, so asking again returns forests of the same graph
+  for (int rep = 0; rep < 2; rep++) {
+    SpanningForests forests = g.k_spanning_forests_compact(4);
+    ASSERT_EQ(forests.num_forests(), 4);
+    ASSERT_EQ(forests.forest_offsets[1] - forests.forest_offsets[0], num_nodes - multiples_graph_ccs);
+  }
+  ASSERT_EQ(g.get_connected_components(true).size(), multiples_graph_ccs);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <types.h>
+
+#include <cstdio>
+#include <fstream>
+#include <initializer_list>
+#include <numeric>
+#include <string>
+#include <vector>
+
+// a GraphZeppelin test graph in which node i is connected to its multiples
+const std::string multiples_graph_file = "./_deps/graphzeppelin-src/test/res/multiples_graph_1024.txt";
+constexpr size_t multiples_graph_ccs = 78;
+
+/*
+ * Read a graph file holding "num_nodes num_edges" followed by one "src dst" line per edge
+ * @param file   the graph file
+ * @param edges  the vector the edges are appended to
+ * @return       the number of nodes of the graph, or 0 if the file could not be read
+ */
+inline node_id_t read_graph_edges(const std::string &file, std::vector<Edge> &edges) {
+  std::ifstream in{file};
+  if (!in.is_open()) return 0;
+  node_id_t num_nodes;
+  edge_id_t m;
+  in >> num_nodes >> m;
+  edges.reserve(edges.size() + m);
+  node_id_t a, b;
+  while (m-- && in >> a >> b)
+    edges.push_back({a, b});
+  return num_nodes;
+}
+
+// insert the edges with index in [first, last) into g
+template <class Graph_t>
+void insert_edges(Graph_t &g, const std::vector<Edge> &edges, size_t first, size_t last) {
+  for (size_t e = first; e < last; e++)
+    g.update({edges[e], INSERT});
+}
+
+template <class Graph_t>
+void insert_edges(Graph_t &g, const std::vector<Edge> &edges) {
+  insert_edges(g, edges, 0, edges.size());
+}
+
+/*
+ * Label each node with the smallest node of its connected component, computed with a simple
+ * union-find over the edges. Used as the expected answer of connectivity queries
+ */
+inline std::vector<node_id_t> brute_force_labels(node_id_t num_nodes, const std::vector<Edge> &edges) {
+  std::vector<node_id_t> parent(num_nodes);
+  std::iota(parent.begin(), parent.end(), 0);
+  auto find = [&](node_id_t node) {
+    while (parent[node] != node) node = parent[node] = parent[parent[node]];
+    return node;
+  };
+  for (const Edge &edge : edges) {
+    node_id_t a = find(edge.src);
+    node_id_t b = find(edge.dst);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+  }
+  std::vector<node_id_t> labels(num_nodes);
+  for (node_id_t node = 0; node < num_nodes; node++)
+    labels[node] = find(node);
+  return labels;
+}
+
+/*
+ * Removes the files a test writes when the test ends, pass or fail. The incremental log
+ * of a checkpoint is removed along with the checkpoint
+ */
+class TempFiles {
+ private:
+  std::vector<std::string> paths;
+ public:
+  TempFiles(std::initializer_list<std::string> files) : paths(files) {}
+  ~TempFiles() {
+    for (auto &path : paths) {
+      std::remove(path.c_str());
+      std::remove((path + ".log").c_str());
+      std::remove((path + ".tmp").c_str());
+    }
+  }
+  void add(const std::string &path) { paths.push_back(path); }
+};
@@ -0,0 +1,240 @@
+#include "benchmark/benchmark.h"
+
+#include <graph.h>
+#include <supernode.h>
+
+#include "memstream.h"
+#include "msg_buffer_queue.h"
+#include "worker_cluster.h"
+
+#include <random>
+#include <vector>
+
+/*
+ * Microbenchmarks of the hot paths of Landscape: the messages exchanged between main and the
+ * DistributedWorkers, the generation of deltas, and the structures moving them between
+ * threads. None of these use MPI so they are run as a plain executable.
+ *
+ * Benchmarks that depend upon the graph take num_nodes, k and batch_size as arguments.
+ */
+
+constexpr uint64_t seed = 437650290;
+
+// the list of {num_nodes, k, batch_size} arguments
+static void GraphArgs(benchmark::internal::Benchmark *b) {
+  b->ArgNames({"num_nodes", "k", "batch_size"});
+  b->ArgsProduct({{1 << 10, 1 << 17, 1 << 20}, {1, 4}, {64, 1024}});
+}
+
+// Access to the private functions and configuration of WorkerCluster
+class WorkerClusterBench {
+ public:
+  static void configure(node_id_t num_nodes, node_id_t k) {
+    Supernode::configure(num_nodes, Supernode::default_num_columns, k);
+    WorkerCluster::num_nodes = num_nodes;
+    WorkerCluster::seed = seed;
+  }
+
+  static void parse_batches(char *msg, int msg_size, std::vector<batch_t> &batches) {
+    WorkerCluster::parse_batches(msg, msg_size, batches);
+  }
+
+  static void serialize_delta(node_id_t node_idx, Supernode &delta, std::ostream &out) {
+    WorkerCluster::serialize_delta(node_idx, delta, out);
+  }
+
+  template <class Apply>
+  static void parse_deltas(char *msg, int msg_size, Supernode *delta, Apply apply) {
+    WorkerCluster::parse_deltas(msg, msg_size, delta, apply);
+  }
+};
+
+// the batches of one batch message. Batch i updates node i with random destinations
+static std::vector<update_batch> make_batches(node_id_t num_nodes, size_t batch_size) {
+  std::mt19937_64 gen(seed);
+  std::vector<update_batch> batches(WorkerCluster::num_batches);
+  for (size_t i = 0; i < batches.size(); i++) {
+    batches[i].node_idx = i;
+    for (size_t u = 0; u < batch_size; u++)
+      batches[i].upd_vec.push_back(gen() % num_nodes);
+  }
+  return batches;
+}
+
+// the deltas of the batches of one batch message
+static std::vector<Supernode *> make_deltas(node_id_t num_nodes,
+                                            const std::vector<update_batch> &batches) {
+  std::vector<Supernode *> deltas;
+  for (auto &batch : batches) {
+    Supernode *delta = (Supernode *) malloc(Supernode::get_size());
+    Graph::generate_delta_node(num_nodes, seed, batch.node_idx, batch.upd_vec, delta);
+    deltas.push_back(delta);
+  }
+  return deltas;
+}
+
+static size_t delta_msg_size() {
+  return WorkerCluster::num_batches * (sizeof(node_id_t) + Supernode::get_serialized_size());
+}
+
+// Serialize the batches of a message as main does before sending it to a worker
+static void BM_SerializeBatches(benchmark::State &state) {
+  WorkerClusterBench::configure(state.range(0), state.range(1));
+  auto batches = make_batches(state.range(0), state.range(2));
+  std::vector<char> msg(WorkerCluster::batch_msg_size(state.range(2)));
+
+  size_t msg_bytes = 0;
+  for (auto _ : state) {
+    msg_bytes = 0;
+    size_t cancelled = 0;
+    WorkerCluster::serialize_batches(batches, msg.data(), msg_bytes, cancelled);
+    benchmark::DoNotOptimize(msg.data());
+  }
+  state.SetBytesProcessed(state.iterations() * msg_bytes);
+  state.counters["Messages"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_SerializeBatches)->Apply(GraphArgs);
+
+// Parse a batch message as a worker does when it is recieved
+static void BM_ParseBatches(benchmark::State &state) {
+  WorkerClusterBench::configure(state.range(0), state.range(1));
+  auto batches = make_batches(state.range(0), state.range(2));
+  std::vector<char> msg(WorkerCluster::batch_msg_size(state.range(2)));
+  size_t msg_bytes = 0;
+  size_t cancelled = 0;
+  WorkerCluster::serialize_batches(batches, msg.data(), msg_bytes, cancelled);
+
+  std::vector<batch_t> parsed;
+  for (auto _ : state) {
+    parsed.clear();
+    WorkerClusterBench::parse_batches(msg.data(), msg_bytes, parsed);
+    benchmark::DoNotOptimize(parsed.data());
+  }
+  state.SetBytesProcessed(state.iterations() * msg_bytes);
+  state.counters["Messages"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_ParseBatches)->Apply(GraphArgs);
+
+// Generate the deltas of every batch of a message
+static void BM_GenerateDeltas(benchmark::State &state) {
+  WorkerClusterBench::configure(state.range(0), state.range(1));
+  auto batches = make_batches(state.range(0), state.range(2));
+  Supernode *delta = (Supernode *) malloc(Supernode::get_size());
+
+  for (auto _ : state) {
+    for (auto &batch : batches)
+      Graph::generate_delta_node(state.range(0), seed, batch.node_idx, batch.upd_vec, delta);
+    benchmark::DoNotOptimize(delta);
+  }
+  state.counters["Messages"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  state.counters["Updates"] = benchmark::Counter(
+      state.iterations() * batches.size() * state.range(2), benchmark::Counter::kIsRate);
+  free(delta);
+}
+BENCHMARK(BM_GenerateDeltas)->Apply(GraphArgs);
+
+// Serialize the deltas of a message as a worker does before returning them to main
+static void BM_SerializeDeltas(benchmark::State &state) {
+  WorkerClusterBench::configure(state.range(0), state.range(1));
+  auto deltas = make_deltas(state.range(0), make_batches(state.range(0), state.range(2)));
+  std::vector<char> msg(delta_msg_size());
+  omemstream stream(msg.data(), msg.size());
+
+  size_t msg_bytes = 0;
+  for (auto _ : state) {
+    stream.reset();
+    for (size_t i = 0; i < deltas.size(); i++)
+      WorkerClusterBench::serialize_delta(i, *deltas[i], stream);
+    msg_bytes = stream.tellp();
+    benchmark::DoNotOptimize(msg.data());
+  }
+  state.SetBytesProcessed(state.iterations() * msg_bytes);
+  state.counters["Messages"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  for (auto delta : deltas) free(delta);
+}
+BENCHMARK(BM_SerializeDeltas)->Apply(GraphArgs);
+
+// Parse the deltas of a message and apply them to the supernodes as main does
+static void BM_ParseAndApplyDeltas(benchmark::State &state) {
+  WorkerClusterBench::configure(state.range(0), state.range(1));
+  auto deltas = make_deltas(state.range(0), make_batches(state.range(0), state.range(2)));
+  std::vector<char> msg(delta_msg_size());
+  omemstream stream(msg.data(), msg.size());
+  for (size_t i = 0; i < deltas.size(); i++)
+    WorkerClusterBench::serialize_delta(i, *deltas[i], stream);
+  int msg_bytes = stream.tellp();
+
+  // the supernodes updated by the message
+  std::vector<Supernode *> supernodes;
+  for (size_t i = 0; i < deltas.size(); i++)
+    supernodes.push_back(Supernode::makeSupernode(state.range(0), seed));
+  Supernode *delta = (Supernode *) malloc(Supernode::get_size());
+
+  for (auto _ : state) {
+    WorkerClusterBench::parse_deltas(msg.data(), msg_bytes, delta,
+                                     [&supernodes](node_id_t node_idx, Supernode *delta) {
+      supernodes[node_idx]->apply_delta_update(delta);
+    });
+  }
+  state.SetBytesProcessed(state.iterations() * msg_bytes);
+  state.counters["Messages"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+  for (auto supernode : supernodes) free(supernode);
+  for (auto d : deltas) free(d);
+  free(delta);
+}
+BENCHMARK(BM_ParseAndApplyDeltas)->Apply(GraphArgs);
+
+// Pass messages between threads with a MsgBufferQueue as a worker does with its send queue
+static void BM_MsgBufferQueue(benchmark::State &state) {
+  // twice as many elements as threads so that a pop rarely waits
+  static MsgBufferQueue<int> *queue;
+  if (state.thread_index() == 0) {
+    std::list<int> elms(2 * state.threads());
+    queue = new MsgBufferQueue<int>(elms);
+  }
+
+  for (auto _ : state) {
+    MsgBufferQueue<int>::QueueElm *elm = queue->pop();
+    benchmark::DoNotOptimize(elm->data);
+    queue->push(elm);
+  }
+  state.counters["Ops"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+
+  if (state.thread_index() == 0) delete queue;
+}
+BENCHMARK(BM_MsgBufferQueue)->ThreadRange(1, 16)->UseRealTime();
+
+// Write chunks of range(0) bytes to an omemstream
+static void BM_OMemStream(benchmark::State &state) {
+  std::vector<char> buf(1 << 20);
+  std::vector<char> chunk(state.range(0), 'a');
+  omemstream stream(buf.data(), buf.size());
+  size_t chunks_per_buf = buf.size() / chunk.size();
+
+  for (auto _ : state) {
+    stream.reset();
+    for (size_t i = 0; i < chunks_per_buf; i++)
+      stream.write(chunk.data(), chunk.size());
+    benchmark::DoNotOptimize(buf.data());
+  }
+  state.SetBytesProcessed(state.iterations() * chunks_per_buf * chunk.size());
+}
+BENCHMARK(BM_OMemStream)->RangeMultiplier(4)->Range(4, 1 << 16);
+
+// Read chunks of range(0) bytes from an imemstream
+static void BM_IMemStream(benchmark::State &state) {
+  std::vector<char> buf(1 << 20, 'a');
+  std::vector<char> chunk(state.range(0));
+  size_t chunks_per_buf = buf.size() / chunk.size();
+
+  for (auto _ : state) {
+    imemstream stream(buf.data(), buf.size());
+    for (size_t i = 0; i < chunks_per_buf; i++)
+      stream.read(chunk.data(), chunk.size());
+    benchmark::DoNotOptimize(chunk.data());
+  }
+  state.SetBytesProcessed(state.iterations() * chunks_per_buf * chunk.size());
+}
+BENCHMARK(BM_IMemStream)->RangeMultiplier(4)->Range(4, 1 << 16);
+
+BENCHMARK_MAIN();
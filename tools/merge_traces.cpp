@@ -0,0 +1,109 @@
+#include "batch_tracer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * Combines the trace files written by BatchTracer into a single Chrome trace (JSON) that may
+ * be opened with chrome://tracing or Perfetto. Each process is shown as its own row and the
+ * stages of a traced batch message are connected by flow arrows.
+ */
+
+struct Event {
+  uint64_t trace_id;
+  std::string stage;
+  int64_t begin_ns; // on the clock of main
+  int64_t end_ns;
+  int rank;
+  uint64_t thread;
+};
+
+// read the events of one trace file, adjusted to the clock of main
+static bool read_trace(const std::string &path, std::vector<Event> &events) {
+  int rank;
+  std::vector<BatchTracer::TraceEvent> trace;
+  if (!BatchTracer::read(path, rank, trace)) return false;
+  for (auto &event : trace) {
+    events.push_back({event.trace_id, BatchTracer::stage_name(event.stage), event.begin_ns,
+                      event.end_ns, rank, event.thread});
+  }
+  return true;
+}
+
+static std::string process_name(int rank) {
+  return rank == 0 ? "main" : "rank " + std::to_string(rank);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cout << "Incorrect number of arguments. "
+                 "Expected at least two but got " << argc-1 << std::endl;
+    std::cout << "Arguments are: output_file, trace_files..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string output = argv[1];
+
+  std::vector<Event> events;
+  std::map<int, bool> ranks;
+  for (int i = 2; i < argc; i++) {
+    size_t before = events.size();
+    if (!read_trace(argv[i], events)) {
+      std::cerr << "Could not read trace file " << argv[i] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (events.size() > before) ranks[events.back().rank] = true;
+  }
+  if (events.empty()) {
+    std::cerr << "The trace files contain no events" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // timestamps are relative to the first event, in microseconds
+  std::sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+    return a.trace_id < b.trace_id || (a.trace_id == b.trace_id && a.begin_ns < b.begin_ns);
+  });
+  int64_t first_ns = events[0].begin_ns;
+  for (auto &event : events) first_ns = std::min(first_ns, event.begin_ns);
+  auto micros = [first_ns](int64_t ns) { return (ns - first_ns) / 1000.0; };
+
+  std::ofstream out(output);
+  out << "{\"traceEvents\":[\n";
+  bool first = true;
+  auto sep = [&]() -> std::ostream & {
+    if (!first) out << ",\n";
+    first = false;
+    return out;
+  };
+
+  for (auto &rank : ranks) {
+    sep() << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << rank.first
+          << ",\"args\":{\"name\":\"" << process_name(rank.first) << "\"}}";
+  }
+
+  for (size_t i = 0; i < events.size(); i++) {
+    const Event &event = events[i];
+    sep() << "{\"name\":\"" << event.stage << "\",\"cat\":\"batch\",\"ph\":\"X\",\"ts\":"
+          << micros(event.begin_ns) << ",\"dur\":" << (event.end_ns - event.begin_ns) / 1000.0
+          << ",\"pid\":" << event.rank << ",\"tid\":" << event.thread
+          << ",\"args\":{\"trace_id\":" << event.trace_id << "}}";
+
+    // connect the stages of a message in the order they began
+    bool first_stage = i == 0 || events[i - 1].trace_id != event.trace_id;
+    bool last_stage = i + 1 == events.size() || events[i + 1].trace_id != event.trace_id;
+    if (first_stage && last_stage) continue;
+    const char *phase = first_stage ? "s" : (last_stage ? "f" : "t");
+    sep() << "{\"name\":\"batch\",\"cat\":\"batch\",\"ph\":\"" << phase << "\",\"id\":"
+          << event.trace_id << ",\"ts\":" << micros(event.begin_ns) << ",\"pid\":" << event.rank
+          << ",\"tid\":" << event.thread << (last_stage ? ",\"bp\":\"e\"" : "") << "}";
+  }
+  out << "\n]}\n";
+
+  std::cout << "Wrote " << events.size() << " events of " << ranks.size() << " processes to "
+            << output << std::endl;
+}
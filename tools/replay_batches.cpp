@@ -0,0 +1,91 @@
+#include "batch_capture.h"
+#include "worker_cluster.h"
+#include "memstream.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Replays the BATCH messages captured by BatchCapture on a single machine. Each thread does
+ * the work of a DistributedWorker on its share of the messages: parse the batches, generate
+ * a delta for each, and serialize the deltas. The throughput per thread is the throughput to
+ * expect of each core of a DistributedWorker, without any communication.
+ */
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    std::cout << "Incorrect number of arguments. "
+                 "Expected at least three but got " << argc-1 << std::endl;
+    std::cout << "Arguments are: threads, passes, capture_files..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  int num_threads = std::atoi(argv[1]);
+  int passes = std::atoi(argv[2]);
+  if (num_threads < 1 || passes < 1) {
+    std::cout << "threads and passes must be positive" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  CaptureParams params;
+  std::vector<std::vector<char>> messages;
+  for (int i = 3; i < argc; i++) {
+    CaptureParams file_params;
+    if (!BatchCapture::read(argv[i], file_params, messages)) {
+      std::cout << "ERROR: Could not read capture file " << argv[i] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (i == 3) {
+      params = file_params;
+    } else if (file_params.num_nodes != params.num_nodes || file_params.seed != params.seed ||
+               file_params.sketches_factor != params.sketches_factor ||
+               file_params.max_msg_size != params.max_msg_size) {
+      std::cout << "ERROR: Capture file " << argv[i] << " is of a different graph" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (messages.empty()) {
+    std::cout << "ERROR: No messages were captured" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::cout << "Replaying " << messages.size() << " messages of a graph with "
+            << params.num_nodes << " vertices" << std::endl;
+
+  BatchCapture::configure(params);
+  size_t delta_buffer_size = WorkerCluster::num_batches
+                             * (sizeof(node_id_t) + Supernode::get_serialized_size());
+
+  std::vector<size_t> thread_updates(num_threads);
+  auto replay_task = [&](int thr_id) {
+    Supernode *delta = (Supernode *) malloc(Supernode::get_size());
+    char *delta_buffer = (char *) malloc(delta_buffer_size);
+    size_t num_updates = 0;
+    for (int p = 0; p < passes; p++) {
+      for (size_t m = thr_id; m < messages.size(); m += num_threads) {
+        omemstream serial_str(delta_buffer, delta_buffer_size);
+        num_updates += BatchCapture::process_message(messages[m].data(), messages[m].size(),
+                                                     delta, serial_str);
+      }
+    }
+    thread_updates[thr_id] = num_updates;
+    free(delta_buffer);
+    free(delta);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) threads.emplace_back(replay_task, t);
+  for (auto &thr : threads) thr.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  size_t total_updates = 0;
+  for (size_t updates : thread_updates) total_updates += updates;
+  std::cout << "Updates:                " << total_updates << std::endl;
+  std::cout << "Seconds:                " << seconds << std::endl;
+  std::cout << "Updates/sec:            " << total_updates / seconds << std::endl;
+  std::cout << "Updates/sec/core:       " << total_updates / seconds / num_threads << std::endl;
+  std::cout << "Messages/sec:           " << messages.size() * passes / seconds << std::endl;
+}